@@ -0,0 +1,3 @@
+#
+# Main component makefile.
+#
@@ -0,0 +1,224 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/*
+ * Hammers the WiFi Manager's API from several tasks and dumps the lock
+ * profile afterwards. Needs the WMNGR_LOCK_PROFILE option.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+#include "esp_event.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "wifi_manager.h"
+
+static const char *TAG = "lock_stress";
+
+#define STRESS_TASKS    4
+#define STRESS_TIME     (60 * 1000 / portTICK_PERIOD_MS)
+#define STRESS_STACK    3072
+#define STRESS_PRIO     5
+
+enum stress_op {
+    stress_get_cfg = 0,
+    stress_set_cfg,
+    stress_get_scan,
+    stress_op_max,
+};
+
+static const char *stress_op_names[stress_op_max] = {
+    "get_cfg",
+    "set_cfg",
+    "get_scan",
+};
+
+struct stress_result {
+    uint32_t ok[stress_op_max];
+    uint32_t timeouts[stress_op_max];
+    uint32_t errors[stress_op_max];
+};
+
+static struct stress_result results[STRESS_TASKS];
+static EventGroupHandle_t done_events;
+
+static void count(struct stress_result *res, enum stress_op op,
+                  esp_err_t result)
+{
+    if(result == ESP_OK){
+        ++res->ok[op];
+    } else if(result == ESP_ERR_TIMEOUT){
+        ++res->timeouts[op];
+    } else {
+        ++res->errors[op];
+    }
+}
+
+/*
+ * Mostly read the config, now and then read the scan results or flip the
+ * AP channel, so the state machine keeps taking the lock, too.
+ */
+static void stress_task(void *arg)
+{
+    unsigned int idx, iter;
+    struct stress_result *res;
+    struct scan_data *scan;
+    struct wifi_cfg cfg;
+    TickType_t start;
+    esp_err_t result;
+
+    idx = (unsigned int) (uintptr_t) arg;
+    res = &results[idx];
+    start = xTaskGetTickCount();
+
+    for(iter = idx; (xTaskGetTickCount() - start) < STRESS_TIME; ++iter){
+        switch(iter % 16){
+        case 0:
+            result = esp_wmngr_get_cfg(&cfg);
+            if(result == ESP_OK){
+                cfg.ap.ap.channel = (cfg.ap.ap.channel == 1) ? 6 : 1;
+                result = esp_wmngr_set_cfg(&cfg);
+            }
+            count(res, stress_set_cfg, result);
+            break;
+        case 4:
+        case 12:
+            (void) esp_wmngr_start_scan();
+            scan = esp_wmngr_get_scan();
+            count(res, stress_get_scan, (scan != NULL) ? ESP_OK : ESP_FAIL);
+            if(scan != NULL){
+                esp_wmngr_put_scan(scan);
+            }
+            break;
+        default:
+            result = esp_wmngr_get_cfg(&cfg);
+            count(res, stress_get_cfg, result);
+            break;
+        }
+
+        /* Give lower priority tasks, e.g. the idle task, a chance to run. */
+        if((iter % 64) == 63){
+            vTaskDelay(1);
+        }
+    }
+
+    xEventGroupSetBits(done_events, 1u << idx);
+    vTaskDelete(NULL);
+}
+
+static void dump_results(void)
+{
+    unsigned int idx, op;
+
+    printf("\ntask op         ok    timeout  error\n");
+    for(idx = 0; idx < STRESS_TASKS; ++idx){
+        for(op = 0; op < stress_op_max; ++op){
+            printf("%4u %-8s %8u %8u %8u\n", idx, stress_op_names[op],
+                   results[idx].ok[op], results[idx].timeouts[op],
+                   results[idx].errors[op]);
+        }
+    }
+}
+
+static void dump_hist(const char *name, const uint32_t *hist)
+{
+    unsigned int idx;
+
+    printf("  %-5s", name);
+    for(idx = 0; idx < WMNGR_HIST_BUCKETS; ++idx){
+        printf(" %7u", hist[idx]);
+    }
+    printf("\n");
+}
+
+static void dump_lock_stats(void)
+{
+    struct wmngr_lock_stats stats;
+    struct wmngr_lock_site_stats *site;
+    unsigned int idx;
+    esp_err_t result;
+
+    result = esp_wmngr_get_lock_stats(&stats, false);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Lock profile not available: %s",
+                 __func__, esp_err_to_name(result));
+        return;
+    }
+
+    printf("\nLock profile, histogram buckets start at %u us and double\n",
+           WMNGR_HIST_LOCK_US);
+    for(idx = 0; idx < wmngr_lock_max; ++idx){
+        site = &(stats.site[idx]);
+        printf("%s: timeouts %u, max wait %u us, max hold %u us\n",
+               wmngr_lock_site_names[idx], site->timeouts,
+               site->max_wait_us, site->max_hold_us);
+        dump_hist("wait", site->wait);
+        dump_hist("hold", site->hold);
+    }
+}
+
+void app_main(void)
+{
+    struct wmngr_lock_stats stats;
+    unsigned int idx;
+    esp_err_t result;
+
+    result = nvs_flash_init();
+    if(result == ESP_ERR_NVS_NO_FREE_PAGES
+       || result == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        result = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(result);
+
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    ESP_ERROR_CHECK(esp_wmngr_init());
+    ESP_ERROR_CHECK(esp_wmngr_start());
+
+    done_events = xEventGroupCreate();
+    configASSERT(done_events != NULL);
+
+    /* Only profile the stress run. */
+    (void) esp_wmngr_get_lock_stats(&stats, true);
+
+    ESP_LOGI(TAG, "[%s] Starting %u tasks for %u ms.", __func__,
+             STRESS_TASKS, STRESS_TIME * portTICK_PERIOD_MS);
+
+    for(idx = 0; idx < STRESS_TASKS; ++idx){
+        if(xTaskCreate(&stress_task, "stress", STRESS_STACK,
+                       (void *) (uintptr_t) idx, STRESS_PRIO, NULL) != pdPASS)
+        {
+            ESP_LOGE(TAG, "[%s] Creating task %u failed.", __func__, idx);
+            xEventGroupSetBits(done_events, 1u << idx);
+        }
+    }
+
+    (void) xEventGroupWaitBits(done_events, (1u << STRESS_TASKS) - 1,
+                               pdFALSE, pdTRUE, portMAX_DELAY);
+
+    dump_results();
+    dump_lock_stats();
+}
@@ -40,6 +40,24 @@ static inline void kref_get(struct kref *kref)
     configASSERT(old >= 1);
 }
 
+/*
+ * Take a reference unless the count has already dropped to zero, i.e. the
+ * object is about to be released. Returns non-zero if a reference was taken.
+ */
+static inline int kref_get_unless_zero(struct kref *kref)
+{
+    int old;
+
+    old = atomic_load(&(kref->count));
+    do{
+        if(old == 0){
+            return 0;
+        }
+    } while(!atomic_compare_exchange_weak(&(kref->count), &old, old + 1));
+
+    return 1;
+}
+
 static inline int kref_put(struct kref *kref, void (*release)(struct kref *kref))
 {
     int result;
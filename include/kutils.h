@@ -48,7 +48,7 @@
 #define time_after(a, b)            \
     (typecheck(unsigned int, a) &&  \
      typecheck(unsigned int, b) &&  \
-     ((long)((b) - (a)) < 0))
+     ((int)((b) - (a)) < 0))
 #define time_before(a, b)       time_after(b, a)
 
 #define time_after_eq(a, b)         \
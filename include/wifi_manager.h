@@ -24,17 +24,84 @@
 /** @file */
 
 #include <stdbool.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
 #include "esp_err.h"
 #include "esp_wifi_types.h"
 #include "esp_netif.h"
+#include "esp_event.h"
+
+/** Time stamps of an AP in a set of scan data. */
+struct scan_age {
+    TickType_t first_seen;          //!< Timestamp in FreeRTOS ticks of first sighting
+    TickType_t last_seen;           //!< Timestamp in FreeRTOS ticks of last sighting
+};
+
+#define SCAN_AP_PHY_11B     (1 << 0)    //!< AP supports 802.11b
+#define SCAN_AP_PHY_11G     (1 << 1)    //!< AP supports 802.11g
+#define SCAN_AP_PHY_11N     (1 << 2)    //!< AP supports 802.11n
+#define SCAN_AP_PHY_LR      (1 << 3)    //!< AP supports low rate mode
+#define SCAN_AP_WPS         (1 << 4)    //!< AP supports WPS
+
+/** Compact AP record, holding the commonly used parts of a wifi_ap_record_t. */
+struct scan_ap {
+    uint8_t ssid[33];               //!< SSID of AP, NUL terminated
+    uint8_t bssid[6];               //!< BSSID of AP
+    int8_t rssi;                    //!< Signal strength of AP
+    uint8_t primary;                //!< Primary channel of AP
+    uint8_t authmode;               //!< Authentication mode, a wifi_auth_mode_t
+    uint8_t phy_flags;              //!< Combination of SCAN_AP_* flags
+};
 
 /** A set of AP scan data. */
 struct scan_data {
     TickType_t tstamp;              //!< Timestamp in FreeRTOS ticks at creation
-    wifi_ap_record_t *ap_records;   //!< Array of AP data entries
+    struct scan_ap *aps;            //!< Array of compact AP data entries
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+    wifi_ap_record_t *ap_records;   //!< Array of full AP data entries
+#endif
+    struct scan_age *ap_ages;       //!< Array of time stamps for AP data entries
     uint16_t num_records;           //!< Number of AP entries 
 };
 
+/** Get an AP entry from a set of scan data.
+ * @param[in] data Set of scan data.
+ * @param[in] idx Index of AP entry.
+ * @return Pointer to a #scan_ap or NULL if idx is out of range.
+ */
+static inline const struct scan_ap *scan_data_get_ap(
+                                            const struct scan_data *data,
+                                            unsigned int idx)
+{
+    return (idx < data->num_records) ? &(data->aps[idx]) : NULL;
+}
+
+/** Parameters used for AP scans. */
+struct scan_cfg {
+    bool passive;           //!< Use passive instead of active scans
+    uint32_t dwell_time;    //!< Time in ms spent on each channel, 0 for driver default
+    uint8_t slice_chans;    //!< Channels scanned per slice, 0 to scan all channels at once
+    uint32_t home_time;     //!< Time in ms spent on the home channel between slices
+};
+
+/** Counters of NVS write operations. */
+struct wmngr_flash_stats {
+    uint32_t saves;         //!< Config slots written to NVS
+    uint32_t skipped;       //!< Slot writes skipped because config was unchanged
+    uint32_t coalesced;     //!< Save requests merged into a pending save
+    uint32_t fast_writes;   //!< Fast connect records written or erased
+    uint32_t erases;        //!< Times the stored config was erased
+    uint32_t failures;      //!< Failed slot writes
+};
+
+/** Description of the configuration stored in NVS. */
+struct wmngr_nvs_info {
+    bool present;           //!< A valid configuration is stored in NVS
+    uint32_t version;       //!< Storage format version of the stored configuration
+    uint32_t generation;    //!< Incremented every time the configuration is written
+    uint32_t checksum;      //!< CRC32 of the stored configuration, 0 for version 1
+};
+
 /** States used during WiFi (re)configuration. */
 enum wmngr_state {
     /* "stable" states */
@@ -51,12 +118,149 @@ enum wmngr_state {
     wmngr_state_connecting,     //!< Device is trying to connect to AP
     wmngr_state_disconnecting,  //!< Disconnect from AP has been triggered
     wmngr_state_fallback,       //!< Connection failed, falling back to previous config
+
+    /* stable, appended to keep the numbering of the states above */
+    wmngr_state_reconnecting,   //!< Connection to AP lost, waiting to reconnect
     wmngr_state_max,            //!< Number of states
 };
 
 /** Array of strings describing current state. */
 extern const char *wmngr_state_names[wmngr_state_max];
 
+/** Number of buckets in the histograms of #wmngr_stats. */
+#define WMNGR_HIST_BUCKETS      8
+/** Unit of the scan duration histogram in ms. */
+#define WMNGR_HIST_SCAN_MS      250
+
+/**
+ * Runtime statistics.
+ *
+ * Bucket 0 of a histogram counts values below one unit, bucket n values
+ * below unit << n. The last bucket also counts all larger values.
+ */
+struct wmngr_stats {
+    uint64_t state_ms[wmngr_state_max]; //!< Cumulative time spent in each state
+    uint32_t entries[wmngr_state_max];  //!< Number of transitions into each state
+    uint32_t transitions;               //!< Total number of state transitions
+    uint32_t conn_lost;                 //!< Times the connection to the AP was lost
+    uint32_t reconnects;                //!< Reconnect attempts
+    uint32_t assoc_ip_count;            //!< Number of association to IP measurements
+    uint32_t assoc_ip_last_ms;          //!< Last time from association to IP address
+    uint32_t assoc_ip_max_ms;           //!< Longest time from association to IP address
+    uint32_t assoc_ip_total_ms;         //!< Sum of all association to IP times
+    uint32_t scan_ms[WMNGR_HIST_BUCKETS];  //!< Durations of full scans or sliced sweeps, unit WMNGR_HIST_SCAN_MS
+    uint32_t scan_aps[WMNGR_HIST_BUCKETS]; //!< APs found per full scan or sliced sweep, unit 1
+};
+
+/** Unit of the lock profile histograms in us. */
+#define WMNGR_HIST_LOCK_US      250
+
+/** Places where the WiFi Manager's lock is taken. */
+enum wmngr_lock_site {
+    wmngr_lock_submit_cfg = 0,
+    wmngr_lock_set_connect,
+    wmngr_lock_handle_wifi,
+    wmngr_lock_worker,
+    wmngr_lock_start,
+    wmngr_lock_stop,
+    wmngr_lock_wait_ticket,
+    wmngr_lock_start_wps,
+    wmngr_lock_set_scan_cfg,
+    wmngr_lock_get_scan_cfg,
+    wmngr_lock_get_nvs_info,
+    wmngr_lock_get_flash_stats,
+    wmngr_lock_reset_cfg,
+    wmngr_lock_max,             //!< Number of call sites
+};
+
+/** Array of strings naming the lock call sites. */
+extern const char *wmngr_lock_site_names[wmngr_lock_max];
+
+/** Lock profile of a single call site. Histograms as in #wmngr_stats. */
+struct wmngr_lock_site_stats {
+    uint32_t wait[WMNGR_HIST_BUCKETS]; //!< Time waited for the lock, unit WMNGR_HIST_LOCK_US
+    uint32_t hold[WMNGR_HIST_BUCKETS]; //!< Time the lock was held, unit WMNGR_HIST_LOCK_US
+    uint32_t timeouts;                 //!< Times the lock could not be taken
+    uint32_t max_wait_us;              //!< Longest time waited for the lock
+    uint32_t max_hold_us;              //!< Longest time the lock was held
+};
+
+/** Contention profile of the WiFi Manager's lock. */
+struct wmngr_lock_stats {
+    struct wmngr_lock_site_stats site[wmngr_lock_max]; //!< Per call site
+};
+
+/** Kinds of trace records. */
+enum wmngr_trace_kind {
+    wmngr_trace_boot = 0,       //!< WiFi Manager initialised, err is the reset reason
+    wmngr_trace_state,          //!< State transition
+    wmngr_trace_event,          //!< System event, err is the event id
+    wmngr_trace_error,          //!< State machine run failed, err is the error
+};
+
+/** Record of the trace ring buffer. */
+struct wmngr_trace_rec {
+    uint32_t seq;               //!< Sequence number of the record, starting at 1
+    uint32_t tick;              //!< Tick count when the record was written
+    uint8_t kind;               //!< Kind of record, #wmngr_trace_kind
+    uint8_t old_state;          //!< State before a transition
+    uint8_t new_state;          //!< State after a transition
+    uint8_t base;               //!< Base of system events, 0: WIFI_EVENT, 1: IP_EVENT
+    uint32_t events;            //!< Internal event bits
+    int32_t err;                //!< Error code or event id
+};
+
+/** Bit representing a state in masks passed to #esp_wmngr_wait_state(). */
+#define WMNGR_STATE_BIT(state)  (1UL << (state))
+
+/** Base of the events posted by the WiFi Manager. */
+ESP_EVENT_DECLARE_BASE(WMNGR_EVENT);
+
+/** Events posted by the WiFi Manager. */
+enum wmngr_event {
+    WMNGR_EVENT_STATE_CHANGED,  //!< State has changed, data is a #wmngr_event_state
+};
+
+/** Data of #WMNGR_EVENT_STATE_CHANGED events. */
+struct wmngr_event_state {
+    enum wmngr_state old_state; //!< State before the change
+    enum wmngr_state new_state; //!< State after the change
+};
+
+/** Public API functions instrumented for stack usage. */
+enum wmngr_api {
+    wmngr_api_init = 0,
+    wmngr_api_start,
+    wmngr_api_stop,
+    wmngr_api_set_cfg,
+    wmngr_api_get_cfg,
+    wmngr_api_reset_cfg,
+    wmngr_api_start_wps,
+    wmngr_api_start_scan,
+    wmngr_api_connect,
+    wmngr_api_disconnect,
+    wmngr_api_max,              //!< Number of instrumented functions
+};
+
+/** Array of strings naming the instrumented API functions. */
+extern const char *wmngr_api_names[wmngr_api_max];
+
+/** Length of task names in #wmngr_stack_rec. */
+#define WMNGR_TASK_NAME_LEN     16
+
+/** Deepest stack use measured for a code path. */
+struct wmngr_stack_rec {
+    uint32_t depth;                  //!< Stack used by the path in bytes, 0 if not run yet
+    uint32_t free;                   //!< Free stack left in the task during that run
+    char task[WMNGR_TASK_NAME_LEN];  //!< Name of the task the path ran in
+};
+
+/** Stack use per code path. */
+struct wmngr_stack_stats {
+    struct wmngr_stack_rec state[wmngr_state_max]; //!< Per state handler of the state machine
+    struct wmngr_stack_rec api[wmngr_api_max];     //!< Per public API function
+};
+
 /*
  * Holds complete WiFi config for both STA and AP, the mode and whether
  * the WiFi should connect to an AP in STA or APSTA mode.
@@ -83,16 +287,33 @@ esp_err_t esp_wmngr_init(void);
 esp_err_t esp_wmngr_start(void);
 esp_err_t esp_wmngr_stop(void);
 esp_err_t esp_wmngr_start_scan(void);
+esp_err_t esp_wmngr_set_scan_cfg(const struct scan_cfg *cfg);
+esp_err_t esp_wmngr_get_scan_cfg(struct scan_cfg *cfg);
 struct scan_data *esp_wmngr_get_scan(void);
 void esp_wmngr_put_scan(struct scan_data *data);
 esp_err_t esp_wmngr_set_cfg(struct wifi_cfg *cfg);
+esp_err_t esp_wmngr_submit_cfg(const struct wifi_cfg *cfg, uint32_t *ticket);
+esp_err_t esp_wmngr_wait_ticket(uint32_t ticket, TickType_t timeout);
 esp_err_t esp_wmngr_get_cfg(struct wifi_cfg *cfg);
+const struct wifi_cfg *esp_wmngr_get_cfg_snap(uint32_t *gen);
+void esp_wmngr_put_cfg_snap(const struct wifi_cfg *cfg);
+uint32_t esp_wmngr_get_cfg_gen(void);
 esp_err_t esp_wmngr_reset_cfg(void);
 esp_err_t esp_wmngr_start_wps(void);
 bool esp_wmngr_is_connected(void);
 esp_err_t esp_wmngr_connect(void);
 esp_err_t esp_wmngr_disconnect(void);
 enum wmngr_state esp_wmngr_get_state(void);
+esp_err_t esp_wmngr_wait_state(uint32_t mask, TickType_t timeout);
 bool esp_wmngr_nvs_valid(void);
+esp_err_t esp_wmngr_get_nvs_info(struct wmngr_nvs_info *info);
+esp_err_t esp_wmngr_get_flash_stats(struct wmngr_flash_stats *stats);
+uint32_t esp_wmngr_get_timer_max(void);
+uint32_t esp_wmngr_get_run_count(void);
+esp_err_t esp_wmngr_get_stack_stats(struct wmngr_stack_stats *stats);
+esp_err_t esp_wmngr_get_stats(struct wmngr_stats *stats);
+esp_err_t esp_wmngr_get_lock_stats(struct wmngr_lock_stats *stats, bool clear);
+size_t esp_wmngr_get_trace(struct wmngr_trace_rec *recs, size_t max);
+void esp_wmngr_dump_trace(void);
 
 #endif // ESP_WIFI_MANAGER_H
@@ -33,6 +33,9 @@
 #include "esp_wifi.h"
 #include "esp_wps.h"
 #include "esp_err.h"
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 //#define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
 #include "esp_log.h"
@@ -47,7 +50,13 @@
 static const char *TAG = "wifimngr";
 
 #define WMNGR_NAMESPACE "esp_wmngr"
-#define NVS_CFG_VER     1
+#define NVS_CFG_VER     2
+#define NVS_CFG_VER_LEGACY  1
+#define NVS_SLOTS       2
+#define NVS_SLOT_NONE   0xff
+#define NVS_SLOT_KEY    "cfg_slot"
+#define NVS_SLOT_MAGIC  0x46434d57 /* "WMCF" */
+#define NVS_TLV_MAX     384
 
 #define MAX_AP_CLIENTS  3
 #define MAX_NUM_APS     32
@@ -55,22 +64,277 @@ static const char *TAG = "wifimngr";
 #define CFG_TIMEOUT     (60 * 1000 / portTICK_PERIOD_MS)
 #define CFG_TICKS       (1000 / portTICK_PERIOD_MS)
 #define CFG_DELAY       (100 / portTICK_PERIOD_MS)
+#define SCAN_MAX_AGE    (CONFIG_WMNGR_SCAN_MAX_AGE * 1000 / portTICK_PERIOD_MS)
+#define SCAN_SLABS      CONFIG_WMNGR_SCAN_SLABS
+#define SCAN_MAX_CHAN   14
+#define RECONNECT_BASE  CONFIG_WMNGR_RECONNECT_BASE
+#define RECONNECT_MAX   CONFIG_WMNGR_RECONNECT_MAX
+#define RECONNECT_LIGHT CONFIG_WMNGR_RECONNECT_LIGHT
+
+#define SAVE_DELAY      (CONFIG_WMNGR_SAVE_DELAY / portTICK_PERIOD_MS)
+/* Replaced snapshots that may still be in use by readers. */
+#define SNAP_RETIRED    2
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+#define SNAP_PINNED     CONFIG_WMNGR_SNAP_PINNED
+#else
+#define SNAP_PINNED     0
+#endif
+/*
+ * saved, current, new, queued, submitted, two temporaries, retired
+ * snapshots and snapshots pinned by esp_wmngr_get_cfg_snap() callers
+ */
+#define CFG_OBJS        (7 + SNAP_RETIRED + SNAP_PINNED)
 
+#if defined(CONFIG_WMNGR_FAST_CONNECT)
+#define FAST_TIMEOUT    (CONFIG_WMNGR_FAST_CONNECT_TIMEOUT / portTICK_PERIOD_MS)
+#else
+#define FAST_TIMEOUT    0
+#endif
+
+/*
+ * A scan slab. Slabs are taken from a fixed pool and handed back to it
+ * when the last reference to their data is dropped.
+ */
 struct scan_data_ref {
     struct kref ref_cnt;
-    uint32_t status;
+    atomic_bool in_use; /* Slab has been handed out. */
     struct scan_data data;
 };
 
+/* An AP in the scan table. */
+struct scan_entry {
+    struct scan_ap ap;
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+    wifi_ap_record_t record;
+#endif
+    TickType_t first_seen;
+    TickType_t last_seen;
+};
+
+/*
+ * Results of all recent scans, merged by BSSID. Only accessed by
+ * wifi_scan_done(), users get reference counted snapshots of it.
+ */
+struct scan_table {
+    struct scan_entry *entries; /* Table of MAX_NUM_APS entries. */
+    uint16_t num_entries;
+    wifi_ap_record_t *fetch; /* Buffer of MAX_NUM_APS for fetching records. */
+    struct scan_data_ref *slabs; /* Pool of SCAN_SLABS scan data sets. */
+};
+
+/* State of a channel-by-channel scan sweep. */
+struct scan_sched {
+    bool active; /* Sweep in progress, more channels left to scan. */
+    uint8_t next_chan; /* Next channel to scan. */
+    uint8_t last_chan; /* Last channel of the sweep. */
+    uint8_t slice_left; /* Channels left to scan in current slice. */
+    TickType_t next_slice; /* Timestamp when the next slice is due. */
+    uint16_t found; /* APs found by the slices scanned so far. */
+};
+
+/* Fast connect data as stored in NVS. */
+struct fast_connect_nvs {
+    uint8_t ssid[32]; /* SSID the BSSID belongs to. */
+    uint8_t bssid[6]; /* BSSID of last AP we were associated with. */
+    uint8_t channel; /* Primary channel of that AP. */
+};
+
+/* Cached data for connecting directly to the last known AP. */
+struct fast_connect {
+    struct fast_connect_nvs data;
+    bool valid; /* Data may be used for connecting. */
+    bool active; /* STA config in WiFi driver was set up from the data. */
+    bool dirty; /* Data differs from what is stored in NVS. */
+};
+
+/*
+ * A reference counted configuration. Once an object has been stored in
+ * cfg_state it must not be modified any more. This allows saved, current
+ * and new to share a single object most of the time and readers to use it
+ * as a snapshot without holding the lock.
+ */
+struct cfg_obj {
+    struct kref ref_cnt;
+    uint32_t gen; /* Unique, increasing number assigned on allocation. */
+    struct wifi_cfg cfg;
+};
+
+/* Slow operations that can be handed off to the worker task. */
+enum wmngr_job {
+    wmngr_job_none = 0,
+    wmngr_job_apply,        /* set_wifi_cfg() applying changes only */
+    wmngr_job_apply_full,   /* set_wifi_cfg() reconfiguring everything */
+    wmngr_job_save,         /* save_config() */
+};
+
+/* Job slot shared by the state machine and the worker task. */
+struct worker_job {
+    enum wmngr_job type;
+    struct cfg_obj *obj; /* Config the job operates on, referenced. */
+    bool done; /* Job has been run, result is valid. */
+    esp_err_t result;
+};
+
+/*
+ * Mailbox for config changes requested while a change is in progress.
+ * Each request gets a ticket. Only the latest request is kept, it
+ * supersedes any request still waiting in the mailbox. The results of the
+ * last CMD_RESULTS completed requests are kept for esp_wmngr_wait_ticket().
+ */
+#define CMD_RESULTS     8
+/* Result of a request that was replaced by a later one before finishing. */
+#define CMD_SUPERSEDED  ESP_ERR_INVALID_STATE
+
+struct cmd_result {
+    uint32_t ticket; /* 0 if unused. */
+    esp_err_t result;
+};
+
+struct cmd_queue {
+    struct cfg_obj *obj; /* Latest config waiting to be applied, referenced. */
+    uint32_t queued; /* Ticket of obj. */
+    uint32_t active; /* Ticket of the config being applied, 0 if none. */
+    uint32_t issued; /* Last ticket handed out. */
+    struct cmd_result results[CMD_RESULTS]; /* Ring of completed requests. */
+    unsigned int next; /* Slot in results to be used next. */
+};
+
+/* Ticket comparison, safe against wrap-around. */
+#define ticket_after(a, b)      ((int32_t)((b) - (a)) < 0)
+
+/*
+ * Description of the config stored in NVS. Kept up to date by loading,
+ * saving and clearing the config, so it can be queried without accessing
+ * the flash.
+ */
+struct nvs_cfg_desc {
+    bool present; /* A valid config is stored in NVS. */
+    uint32_t version; /* Storage format version of that config. */
+    uint8_t slot; /* Slot holding the config or NVS_SLOT_NONE. */
+    uint32_t seq; /* Sequence number of that slot. */
+    uint32_t crc; /* Checksum of the slot's payload. */
+};
+
+/* Header of a config slot as stored in NVS. */
+struct nvs_slot_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq; /* Incremented with every save. */
+    uint32_t crc; /* CRC32 over the remainder of the slot's blob. */
+};
+
+/*
+ * Version 2 slot. The config is stored as a sequence of records, each
+ * made up of a one byte tag, a one byte length and the value. Only the
+ * used part of data[] is written to NVS.
+ */
+struct nvs_cfg_slot {
+    struct nvs_slot_hdr hdr;
+    uint8_t data[NVS_TLV_MAX];
+};
+
+union nvs_slot_buf {
+    struct nvs_slot_hdr hdr;
+    struct nvs_cfg_slot slot;
+};
+
+/* Tags of the records in a version 2 slot. Values must never change. */
+enum cfg_tag {
+    cfg_tag_mode = 0x01,
+    cfg_tag_sta_static,
+    cfg_tag_sta_connect,
+    cfg_tag_ap_ssid = 0x10,
+    cfg_tag_ap_pass,
+    cfg_tag_ap_chan,
+    cfg_tag_ap_auth,
+    cfg_tag_ap_hidden,
+    cfg_tag_ap_max_conn,
+    cfg_tag_ap_beacon,
+    cfg_tag_ap_ip,
+    cfg_tag_sta_ssid = 0x20,
+    cfg_tag_sta_pass,
+    cfg_tag_sta_bssid,
+    cfg_tag_sta_chan,
+    cfg_tag_sta_scan,
+    cfg_tag_sta_listen,
+    cfg_tag_sta_sort,
+    cfg_tag_sta_thresh,
+    cfg_tag_sta_pmf,
+    cfg_tag_sta_ip,
+    cfg_tag_sta_dns,
+};
+
+/* Buffer for encoding TLV records. */
+struct tlv_buf {
+    uint8_t *data;
+    size_t size;
+    size_t len;
+    bool overflow; /* A record did not fit into the buffer. */
+};
+
+static const char *nvs_slot_keys[NVS_SLOTS] = {"cfg_a", "cfg_b"};
+
+/* Keys used by the version 1 layout. */
+static const char *nvs_legacy_keys[] = {
+    "version", "mode", "sta_static", "sta_connect",
+    "ap", "sta", "ap_ip", "sta_ip", "sta_dns"
+};
+
+/* Parts of the system affected by a config change. */
+#define CFG_CHG_NETIF           BIT0 /* STA IP and DNS settings */
+#define CFG_CHG_STA             BIT1 /* STA WiFi config and connect flag */
+#define CFG_CHG_AP              BIT2 /* AP WiFi config */
+#define CFG_CHG_MODE            BIT3 /* WiFi mode, needs driver restart */
+#define CFG_CHG_ALL             (CFG_CHG_NETIF | CFG_CHG_STA | CFG_CHG_AP \
+                                 | CFG_CHG_MODE)
+
 /* This holds all the state and configuration data needed at runtime. */
 struct wifi_cfg_state {
     SemaphoreHandle_t lock;
     TickType_t cfg_timestamp; /* Timestamp of last config change. */
     enum wmngr_state state;
-    struct wifi_cfg saved; /* Active config when _set_cfg() was last called. */
-    struct wifi_cfg current; /* Config that is currently being applied. */
-    struct wifi_cfg new; /* Config last set, might not have been applied yet.*/
-    struct scan_data_ref *scan_ref; /* Pointer to current AP scan data. */
+    struct cfg_obj *saved; /* Active config when _set_cfg() was last called. */
+    struct cfg_obj *current; /* Config that is currently being applied. */
+    struct cfg_obj *new; /* Config last set, might not have been applied yet.*/
+    /* Config snapshot handed to readers. Only written by publish_cfg(). */
+    _Atomic(struct cfg_obj *) snap;
+    atomic_uint snap_readers; /* Readers currently pinning snap. */
+    atomic_uint snap_gen; /* Generation of snap. */
+    atomic_uint snap_pinned; /* Snapshots held by API users. */
+    /* Replaced snapshots waiting to be released by snap_reclaim(). */
+    struct cfg_obj *snap_retired[SNAP_RETIRED];
+    unsigned int snap_num_retired;
+    /* Pointer to current AP scan data. Only written by wifi_scan_done(). */
+    _Atomic(struct scan_data_ref *) scan_ref;
+    atomic_uint scan_readers; /* Readers currently pinning scan_ref. */
+    struct scan_data_ref *scan_retired; /* Replaced, waiting for release. */
+    struct scan_table scan_table; /* Merged AP scan results. */
+    struct scan_cfg scan_cfg; /* Parameters used for AP scans. */
+    struct scan_sched scan_sched; /* State of running scan sweep. */
+    struct fast_connect fast; /* Last AP we successfully associated with. */
+    bool full_apply; /* Next update must reconfigure everything. */
+    unsigned int retries; /* Reconnect attempts since connection was lost. */
+    TickType_t retry_tstamp; /* Timestamp of next reconnect attempt. */
+    struct nvs_cfg_desc nvs; /* Config currently stored in NVS. */
+    bool save_pending; /* Saved config needs to be written to NVS. */
+    TickType_t save_tstamp; /* Timestamp when pending save is due. */
+    struct wmngr_flash_stats flash_stats;
+#if defined(CONFIG_WMNGR_WORKER)
+    struct worker_job job; /* Job handed to the worker task. */
+#endif
+    uint32_t timer_max_us; /* Longest run of the timer call back. */
+    uint32_t runs; /* Number of state machine runs. */
+    struct cmd_queue cmd; /* Config changes requested while busy. */
+#if defined(CONFIG_WMNGR_STATS)
+    struct wmngr_stats stats;
+    TickType_t state_tstamp; /* Time the current state was entered. */
+    TickType_t scan_tstamp; /* Time the running scan was started. */
+    TickType_t assoc_tstamp; /* Time of association with the AP. */
+    bool assoc_pending; /* Associated, waiting for an IP address. */
+#endif
+#if defined(CONFIG_WMNGR_STACK_STATS)
+    struct wmngr_stack_stats stack_stats;
+#endif
 };
 
 const char *wmngr_state_names[wmngr_state_max] = {
@@ -84,10 +348,54 @@ const char *wmngr_state_names[wmngr_state_max] = {
     "WPS Active",
     "Connecting",
     "Disconnecting",
-    "Fall Back"
+    "Fall Back",
+    "Reconnecting",
+};
+
+/*
+ * Stable states are the ones the state machine rests in until something
+ * happens. wmngr_state_reconnecting has been appended after the transitional
+ * states to keep the numbering of the public enum, so a range check on
+ * wmngr_state_idle is not enough.
+ */
+static bool state_is_stable(enum wmngr_state state)
+{
+    return state <= wmngr_state_idle || state == wmngr_state_reconnecting;
+}
+
+const char *wmngr_lock_site_names[wmngr_lock_max] = {
+    "submit_cfg",
+    "set_connect",
+    "handle_wifi",
+    "worker",
+    "start",
+    "stop",
+    "wait_ticket",
+    "start_wps",
+    "set_scan_cfg",
+    "get_scan_cfg",
+    "get_nvs_info",
+    "get_flash_stats",
+    "reset_cfg",
+};
+
+const char *wmngr_api_names[wmngr_api_max] = {
+    "init",
+    "start",
+    "stop",
+    "set_cfg",
+    "get_cfg",
+    "reset_cfg",
+    "start_wps",
+    "start_scan",
+    "connect",
+    "disconnect",
 };
 
-static struct wifi_cfg_state cfg_state = {.state = wmngr_state_deinit};
+static struct wifi_cfg_state cfg_state = {
+    .state = wmngr_state_deinit,
+    .nvs = {.slot = NVS_SLOT_NONE},
+};
 
 /* For keeping track of system events. */
 #define BIT_TRIGGER             BIT0
@@ -102,783 +410,3089 @@ static struct wifi_cfg_state cfg_state = {.state = wmngr_state_deinit};
 #define BIT_WPS_FAILED          BIT9
 #define BITS_WPS    (BIT_WPS_SUCCESS | BIT_WPS_FAILED)
 #define BIT_STOPPED             BIT10
+#define BIT_JOB                 BIT11
+#define BIT_CMD_DONE            BIT12
 
 static esp_netif_t* sta_netif = NULL;
 static esp_netif_t* ap_netif = NULL;
 
 static EventGroupHandle_t wifi_events = NULL;
 
+/* One bit per state, only the bit of the current state is set. */
+static EventGroupHandle_t state_events = NULL;
+#define STATE_BITS              (WMNGR_STATE_BIT(wmngr_state_max) - 1)
+
+ESP_EVENT_DEFINE_BASE(WMNGR_EVENT);
+
 static TimerHandle_t *config_timer = NULL;
 
-static void handle_timer(TimerHandle_t timer);
-static void event_handler(void* args, esp_event_base_t base,
-                          int32_t id, void* data);
-static esp_err_t get_saved_config(struct wifi_cfg *cfg);
+#if defined(CONFIG_WMNGR_TASK) && !defined(CONFIG_WMNGR_EVENT_DRIVEN)
+#define TIMER_RELOAD    pdTRUE
+#else
+#define TIMER_RELOAD    pdFALSE
+#endif
 
-/** Set configuration from compiled-in defaults.
+#if defined(CONFIG_WMNGR_STACK_STATS)
+/*
+ * Stack use is measured per path. Before the path runs, the unused part
+ * of the calling task's stack below the current stack pointer is painted
+ * with the fill byte FreeRTOS uses for new stacks. Afterwards, the lowest
+ * overwritten byte gives the depth the path reached. The area right below
+ * the painting function's frame is left alone, as it may be used for
+ * register spills, so depths below STACK_MARGIN are not resolved.
+ * Instrumented paths must not be nested.
  */
-static void set_defaults(struct wifi_cfg *cfg)
-{
-    ip4_addr_t tmp;
-    size_t len;
+#define STACK_PAINT     0xa5
+#define STACK_MARGIN    128
 
-    memset(cfg, 0x0, sizeof(*cfg));
-    cfg->is_default = true;
-    cfg->is_valid = true;
-    cfg->mode = WIFI_MODE_APSTA;
+static portMUX_TYPE stack_mux = portMUX_INITIALIZER_UNLOCKED;
 
-    if(!(ip4addr_aton(CONFIG_WMNGR_AP_IP, &tmp))){
-        ESP_LOGE(TAG, "[%s] Invalid default AP IP: %s. "
-                      "Using 192.168.4.1 instead.",
-                      __func__, CONFIG_WMNGR_AP_IP);
-        IP4_ADDR(&tmp, 192, 168, 4, 1);
-    }
-    cfg->ap_ip_info.ip.addr = tmp.addr;
+/* Lowest byte of the calling task's stack that has been written to. */
+static uint8_t *stack_lowest(uint8_t *top)
+{
+    volatile uint8_t *pos;
 
-    if(!(ip4addr_aton(CONFIG_WMNGR_AP_MASK, &tmp))){
-        ESP_LOGE(TAG, "[%s] Invalid default AP netmask: %s. "
-                      "Using 255.255.255.0 instead.",
-                      __func__, CONFIG_WMNGR_AP_MASK);
-        IP4_ADDR(&tmp, 255, 255, 255, 0);
+    pos = pxTaskGetStackStart(NULL);
+    while(pos < top && *pos == STACK_PAINT){
+        ++pos;
     }
-    cfg->ap_ip_info.netmask.addr = tmp.addr;
 
-    if(!(ip4addr_aton(CONFIG_WMNGR_AP_GW, &tmp))){
-        ESP_LOGE(TAG, "[%s] Invalid default AP GW: %s. "
-                      "Using 192.168.4.1 instead.",
-                      __func__, CONFIG_WMNGR_AP_GW);
-        IP4_ADDR(&tmp, 192, 168, 4, 1);
+    return (uint8_t *) pos;
+}
+
+/* Paint the unused stack and return the position measurements refer to. */
+static __attribute__((noinline)) uint8_t *stack_paint(void)
+{
+    volatile uint8_t *pos, *top;
+    uint8_t *ref;
+
+    ref = __builtin_frame_address(0);
+    top = ref - STACK_MARGIN;
+
+    /* Everything below the lowest written byte still holds the pattern. */
+    for(pos = stack_lowest((uint8_t *) top); pos < top; ++pos){
+        *pos = STACK_PAINT;
     }
-    cfg->ap_ip_info.gw.addr = tmp.addr;
 
-    len = strlen(CONFIG_WMNGR_AP_SSID);
-    if(len > 0 && len <= sizeof(cfg->ap.ap.ssid)){
-        memcpy(cfg->ap.ap.ssid, CONFIG_WMNGR_AP_SSID, len);
-    } else {
-        ESP_LOGE(TAG, "[%s] Invalid default AP SSID: %s. "
-                      "Using \"ESP WiFi Manager\" instead.",
-                      __func__, CONFIG_WMNGR_AP_SSID);
+    return ref;
+}
 
-        len = MIN(strlen("ESP WiFi Manager"), sizeof(cfg->ap.ap.ssid));
-        memcpy(cfg->ap.ap.ssid, "ESP WiFi Manager", len);
+/* Record the depth reached since stack_paint() returned ref. */
+static void stack_record(struct wmngr_stack_rec *rec, uint8_t *ref)
+{
+    uint8_t *start, *lowest;
+    uint32_t depth;
+
+    start = pxTaskGetStackStart(NULL);
+    lowest = stack_lowest(ref - STACK_MARGIN);
+    depth = ref - lowest;
+
+    portENTER_CRITICAL(&stack_mux);
+    if(depth > rec->depth){
+        rec->depth = depth;
+        rec->free = lowest - start;
+        snprintf(rec->task, sizeof(rec->task), "%s", pcTaskGetTaskName(NULL));
     }
-    cfg->ap.ap.ssid_len = len;
+    portEXIT_CRITICAL(&stack_mux);
 }
 
-/* Free scan data, should only be called through kref_put(). */
-static void free_scan_data(struct kref *ref)
+#define STACK_ENTER()                                                   \
+            uint8_t *stack_ref = stack_paint()
+#define STACK_LEAVE(func)                                               \
+            stack_record(&(cfg_state.stack_stats.api[(func)]), stack_ref)
+#define STACK_ENTER_STATE()                                             \
+            enum wmngr_state stack_state = cfg_state.state;             \
+            STACK_ENTER()
+#define STACK_LEAVE_STATE()                                             \
+            stack_record(&(cfg_state.stack_stats.state[stack_state]),   \
+                         stack_ref)
+#else
+#define STACK_ENTER()           do{}while(0)
+#define STACK_LEAVE(func)       do{}while(0)
+#define STACK_ENTER_STATE()     do{}while(0)
+#define STACK_LEAVE_STATE()     do{}while(0)
+#endif /* defined(CONFIG_WMNGR_STACK_STATS) */
+
+#if defined(CONFIG_WMNGR_STATS) || defined(CONFIG_WMNGR_LOCK_PROFILE)
+/*
+ * Histogram bucket for a value. Bucket 0 holds values below one unit,
+ * bucket n values below unit << n. The last bucket takes the rest.
+ */
+static unsigned int hist_bucket(uint32_t val, uint32_t unit)
 {
-    struct scan_data_ref *data;
+    unsigned int idx;
 
-    data = container_of(ref, struct scan_data_ref, ref_cnt);
-    free(data->data.ap_records);
-    free(data);
+    val /= unit;
+    for(idx = 0; val > 0 && idx < WMNGR_HIST_BUCKETS - 1; ++idx){
+        val >>= 1;
+    }
+
+    return idx;
 }
+#endif
 
-/** Fetch the latest AP scan data and make it available.
- * Fetch the latest set of AP scan results and make them available to the
- * users. The SCAN_RUNNING and SCAN_DONE flags will be cleared on success or
- * unrecoverable error.
+#if defined(CONFIG_WMNGR_STATS)
+/*
+ * Runtime statistics. They get updated from the state machine as well as
+ * from the event handler, so a spinlock keeps them consistent.
  */
-static void wifi_scan_done(void)
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif /* defined(CONFIG_WMNGR_STATS) */
+
+static void stats_state(enum wmngr_state old, enum wmngr_state new)
 {
-    uint16_t num_aps;
-    struct scan_data_ref *old, *new;
-    esp_err_t result;
+#if defined(CONFIG_WMNGR_STATS)
+    TickType_t now;
 
-    result = ESP_OK;
-    new = NULL;
+    now = xTaskGetTickCount();
 
-    /* cgiWifiSetup() must have been called prior to this point. */
-    configASSERT(cfg_state.lock != NULL);
+    portENTER_CRITICAL(&stats_mux);
+    cfg_state.stats.state_ms[old] += (uint64_t) (now - cfg_state.state_tstamp)
+                                        * portTICK_PERIOD_MS;
+    cfg_state.state_tstamp = now;
+    ++cfg_state.stats.entries[new];
+    ++cfg_state.stats.transitions;
+    portEXIT_CRITICAL(&stats_mux);
+#endif
+}
 
-    /* Fetch number of APs found. Bail out early if there is nothing to get. */
-    result = esp_wifi_scan_get_ap_num(&num_aps);
-    if(result != ESP_OK || num_aps == 0){
-        /* Something went seriously wrong, no point in trying again. */
-        ESP_LOGI(TAG, "Scan error or empty scan result");
-        xEventGroupClearBits(wifi_events, (BIT_SCAN_RUNNING | BIT_SCAN_DONE));
-        goto on_exit;
-    }
+static void stats_conn_lost(void)
+{
+#if defined(CONFIG_WMNGR_STATS)
+    portENTER_CRITICAL(&stats_mux);
+    ++cfg_state.stats.conn_lost;
+    portEXIT_CRITICAL(&stats_mux);
+#endif
+}
 
-    /*
-     * Limit number of records to fetch. Prevents possible DoS by tricking
-     * us into allocating storage for a very large amount of scan results.
-     */
-    if(num_aps > MAX_NUM_APS){
-        ESP_LOGI(TAG, "Limiting AP records to %d (Actually found %d)",
-                 MAX_NUM_APS, num_aps);
-        num_aps = MAX_NUM_APS;
-    }
+static void stats_reconnect(void)
+{
+#if defined(CONFIG_WMNGR_STATS)
+    portENTER_CRITICAL(&stats_mux);
+    ++cfg_state.stats.reconnects;
+    portEXIT_CRITICAL(&stats_mux);
+#endif
+}
 
-    /* Allocate and initialise memory for scan data and AP records. */
-    new = calloc(1, sizeof(*new));
-    if(new == NULL){
-        ESP_LOGE(TAG, "Out of memory creating scan data");
-        goto on_exit;
-    }
+/* Track the time from association with the AP until we got an IP. */
+static void stats_assoc(bool connected, bool got_ip)
+{
+#if defined(CONFIG_WMNGR_STATS)
+    TickType_t now;
+    uint32_t latency;
 
-    kref_init(&(new->ref_cnt)); // initialises ref_cnt to 1
-    new->data.ap_records = calloc(num_aps, sizeof(*(new->data.ap_records)));
-    if(new->data.ap_records == NULL){
-        ESP_LOGE(TAG, "Out of memory for fetching records");
-        goto on_exit;
+    now = xTaskGetTickCount();
+
+    portENTER_CRITICAL(&stats_mux);
+    if(connected){
+        cfg_state.assoc_tstamp = now;
+        cfg_state.assoc_pending = true;
+    } else if(got_ip && cfg_state.assoc_pending){
+        latency = (now - cfg_state.assoc_tstamp) * portTICK_PERIOD_MS;
+        cfg_state.stats.assoc_ip_last_ms = latency;
+        cfg_state.stats.assoc_ip_max_ms = MAX(cfg_state.stats.assoc_ip_max_ms,
+                                              latency);
+        cfg_state.stats.assoc_ip_total_ms += latency;
+        ++cfg_state.stats.assoc_ip_count;
+        cfg_state.assoc_pending = false;
+    } else {
+        cfg_state.assoc_pending = false;
     }
+    portEXIT_CRITICAL(&stats_mux);
+#endif
+}
 
-    /* Fetch actual AP scan data */
-    new->data.tstamp = xTaskGetTickCount();
-    new->data.num_records = num_aps;
-    result = esp_wifi_scan_get_ap_records(&(new->data.num_records),
-                                          new->data.ap_records);
+static void stats_scan_start(void)
+{
+#if defined(CONFIG_WMNGR_STATS)
+    cfg_state.scan_tstamp = xTaskGetTickCount();
+#endif
+}
 
-    /*
-     * Scan data has either been fetched or lost at this point, so
-     * clear flags irregardless of returned status.
-     */
-    xEventGroupClearBits(wifi_events, (BIT_SCAN_RUNNING | BIT_SCAN_DONE));
+static void stats_scan_done(uint16_t num_aps)
+{
+#if defined(CONFIG_WMNGR_STATS)
+    uint32_t duration;
 
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "Error getting scan results");
-        goto on_exit;
-    }
+    duration = (xTaskGetTickCount() - cfg_state.scan_tstamp)
+                    * portTICK_PERIOD_MS;
 
-    ESP_LOGI(TAG, "Scan done: found %d APs", num_aps);
+    portENTER_CRITICAL(&stats_mux);
+    ++cfg_state.stats.scan_ms[hist_bucket(duration, WMNGR_HIST_SCAN_MS)];
+    ++cfg_state.stats.scan_aps[hist_bucket(num_aps, 1)];
+    portEXIT_CRITICAL(&stats_mux);
+#endif
+}
 
-    /*
-     * Make new scan data available.
-     * The new data set will be assigned to the global pointer. Fetch
-     * another reference so it will not be freed on function exit.
-     */
-    kref_get(&(new->ref_cnt));
+#if defined(CONFIG_WMNGR_TRACE)
+#define TRACE_ENTRIES   CONFIG_WMNGR_TRACE_ENTRIES
+#define TRACE_MAGIC     0x54524d57
 
-    old = cfg_state.scan_ref;
-    cfg_state.scan_ref = new;
+_Static_assert((TRACE_ENTRIES & (TRACE_ENTRIES - 1)) == 0,
+               "WMNGR_TRACE_ENTRIES must be a power of two");
 
-    if(old != NULL){
-        /*
-         * Drop global reference to old data set so it will be freed
-         * when the last connection using it gets closed.
-         */
-        esp_wmngr_put_scan(&(old->data));
-    }
+/*
+ * Trace ring buffer. It lives in memory that is not initialised on boot,
+ * so the records leading up to a software reset or crash survive it.
+ * Writers claim a slot with an atomic increment of head and never wait.
+ * A record's seq gets written last and is one more than the index it was
+ * written for, so readers can detect records that are incomplete or have
+ * already been overwritten.
+ */
+static __NOINIT_ATTR struct {
+    uint32_t magic;
+    atomic_uint head;
+    struct wmngr_trace_rec recs[TRACE_ENTRIES];
+} trace_ring;
+
+/* Copy the record with index idx. Returns false if it is not available. */
+static bool trace_read(uint32_t idx, struct wmngr_trace_rec *rec)
+{
+    struct wmngr_trace_rec *src;
 
-on_exit:
-    /* Drop one reference to the new scan data. */
-    if(new != NULL){
-        esp_wmngr_put_scan(&(new->data));
+    src = &(trace_ring.recs[idx & (TRACE_ENTRIES - 1)]);
+
+    if(src->seq != idx + 1){
+        return false;
     }
+
+    atomic_thread_fence(memory_order_acquire);
+    memmove(rec, src, sizeof(*rec));
+    atomic_thread_fence(memory_order_acquire);
+
+    /* The writer might have lapped us while we were copying. */
+    return src->seq == rec->seq;
 }
+#endif /* defined(CONFIG_WMNGR_TRACE) */
 
-/** Start AP scan.
- */
-static void wifi_scan_start(void)
+static void trace_put(enum wmngr_trace_kind kind, enum wmngr_state old,
+                      enum wmngr_state new, uint8_t base, int32_t err)
 {
-    wifi_scan_config_t scan_cfg;
-    EventBits_t events;
-    wifi_mode_t mode;
-    esp_err_t result;
+#if defined(CONFIG_WMNGR_TRACE)
+    struct wmngr_trace_rec *rec;
+    uint32_t idx;
+
+    idx = atomic_fetch_add(&(trace_ring.head), 1);
+    rec = &(trace_ring.recs[idx & (TRACE_ENTRIES - 1)]);
+
+    rec->seq = 0;
+    atomic_thread_fence(memory_order_release);
+
+    rec->tick = xTaskGetTickCount();
+    rec->kind = kind;
+    rec->old_state = old;
+    rec->new_state = new;
+    rec->base = base;
+    rec->events = (wifi_events != NULL) ? xEventGroupGetBits(wifi_events) : 0;
+    rec->err = err;
+
+    atomic_thread_fence(memory_order_release);
+    rec->seq = idx + 1;
+#endif
+}
 
-    /*
-     * Make sure we do not try to start a scan while the WiFi config is
-     * in a transitional state. If we bail out here, the SCAN_START bit
-     * will be kept set and the scan will start once the WiFi config has
-     * settled down again.
-     */
-    if(cfg_state.state > wmngr_state_idle){
-        ESP_LOGI(TAG, "[%s] WiFi connecting, not starting scan.",
-                 __func__);
-        goto on_exit;
+/* Set up the trace buffer, keeping the records of the previous run. */
+static void trace_init(void)
+{
+#if defined(CONFIG_WMNGR_TRACE)
+    if(trace_ring.magic != TRACE_MAGIC){
+        memset(&trace_ring, 0x0, sizeof(trace_ring));
+        trace_ring.magic = TRACE_MAGIC;
     }
 
-    /* WiFi config is in a stable state, clear the SCAN_START bit. */
-    xEventGroupClearBits(wifi_events, BIT_SCAN_START);
+    trace_put(wmngr_trace_boot, wmngr_state_deinit, wmngr_state_deinit,
+              0, esp_reset_reason());
+#endif
+}
 
-    /* Check that we are in a suitable mode for scanning. */
-    result =  esp_wifi_get_mode(&mode);
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] Error fetching WiFi mode.", __func__);
-        goto on_exit;
-    }
+#if defined(CONFIG_WMNGR_LOCK_PROFILE)
+/*
+ * Contention profile of cfg_state.lock. Only the lock holder writes
+ * lock_tstamp, the spinlock protects the statistics from readers.
+ */
+static portMUX_TYPE lock_mux = portMUX_INITIALIZER_UNLOCKED;
+static struct wmngr_lock_stats lock_stats;
+static int64_t lock_tstamp;
+#endif /* defined(CONFIG_WMNGR_LOCK_PROFILE) */
 
-    if(mode != WIFI_MODE_APSTA && mode != WIFI_MODE_STA){
-        ESP_LOGE(TAG, "[%s] Invalid WiFi mode for scanning.", __func__);
-        goto on_exit;
-    }
+static void publish_cfg(void);
+static void scan_reclaim(void);
+
+/* Take cfg_state.lock, recording the wait time for the call site. */
+static BaseType_t cfg_lock(enum wmngr_lock_site site, TickType_t timeout)
+{
+#if defined(CONFIG_WMNGR_LOCK_PROFILE)
+    struct wmngr_lock_site_stats *stats;
+    int64_t start, now;
+    uint32_t wait;
+    BaseType_t status;
+
+    start = esp_timer_get_time();
+    status = xSemaphoreTake(cfg_state.lock, timeout);
+    now = esp_timer_get_time();
+    wait = (uint32_t) (now - start);
+
+    stats = &(lock_stats.site[site]);
+
+    portENTER_CRITICAL(&lock_mux);
+    if(status == pdTRUE){
+        ++stats->wait[hist_bucket(wait, WMNGR_HIST_LOCK_US)];
+        stats->max_wait_us = MAX(stats->max_wait_us, wait);
+    } else {
+        ++stats->timeouts;
+    }
+    portEXIT_CRITICAL(&lock_mux);
+
+    if(status == pdTRUE){
+        lock_tstamp = now;
+    }
+
+    return status;
+#else
+    return xSemaphoreTake(cfg_state.lock, timeout);
+#endif
+}
+
+/*
+ * Release cfg_state.lock, recording the hold time for the call site. Any
+ * config change made while holding the lock gets published to lock-free
+ * readers first.
+ */
+static void cfg_unlock(enum wmngr_lock_site site)
+{
+#if defined(CONFIG_WMNGR_LOCK_PROFILE)
+    struct wmngr_lock_site_stats *stats;
+    uint32_t hold;
+#endif
+
+    publish_cfg();
+    scan_reclaim();
+
+#if defined(CONFIG_WMNGR_LOCK_PROFILE)
+    hold = (uint32_t) (esp_timer_get_time() - lock_tstamp);
+    stats = &(lock_stats.site[site]);
+
+    portENTER_CRITICAL(&lock_mux);
+    ++stats->hold[hist_bucket(hold, WMNGR_HIST_LOCK_US)];
+    stats->max_hold_us = MAX(stats->max_hold_us, hold);
+    portEXIT_CRITICAL(&lock_mux);
+#endif
+
+    xSemaphoreGive(cfg_state.lock);
+}
+
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+/*
+ * Backing storage for everything that would otherwise be allocated from
+ * the heap. Access to nvs_bufs is serialised by cfg_state.lock.
+ */
+static struct {
+    StaticEventGroup_t events;
+    StaticEventGroup_t state_events;
+    StaticSemaphore_t lock;
+    StaticTimer_t timer;
+#if defined(CONFIG_WMNGR_TASK)
+    StaticTask_t task;
+    StackType_t task_stack[CONFIG_WMNGR_TASK_STACK];
+#endif
+#if defined(CONFIG_WMNGR_WORKER)
+    StaticTask_t worker;
+    StackType_t worker_stack[CONFIG_WMNGR_WORKER_STACK];
+#endif
+    struct scan_entry scan_entries[MAX_NUM_APS];
+    wifi_ap_record_t scan_fetch[MAX_NUM_APS];
+    struct scan_data_ref scan_slabs[SCAN_SLABS];
+    struct scan_ap scan_aps[SCAN_SLABS][MAX_NUM_APS];
+    struct scan_age scan_ages[SCAN_SLABS][MAX_NUM_APS];
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+    wifi_ap_record_t scan_records[SCAN_SLABS][MAX_NUM_APS];
+#endif
+    union nvs_slot_buf nvs_bufs[NVS_SLOTS];
+    struct cfg_obj cfg_objs[CFG_OBJS];
+} static_mem;
+#endif /* defined(CONFIG_WMNGR_STATIC_ALLOC) */
+
+static const esp_wps_config_t wps_config = WPS_CONFIG_INIT_DEFAULT(WPS_TYPE_PBC);
+
+static void handle_timer(TimerHandle_t timer);
+static void event_handler(void* args, esp_event_base_t base,
+                          int32_t id, void* data);
+
+/*
+ * Release a config object, should only be called through kref_put().
+ * Objects from the static pool are free once their count has dropped to 0.
+ */
+static void free_cfg_obj(struct kref *ref)
+{
+#if !defined(CONFIG_WMNGR_STATIC_ALLOC)
+    free(container_of(ref, struct cfg_obj, ref_cnt));
+#endif
+}
+
+/* Allocate a zeroed config object holding a single reference. */
+static struct cfg_obj *cfg_obj_alloc(void)
+{
+    static atomic_uint gen;
+    struct cfg_obj *obj;
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    unsigned int idx;
+    int unused;
+
+    obj = NULL;
+    for(idx = 0; idx < CFG_OBJS; ++idx){
+        unused = 0;
+        if(atomic_compare_exchange_strong(
+                            &(static_mem.cfg_objs[idx].ref_cnt.count),
+                            &unused, 1))
+        {
+            obj = &(static_mem.cfg_objs[idx]);
+            break;
+        }
+    }
+#else
+    obj = malloc(sizeof(*obj));
+    if(obj != NULL){
+        kref_init(&(obj->ref_cnt));
+    }
+#endif
+
+    if(obj == NULL){
+        ESP_LOGE(TAG, "[%s] Out of config objects.", __func__);
+        return NULL;
+    }
+
+    memset(&(obj->cfg), 0x0, sizeof(obj->cfg));
+    obj->gen = atomic_fetch_add(&gen, 1) + 1;
+
+    return obj;
+}
+
+/* Allocate a config object holding a copy of cfg. */
+static struct cfg_obj *cfg_obj_new(const struct wifi_cfg *cfg)
+{
+    struct cfg_obj *obj;
+
+    obj = cfg_obj_alloc();
+    if(obj != NULL){
+        memcpy(&(obj->cfg), cfg, sizeof(obj->cfg));
+    }
+
+    return obj;
+}
+
+static struct cfg_obj *cfg_obj_get(struct cfg_obj *obj)
+{
+    kref_get(&(obj->ref_cnt));
+
+    return obj;
+}
+
+static void cfg_obj_put(struct cfg_obj *obj)
+{
+    if(obj != NULL){
+        kref_put(&(obj->ref_cnt), free_cfg_obj);
+    }
+}
+
+/* Make *dst reference obj, dropping the reference to the previous object. */
+static void cfg_obj_set(struct cfg_obj **dst, struct cfg_obj *obj)
+{
+    struct cfg_obj *old;
+
+    old = *dst;
+    *dst = (obj != NULL) ? cfg_obj_get(obj) : NULL;
+    cfg_obj_put(old);
+}
+
+/*
+ * Mark the current config as applied successfully. The object may already
+ * be in use by lock-free readers, so the flag is set on a copy replacing
+ * it, which gets published when the lock is released. Must be called with
+ * cfg_state.lock held.
+ */
+static void cfg_mark_valid(void)
+{
+    struct cfg_obj *obj;
+
+    if(cfg_state.current->cfg.is_valid){
+        return;
+    }
+
+    obj = cfg_obj_new(&(cfg_state.current->cfg));
+    if(obj == NULL){
+        ESP_LOGW(TAG, "[%s] Config not marked as valid.", __func__);
+        return;
+    }
+
+    obj->cfg.is_valid = true;
+
+    if(cfg_state.new == cfg_state.current){
+        cfg_obj_set(&cfg_state.new, obj);
+    }
+
+    cfg_obj_set(&cfg_state.current, obj);
+    cfg_obj_put(obj);
+}
+
+/** Set configuration from compiled-in defaults.
+ */
+static void set_defaults(struct wifi_cfg *cfg)
+{
+    ip4_addr_t tmp;
+    size_t len;
+
+    memset(cfg, 0x0, sizeof(*cfg));
+    cfg->is_default = true;
+    cfg->is_valid = true;
+    cfg->mode = WIFI_MODE_APSTA;
+
+    if(!(ip4addr_aton(CONFIG_WMNGR_AP_IP, &tmp))){
+        ESP_LOGE(TAG, "[%s] Invalid default AP IP: %s. "
+                      "Using 192.168.4.1 instead.",
+                      __func__, CONFIG_WMNGR_AP_IP);
+        IP4_ADDR(&tmp, 192, 168, 4, 1);
+    }
+    cfg->ap_ip_info.ip.addr = tmp.addr;
+
+    if(!(ip4addr_aton(CONFIG_WMNGR_AP_MASK, &tmp))){
+        ESP_LOGE(TAG, "[%s] Invalid default AP netmask: %s. "
+                      "Using 255.255.255.0 instead.",
+                      __func__, CONFIG_WMNGR_AP_MASK);
+        IP4_ADDR(&tmp, 255, 255, 255, 0);
+    }
+    cfg->ap_ip_info.netmask.addr = tmp.addr;
+
+    if(!(ip4addr_aton(CONFIG_WMNGR_AP_GW, &tmp))){
+        ESP_LOGE(TAG, "[%s] Invalid default AP GW: %s. "
+                      "Using 192.168.4.1 instead.",
+                      __func__, CONFIG_WMNGR_AP_GW);
+        IP4_ADDR(&tmp, 192, 168, 4, 1);
+    }
+    cfg->ap_ip_info.gw.addr = tmp.addr;
+
+    len = strlen(CONFIG_WMNGR_AP_SSID);
+    if(len > 0 && len <= sizeof(cfg->ap.ap.ssid)){
+        memcpy(cfg->ap.ap.ssid, CONFIG_WMNGR_AP_SSID, len);
+    } else {
+        ESP_LOGE(TAG, "[%s] Invalid default AP SSID: %s. "
+                      "Using \"ESP WiFi Manager\" instead.",
+                      __func__, CONFIG_WMNGR_AP_SSID);
+
+        len = MIN(strlen("ESP WiFi Manager"), sizeof(cfg->ap.ap.ssid));
+        memcpy(cfg->ap.ap.ssid, "ESP WiFi Manager", len);
+    }
+    cfg->ap.ap.ssid_len = len;
+}
+
+/*
+ * Hand scan data set back to the slab pool, should only be called through
+ * kref_put().
+ */
+static void free_scan_data(struct kref *ref)
+{
+    struct scan_data_ref *data;
+
+    data = container_of(ref, struct scan_data_ref, ref_cnt);
+    data->data.num_records = 0;
+    atomic_store(&(data->in_use), false);
+}
+
+/* Helper to find an unused slab. Returns NULL if all slabs are pinned. */
+static struct scan_data_ref *scan_slab_find(struct scan_table *table)
+{
+    unsigned int idx;
+
+    for(idx = 0; idx < SCAN_SLABS; ++idx){
+        if(!atomic_load(&(table->slabs[idx].in_use))){
+            return &(table->slabs[idx]);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Take an unused slab from the pool. The returned data set holds one
+ * reference. Must only be called from wifi_scan_done(), which is the
+ * only place slabs are taken.
+ */
+static esp_err_t scan_slab_get(struct scan_table *table,
+                               struct scan_data_ref **slab)
+{
+    struct scan_data_ref *new;
+
+    new = scan_slab_find(table);
+    if(new == NULL){
+        return ESP_ERR_NO_MEM;
+    }
+
+    atomic_store(&(new->in_use), true);
+    kref_init(&(new->ref_cnt)); // initialises ref_cnt to 1
+    new->data.num_records = 0;
+
+    *slab = new;
+
+    return ESP_OK;
+}
+
+/* Allocate scan table and slab pool. */
+static esp_err_t scan_mem_init(struct scan_table *table)
+{
+    struct scan_data_ref *slab;
+    unsigned int idx;
+
+    memset(table, 0x0, sizeof(*table));
+
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    memset(&(static_mem.scan_slabs), 0x0, sizeof(static_mem.scan_slabs));
+
+    table->entries = static_mem.scan_entries;
+    table->fetch = static_mem.scan_fetch;
+    table->slabs = static_mem.scan_slabs;
+
+    for(idx = 0; idx < SCAN_SLABS; ++idx){
+        slab = &(table->slabs[idx]);
+        atomic_init(&(slab->in_use), false);
+        atomic_init(&(slab->ref_cnt.count), 0);
+
+        slab->data.aps = static_mem.scan_aps[idx];
+        slab->data.ap_ages = static_mem.scan_ages[idx];
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+        slab->data.ap_records = static_mem.scan_records[idx];
+#endif
+    }
+
+    return ESP_OK;
+#else
+    table->entries = calloc(MAX_NUM_APS, sizeof(*(table->entries)));
+    table->fetch = calloc(MAX_NUM_APS, sizeof(*(table->fetch)));
+    table->slabs = calloc(SCAN_SLABS, sizeof(*(table->slabs)));
+    if(table->entries == NULL || table->fetch == NULL || table->slabs == NULL){
+        return ESP_ERR_NO_MEM;
+    }
+
+    for(idx = 0; idx < SCAN_SLABS; ++idx){
+        slab = &(table->slabs[idx]);
+        atomic_init(&(slab->in_use), false);
+        atomic_init(&(slab->ref_cnt.count), 0);
+
+        slab->data.aps = calloc(MAX_NUM_APS, sizeof(*(slab->data.aps)));
+        slab->data.ap_ages = calloc(MAX_NUM_APS,
+                                    sizeof(*(slab->data.ap_ages)));
+        if(slab->data.aps == NULL || slab->data.ap_ages == NULL){
+            return ESP_ERR_NO_MEM;
+        }
+
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+        slab->data.ap_records = calloc(MAX_NUM_APS,
+                                       sizeof(*(slab->data.ap_records)));
+        if(slab->data.ap_records == NULL){
+            return ESP_ERR_NO_MEM;
+        }
+#endif
+    }
+
+    return ESP_OK;
+#endif /* defined(CONFIG_WMNGR_STATIC_ALLOC) */
+}
+
+/* Release memory allocated by scan_mem_init(). */
+static void scan_mem_free(struct scan_table *table)
+{
+#if !defined(CONFIG_WMNGR_STATIC_ALLOC)
+    unsigned int idx;
+
+    if(table->slabs != NULL){
+        for(idx = 0; idx < SCAN_SLABS; ++idx){
+            free(table->slabs[idx].data.aps);
+            free(table->slabs[idx].data.ap_ages);
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+            free(table->slabs[idx].data.ap_records);
+#endif
+        }
+    }
+
+    free(table->slabs);
+    free(table->entries);
+    free(table->fetch);
+#endif
+    memset(table, 0x0, sizeof(*table));
+}
+
+/* Helper to fill a compact AP record from the full one. */
+static void scan_ap_from_record(struct scan_ap *ap,
+                                const wifi_ap_record_t *record)
+{
+    memcpy(ap->ssid, record->ssid, sizeof(ap->ssid));
+    ap->ssid[sizeof(ap->ssid) - 1] = '\0';
+    memcpy(ap->bssid, record->bssid, sizeof(ap->bssid));
+    ap->rssi = record->rssi;
+    ap->primary = record->primary;
+    ap->authmode = (uint8_t) record->authmode;
+
+    ap->phy_flags = 0;
+    if(record->phy_11b){
+        ap->phy_flags |= SCAN_AP_PHY_11B;
+    }
+    if(record->phy_11g){
+        ap->phy_flags |= SCAN_AP_PHY_11G;
+    }
+    if(record->phy_11n){
+        ap->phy_flags |= SCAN_AP_PHY_11N;
+    }
+    if(record->phy_lr){
+        ap->phy_flags |= SCAN_AP_PHY_LR;
+    }
+    if(record->wps){
+        ap->phy_flags |= SCAN_AP_WPS;
+    }
+}
+
+/* Helper to find an AP in the scan table by its BSSID. */
+static struct scan_entry *scan_table_find(struct scan_table *table,
+                                          const uint8_t *bssid)
+{
+    unsigned int idx;
+
+    for(idx = 0; idx < table->num_entries; ++idx){
+        if(!memcmp(table->entries[idx].ap.bssid, bssid,
+                   sizeof(table->entries[idx].ap.bssid)))
+        {
+            return &(table->entries[idx]);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Merge a batch of freshly fetched AP records into the scan table. Known
+ * APs are updated in place, new ones get added. If the table is full, the
+ * entry that has not been seen for the longest time gets replaced, as long
+ * as it was not part of the current batch.
+ */
+static void scan_table_merge(struct scan_table *table,
+                             wifi_ap_record_t *records, uint16_t num_records,
+                             TickType_t now)
+{
+    struct scan_entry *entry;
+    unsigned int idx, oldest;
+
+    for(idx = 0; idx < num_records; ++idx){
+        entry = scan_table_find(table, records[idx].bssid);
+        if(entry == NULL){
+            if(table->num_entries < MAX_NUM_APS){
+                entry = &(table->entries[table->num_entries]);
+                ++table->num_entries;
+            } else {
+                for(oldest = 0; oldest < table->num_entries; ++oldest){
+                    if(table->entries[oldest].last_seen != now){
+                        break;
+                    }
+                }
+
+                if(oldest == table->num_entries){
+                    continue;
+                }
+
+                entry = &(table->entries[oldest]);
+                for(; oldest < table->num_entries; ++oldest){
+                    if(table->entries[oldest].last_seen != now
+                       && time_before(table->entries[oldest].last_seen,
+                                      entry->last_seen))
+                    {
+                        entry = &(table->entries[oldest]);
+                    }
+                }
+            }
+
+            entry->first_seen = now;
+        }
+
+        scan_ap_from_record(&(entry->ap), &(records[idx]));
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+        memcpy(&(entry->record), &(records[idx]), sizeof(entry->record));
+#endif
+        entry->last_seen = now;
+    }
+}
+
+/* Drop all APs that have not been seen for more than SCAN_MAX_AGE ticks. */
+static void scan_table_expire(struct scan_table *table, TickType_t now)
+{
+    unsigned int idx;
+
+    idx = 0;
+    while(idx < table->num_entries){
+        if(time_after(now, table->entries[idx].last_seen + SCAN_MAX_AGE)){
+            --table->num_entries;
+            if(idx != table->num_entries){
+                memcpy(&(table->entries[idx]),
+                       &(table->entries[table->num_entries]),
+                       sizeof(table->entries[idx]));
+            }
+        } else {
+            ++idx;
+        }
+    }
+}
+
+/*
+ * Create a reference counted snapshot of the current scan table in an
+ * unused slab. The returned data set holds one reference.
+ */
+static esp_err_t scan_table_snapshot(struct scan_table *table, TickType_t now,
+                                     struct scan_data_ref **snapshot)
+{
+    struct scan_data_ref *new;
+    unsigned int idx;
+    esp_err_t result;
+
+    result = scan_slab_get(table, &new);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "All scan slabs in use, not publishing scan data");
+        goto on_exit;
+    }
+
+    new->data.tstamp = now;
+
+    for(idx = 0; idx < table->num_entries; ++idx){
+        memcpy(&(new->data.aps[idx]), &(table->entries[idx].ap),
+               sizeof(new->data.aps[idx]));
+#if defined(CONFIG_WMNGR_SCAN_FULL_RECORDS)
+        memcpy(&(new->data.ap_records[idx]), &(table->entries[idx].record),
+               sizeof(new->data.ap_records[idx]));
+#endif
+        new->data.ap_ages[idx].first_seen = table->entries[idx].first_seen;
+        new->data.ap_ages[idx].last_seen = table->entries[idx].last_seen;
+    }
+
+    new->data.num_records = table->num_entries;
+    *snapshot = new;
+
+on_exit:
+    return result;
+}
+
+/* Set up a new scan sweep according to the scan parameters. */
+static void scan_sweep_init(void)
+{
+    struct scan_sched *sched;
+    wifi_country_t country;
+    esp_err_t result;
+
+    sched = &(cfg_state.scan_sched);
+    memset(sched, 0x0, sizeof(*sched));
+    stats_scan_start();
+
+    /* Not slicing, scan all channels at once. */
+    if(cfg_state.scan_cfg.slice_chans == 0){
+        return;
+    }
+
+    result = esp_wifi_get_country(&country);
+    if(result != ESP_OK || country.schan == 0 || country.nchan == 0){
+        ESP_LOGW(TAG, "[%s] Unable to get channel range, using 1-13.",
+                 __func__);
+        country.schan = 1;
+        country.nchan = 13;
+    }
+
+    sched->active = true;
+    sched->next_chan = country.schan;
+    sched->last_chan = MIN(country.schan + country.nchan - 1, SCAN_MAX_CHAN);
+    sched->slice_left = cfg_state.scan_cfg.slice_chans;
+    sched->next_slice = xTaskGetTickCount();
+}
+
+/*
+ * Schedule the next channel of a running scan sweep. If the current slice
+ * is done, the next one will be started after spending home_time ms on the
+ * home channel. Returns true if the sweep is finished, which is always the
+ * case when not slicing.
+ */
+static bool scan_sweep_next(void)
+{
+    struct scan_sched *sched;
+
+    sched = &(cfg_state.scan_sched);
+    if(!sched->active){
+        return true;
+    }
+
+    if(sched->next_chan > sched->last_chan){
+        ESP_LOGI(TAG, "[%s] Scan sweep done.", __func__);
+        sched->active = false;
+        return true;
+    }
+
+    sched->next_slice = xTaskGetTickCount();
+    if(sched->slice_left == 0){
+        sched->slice_left = cfg_state.scan_cfg.slice_chans;
+        sched->next_slice += pdMS_TO_TICKS(cfg_state.scan_cfg.home_time);
+    }
+
+    xEventGroupSetBits(wifi_events, BIT_SCAN_START);
+
+    return false;
+}
+
+/*
+ * Get number of ticks until the next slice of a scan sweep is due.
+ * Returns 0 if a scan may be started right now.
+ */
+static TickType_t scan_slice_delay(TickType_t now)
+{
+    struct scan_sched *sched;
+
+    sched = &(cfg_state.scan_sched);
+    if(sched->active && time_before(now, sched->next_slice)){
+        return sched->next_slice - now;
+    }
+
+    return 0;
+}
+
+/*
+ * Release the replaced scan data set. A reader might have loaded a pointer
+ * to it just before it got replaced and not have taken its reference yet.
+ * Once no reader is inside esp_wmngr_get_scan(), it can not be loaded any
+ * more. Must be called with cfg_state.lock held.
+ */
+static void scan_reclaim(void)
+{
+    if(cfg_state.scan_retired == NULL
+       || atomic_load(&cfg_state.scan_readers) != 0)
+    {
+        return;
+    }
+
+    /*
+     * Drop global reference to old data set so it will be freed
+     * when the last connection using it gets closed.
+     */
+    esp_wmngr_put_scan(&(cfg_state.scan_retired->data));
+    cfg_state.scan_retired = NULL;
+}
+
+/** Fetch the latest AP scan data and make it available.
+ * Fetch the latest set of AP scan results, merge them into the scan table
+ * and make a snapshot of the table available to the users. The
+ * SCAN_RUNNING and SCAN_DONE flags will be cleared on success or
+ * unrecoverable error.
+ */
+static void wifi_scan_done(void)
+{
+    struct scan_table *table;
+    uint16_t num_aps;
+    struct scan_data_ref *old, *new;
+    TickType_t now;
+    esp_err_t result;
+
+    result = ESP_OK;
+    new = NULL;
+    table = &(cfg_state.scan_table);
+
+    /* cgiWifiSetup() must have been called prior to this point. */
+    configASSERT(cfg_state.lock != NULL);
+    configASSERT(table->entries != NULL);
+    configASSERT(table->slabs != NULL);
+
+    /* Fetch number of APs found. Bail out early if there is an error. */
+    result = esp_wifi_scan_get_ap_num(&num_aps);
+    if(result != ESP_OK){
+        /* Something went seriously wrong, no point in trying again. */
+        ESP_LOGI(TAG, "Scan error");
+        xEventGroupClearBits(wifi_events, (BIT_SCAN_RUNNING | BIT_SCAN_DONE));
+        goto on_exit;
+    }
+
+    /*
+     * Limit number of records to fetch to the size of the fetch buffer.
+     * The driver drops the remaining records.
+     */
+    if(num_aps > MAX_NUM_APS){
+        ESP_LOGI(TAG, "Limiting AP records to %d (Actually found %d)",
+                 MAX_NUM_APS, num_aps);
+        num_aps = MAX_NUM_APS;
+    }
+
+    /* Fetch actual AP scan data */
+    now = xTaskGetTickCount();
+    if(num_aps > 0){
+        result = esp_wifi_scan_get_ap_records(&num_aps, table->fetch);
+    }
+
+    /*
+     * Scan data has either been fetched or lost at this point, so
+     * clear flags irregardless of returned status.
+     */
+    xEventGroupClearBits(wifi_events, (BIT_SCAN_RUNNING | BIT_SCAN_DONE));
+
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "Error getting scan results");
+        goto on_exit;
+    }
+
+    cfg_state.scan_sched.found += num_aps;
+
+    scan_table_merge(table, table->fetch, num_aps, now);
+    scan_table_expire(table, now);
+
+    ESP_LOGI(TAG, "Scan done: found %d APs, %d in table",
+             num_aps, table->num_entries);
+
+    /*
+     * Readers are still busy with the data set replaced last time. Do
+     * not wait for them, publish the merged table after the next scan.
+     */
+    scan_reclaim();
+    if(cfg_state.scan_retired != NULL){
+        ESP_LOGD(TAG, "[%s] Old scan data still in use.", __func__);
+        goto on_exit;
+    }
+
+    result = scan_table_snapshot(table, now, &new);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    /*
+     * Make new scan data available.
+     * The new data set will be assigned to the global pointer. Fetch
+     * another reference so it will not be freed on function exit.
+     */
+    kref_get(&(new->ref_cnt));
+
+    old = atomic_exchange(&cfg_state.scan_ref, new);
+
+    if(old != NULL){
+        cfg_state.scan_retired = old;
+        scan_reclaim();
+    }
+
+on_exit:
+    /* Drop one reference to the new scan data. */
+    if(new != NULL){
+        esp_wmngr_put_scan(&(new->data));
+    }
+
+    /* Only account for whole sweeps, not for the slices they are made of. */
+    if(scan_sweep_next()){
+        stats_scan_done(cfg_state.scan_sched.found);
+    }
+}
+
+/** Start AP scan.
+ */
+static void wifi_scan_start(void)
+{
+    wifi_scan_config_t scan_cfg;
+    struct scan_sched *sched;
+    EventBits_t events;
+    wifi_mode_t mode;
+    esp_err_t result;
+
+    /*
+     * Make sure we do not try to start a scan while the WiFi config is
+     * in a transitional state. If we bail out here, the SCAN_START bit
+     * will be kept set and the scan will start once the WiFi config has
+     * settled down again.
+     */
+    if(!state_is_stable(cfg_state.state)){
+        ESP_LOGI(TAG, "[%s] WiFi connecting, not starting scan.",
+                 __func__);
+        goto on_exit;
+    }
+
+    /* WiFi config is in a stable state, clear the SCAN_START bit. */
+    xEventGroupClearBits(wifi_events, BIT_SCAN_START);
+
+    /* Check that we are in a suitable mode for scanning. */
+    result =  esp_wifi_get_mode(&mode);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Error fetching WiFi mode.", __func__);
+        goto on_exit;
+    }
+
+    if(mode != WIFI_MODE_APSTA && mode != WIFI_MODE_STA){
+        ESP_LOGE(TAG, "[%s] Invalid WiFi mode for scanning.", __func__);
+        goto on_exit;
+    }
+
+    events = xEventGroupGetBits(wifi_events);
+
+    /* Finally, start a scan. Unless there is one running already. */
+    if(!(events & (BIT_SCAN_RUNNING | BIT_SCAN_DONE))){
+        sched = &(cfg_state.scan_sched);
+        if(!sched->active){
+            scan_sweep_init();
+        }
+
+        memset(&scan_cfg, 0x0, sizeof(scan_cfg));
+        scan_cfg.show_hidden = true;
+        if(cfg_state.scan_cfg.passive){
+            scan_cfg.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+            scan_cfg.scan_time.passive = cfg_state.scan_cfg.dwell_time;
+        } else {
+            scan_cfg.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+            scan_cfg.scan_time.active.max = cfg_state.scan_cfg.dwell_time;
+        }
+
+        /* Channel 0 makes the driver scan all channels. */
+        scan_cfg.channel = sched->active ? sched->next_chan : 0;
+
+        ESP_LOGI(TAG, "[%s] Starting scan on channel %d.",
+                 __func__, scan_cfg.channel);
+
+        xEventGroupSetBits(wifi_events, BIT_SCAN_START);
+        result = esp_wifi_scan_start(&scan_cfg, false);
+        if(result == ESP_OK){
+            ESP_LOGI(TAG, "[%s] Scan started.", __func__);
+            xEventGroupSetBits(wifi_events, BIT_SCAN_RUNNING);
+            if(sched->active){
+                ++sched->next_chan;
+                --sched->slice_left;
+            }
+        } else {
+            ESP_LOGE(TAG, "[%s] Starting AP scan failed.", __func__);
+        }
+    } else {
+        ESP_LOGI(TAG, "[%s] Scan aleady running.", __func__);
+    }
+
+on_exit:
+    return;
+}
+
+/* Read the fast connect data from NVS. Failing to do so is not an error. */
+static void load_fast_connect(void)
+{
+#if defined(CONFIG_WMNGR_FAST_CONNECT)
+    nvs_handle handle;
+    size_t len;
+    esp_err_t result;
+
+    memset(&cfg_state.fast, 0x0, sizeof(cfg_state.fast));
+
+    result = nvs_open(WMNGR_NAMESPACE, NVS_READONLY, &handle);
+    if(result != ESP_OK){
+        return;
+    }
+
+    len = sizeof(cfg_state.fast.data);
+    result = nvs_get_blob(handle, "fast", &(cfg_state.fast.data), &len);
+    if(result == ESP_OK && len == sizeof(cfg_state.fast.data)){
+        cfg_state.fast.valid = true;
+    }
+
+    nvs_close(handle);
+#endif
+}
+
+static esp_err_t clear_config(void)
+{
+    nvs_handle handle;
+    esp_err_t result;
+
+    result = nvs_open(WMNGR_NAMESPACE, NVS_READWRITE, &handle);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] nvs_open() failed.", __func__);
+        return result;
+    }
+
+    result = nvs_erase_all(handle);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    result = nvs_commit(handle);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    memset(&cfg_state.nvs, 0x0, sizeof(cfg_state.nvs));
+    cfg_state.nvs.slot = NVS_SLOT_NONE;
+
+    /* Fast connect data has been erased as well. */
+    cfg_state.fast.dirty = cfg_state.fast.valid;
+    ++cfg_state.flash_stats.erases;
+
+on_exit:
+    nvs_close(handle);
+
+    return result;
+}
+
+/*
+ * Read a configuration stored in the version 1 layout, where every member
+ * of the struct wifi_cfg was kept in its own NVS key. Only used for
+ * migrating to the slot based storage.
+ */
+static esp_err_t get_legacy_config(nvs_handle handle, struct wifi_cfg *cfg)
+{
+    size_t len;
+    uint32_t tmp;
+    esp_err_t result;
+
+    memset(cfg, 0x0, sizeof(*cfg));
+
+    /* Make sure we know how to handle the stored configuration. */
+    result = nvs_get_u32(handle, "version", &tmp);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    if(tmp != NVS_CFG_VER_LEGACY){
+        result = ESP_ERR_INVALID_VERSION;
+        goto on_exit;
+    }
+
+    /* Read back the base type components of the struct wifi_cfg. */
+    result = nvs_get_u32(handle, "mode", &(tmp));
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+    cfg->mode = (wifi_mode_t) tmp;
+
+    result = nvs_get_u32(handle, "sta_static", &tmp);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+    cfg->sta_static = (bool) tmp;
+
+    result = nvs_get_u32(handle, "sta_connect", &tmp);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+    cfg->sta_connect = (bool) tmp;
+
+    /*
+     * The esp-idf types are stored as binary blobs. This is problematic
+     * because their memory layout and padding might change between esp-idf
+     * releases or by using a different toolchain or compiler options.
+     * We do a very basic sanity check by comparing the types' sizes to the
+     * records' lengths, but this is not guaranteed to catch every case.
+     */
+
+    len = sizeof(cfg->ap);
+    result = nvs_get_blob(handle, "ap", &(cfg->ap), &len);
+    if(result != ESP_OK || len != sizeof(cfg->ap)){
+        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+        goto on_exit;
+    }
+
+    len = sizeof(cfg->sta);
+    result = nvs_get_blob(handle, "sta", &(cfg->sta), &len);
+    if(result != ESP_OK || len != sizeof(cfg->sta)){
+        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+        goto on_exit;
+    }
+
+    len = sizeof(cfg->ap_ip_info);
+    result = nvs_get_blob(handle, "ap_ip", &(cfg->ap_ip_info), &len);
+    if(result != ESP_OK || len != sizeof(cfg->ap_ip_info)){
+        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+        goto on_exit;
+    }
+
+    len = sizeof(cfg->sta_ip_info);
+    result = nvs_get_blob(handle, "sta_ip", &(cfg->sta_ip_info), &len);
+    if(result != ESP_OK || len != sizeof(cfg->sta_ip_info)){
+        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+        goto on_exit;
+    }
+
+    len = sizeof(cfg->sta_dns_info);
+    result = nvs_get_blob(handle, "sta_dns", &(cfg->sta_dns_info), &len);
+    if(result != ESP_OK || len != sizeof(cfg->sta_dns_info)){
+        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+        goto on_exit;
+    }
+
+on_exit:
+    return result;
+}
+
+/* Erase all keys of the version 1 layout. Missing keys are not an error. */
+static void erase_legacy_config(nvs_handle handle)
+{
+    unsigned int idx;
+
+    for(idx = 0; idx < ARRAY_SIZE(nvs_legacy_keys); ++idx){
+        (void) nvs_erase_key(handle, nvs_legacy_keys[idx]);
+    }
+}
+
+/* Bitwise CRC32 (IEEE 802.3). Only used on a few hundred bytes per save. */
+static uint32_t calc_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *data;
+    unsigned int bit;
+
+    data = buf;
+    crc = ~crc;
+    while(len-- > 0){
+        crc ^= *data++;
+        for(bit = 0; bit < 8; ++bit){
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+/* Get NVS_SLOTS zeroed buffers for reading or writing config slots. */
+static union nvs_slot_buf *nvs_bufs_get(void)
+{
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    memset(static_mem.nvs_bufs, 0x0, sizeof(static_mem.nvs_bufs));
+
+    return static_mem.nvs_bufs;
+#else
+    return calloc(NVS_SLOTS, sizeof(union nvs_slot_buf));
+#endif
+}
+
+static void nvs_bufs_put(union nvs_slot_buf *bufs)
+{
+#if !defined(CONFIG_WMNGR_STATIC_ALLOC)
+    free(bufs);
+#endif
+}
+
+/* Checksum over everything in the slot blob following the header. */
+static uint32_t slot_crc(const union nvs_slot_buf *buf, size_t len)
+{
+    return calc_crc32(0, (const uint8_t *) buf + sizeof(buf->hdr),
+                      len - sizeof(buf->hdr));
+}
+
+/* Append a TLV record to the buffer. */
+static void tlv_put(struct tlv_buf *buf, uint8_t tag, const void *val,
+                    size_t len)
+{
+    if(len > UINT8_MAX || buf->len + 2 + len > buf->size){
+        buf->overflow = true;
+        return;
+    }
+
+    buf->data[buf->len++] = tag;
+    buf->data[buf->len++] = (uint8_t) len;
+    memcpy(&(buf->data[buf->len]), val, len);
+    buf->len += len;
+}
+
+static void tlv_put_u8(struct tlv_buf *buf, uint8_t tag, uint8_t val)
+{
+    tlv_put(buf, tag, &val, sizeof(val));
+}
+
+/* Multi-byte integers are stored little endian. */
+static void tlv_put_u16(struct tlv_buf *buf, uint8_t tag, uint16_t val)
+{
+    uint8_t tmp[2];
+
+    tmp[0] = val & 0xff;
+    tmp[1] = (val >> 8) & 0xff;
+
+    tlv_put(buf, tag, tmp, sizeof(tmp));
+}
+
+/* Strings are stored without padding and NUL termination. */
+static void tlv_put_str(struct tlv_buf *buf, uint8_t tag, const uint8_t *str,
+                        size_t max)
+{
+    tlv_put(buf, tag, str, strnlen((const char *) str, max));
+}
+
+/* IP addresses, netmasks and gateways are stored in network byte order. */
+static void tlv_put_ip_info(struct tlv_buf *buf, uint8_t tag,
+                            const esp_netif_ip_info_t *info)
+{
+    uint8_t tmp[12];
+
+    memcpy(&tmp[0], &(info->ip.addr), 4);
+    memcpy(&tmp[4], &(info->netmask.addr), 4);
+    memcpy(&tmp[8], &(info->gw.addr), 4);
+
+    tlv_put(buf, tag, tmp, sizeof(tmp));
+}
+
+/* Encode the parts of a struct wifi_cfg we need to restore it. */
+static esp_err_t cfg_to_tlv(const struct wifi_cfg *cfg, struct tlv_buf *buf)
+{
+    const wifi_ap_config_t *ap;
+    const wifi_sta_config_t *sta;
+    uint8_t tmp[5];
+    unsigned int idx;
+    size_t len;
+
+    ap = &(cfg->ap.ap);
+    sta = &(cfg->sta.sta);
+
+    tlv_put_u8(buf, cfg_tag_mode, cfg->mode);
+    tlv_put_u8(buf, cfg_tag_sta_static, cfg->sta_static);
+    tlv_put_u8(buf, cfg_tag_sta_connect, cfg->sta_connect);
+
+    /* SSID is either ssid_len bytes long or NUL terminated. */
+    len = (ap->ssid_len > 0) ? MIN(ap->ssid_len, sizeof(ap->ssid))
+                             : strnlen((const char *) ap->ssid,
+                                       sizeof(ap->ssid));
+    tlv_put(buf, cfg_tag_ap_ssid, ap->ssid, len);
+    tlv_put_str(buf, cfg_tag_ap_pass, ap->password, sizeof(ap->password));
+    tlv_put_u8(buf, cfg_tag_ap_chan, ap->channel);
+    tlv_put_u8(buf, cfg_tag_ap_auth, ap->authmode);
+    tlv_put_u8(buf, cfg_tag_ap_hidden, ap->ssid_hidden);
+    tlv_put_u8(buf, cfg_tag_ap_max_conn, ap->max_connection);
+    tlv_put_u16(buf, cfg_tag_ap_beacon, ap->beacon_interval);
+    tlv_put_ip_info(buf, cfg_tag_ap_ip, &(cfg->ap_ip_info));
+
+    tlv_put_str(buf, cfg_tag_sta_ssid, sta->ssid, sizeof(sta->ssid));
+    tlv_put_str(buf, cfg_tag_sta_pass, sta->password, sizeof(sta->password));
+    if(sta->bssid_set){
+        tlv_put(buf, cfg_tag_sta_bssid, sta->bssid, sizeof(sta->bssid));
+    }
+    tlv_put_u8(buf, cfg_tag_sta_chan, sta->channel);
+    tlv_put_u8(buf, cfg_tag_sta_scan, sta->scan_method);
+    tlv_put_u16(buf, cfg_tag_sta_listen, sta->listen_interval);
+    tlv_put_u8(buf, cfg_tag_sta_sort, sta->sort_method);
+    tmp[0] = (uint8_t) sta->threshold.rssi;
+    tmp[1] = sta->threshold.authmode;
+    tlv_put(buf, cfg_tag_sta_thresh, tmp, 2);
+    tlv_put_u8(buf, cfg_tag_sta_pmf, (sta->pmf_cfg.capable ? BIT0 : 0)
+                                     | (sta->pmf_cfg.required ? BIT1 : 0));
+    tlv_put_ip_info(buf, cfg_tag_sta_ip, &(cfg->sta_ip_info));
+
+    /* Only IPv4 DNS servers can be configured, skip unset entries. */
+    for(idx = 0; idx < ARRAY_SIZE(cfg->sta_dns_info); ++idx){
+        if(cfg->sta_dns_info[idx].ip.type != IPADDR_TYPE_V4
+           || ip_addr_isany_val(cfg->sta_dns_info[idx].ip))
+        {
+            continue;
+        }
+
+        tmp[0] = idx;
+        memcpy(&tmp[1], &(cfg->sta_dns_info[idx].ip.u_addr.ip4.addr), 4);
+        tlv_put(buf, cfg_tag_sta_dns, tmp, 5);
+    }
+
+    return buf->overflow ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+/* Copy a string record into a fixed size, zero padded buffer. */
+static void tlv_get_str(uint8_t *dst, size_t size, const uint8_t *val,
+                        size_t len)
+{
+    memcpy(dst, val, MIN(len, size));
+}
+
+static void tlv_get_ip_info(esp_netif_ip_info_t *info, const uint8_t *val)
+{
+    memcpy(&(info->ip.addr), &val[0], 4);
+    memcpy(&(info->netmask.addr), &val[4], 4);
+    memcpy(&(info->gw.addr), &val[8], 4);
+}
+
+/*
+ * Decode a TLV encoded config. Records with unknown tags are skipped, so
+ * that configs written by later firmware versions can still be read.
+ */
+static esp_err_t cfg_from_tlv(const uint8_t *data, size_t size,
+                              struct wifi_cfg *cfg)
+{
+    wifi_ap_config_t *ap;
+    wifi_sta_config_t *sta;
+    const uint8_t *val;
+    size_t pos, len;
+    uint8_t tag;
+    bool have_mode;
+
+    memset(cfg, 0x0, sizeof(*cfg));
+    ap = &(cfg->ap.ap);
+    sta = &(cfg->sta.sta);
+    have_mode = false;
+
+    for(pos = 0; pos < size; pos += 2 + len){
+        if(pos + 2 > size){
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        tag = data[pos];
+        len = data[pos + 1];
+        val = &data[pos + 2];
+
+        if(pos + 2 + len > size){
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        /* Fixed size records must have exactly the expected length. */
+        switch(tag){
+        case cfg_tag_ap_beacon:
+        case cfg_tag_sta_listen:
+        case cfg_tag_sta_thresh:
+            if(len != 2){
+                return ESP_ERR_INVALID_SIZE;
+            }
+            break;
+        case cfg_tag_ap_ip:
+        case cfg_tag_sta_ip:
+            if(len != 12){
+                return ESP_ERR_INVALID_SIZE;
+            }
+            break;
+        case cfg_tag_sta_bssid:
+            if(len != sizeof(sta->bssid)){
+                return ESP_ERR_INVALID_SIZE;
+            }
+            break;
+        case cfg_tag_sta_dns:
+            if(len != 5){
+                return ESP_ERR_INVALID_SIZE;
+            }
+            break;
+        case cfg_tag_mode:
+        case cfg_tag_sta_static:
+        case cfg_tag_sta_connect:
+        case cfg_tag_ap_chan:
+        case cfg_tag_ap_auth:
+        case cfg_tag_ap_hidden:
+        case cfg_tag_ap_max_conn:
+        case cfg_tag_sta_chan:
+        case cfg_tag_sta_scan:
+        case cfg_tag_sta_sort:
+        case cfg_tag_sta_pmf:
+            if(len != 1){
+                return ESP_ERR_INVALID_SIZE;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch(tag){
+        case cfg_tag_mode:
+            cfg->mode = (wifi_mode_t) val[0];
+            have_mode = true;
+            break;
+        case cfg_tag_sta_static:
+            cfg->sta_static = val[0] != 0;
+            break;
+        case cfg_tag_sta_connect:
+            cfg->sta_connect = val[0] != 0;
+            break;
+        case cfg_tag_ap_ssid:
+            tlv_get_str(ap->ssid, sizeof(ap->ssid), val, len);
+            ap->ssid_len = MIN(len, sizeof(ap->ssid));
+            break;
+        case cfg_tag_ap_pass:
+            tlv_get_str(ap->password, sizeof(ap->password), val, len);
+            break;
+        case cfg_tag_ap_chan:
+            ap->channel = val[0];
+            break;
+        case cfg_tag_ap_auth:
+            ap->authmode = (wifi_auth_mode_t) val[0];
+            break;
+        case cfg_tag_ap_hidden:
+            ap->ssid_hidden = val[0];
+            break;
+        case cfg_tag_ap_max_conn:
+            ap->max_connection = val[0];
+            break;
+        case cfg_tag_ap_beacon:
+            ap->beacon_interval = val[0] | (val[1] << 8);
+            break;
+        case cfg_tag_ap_ip:
+            tlv_get_ip_info(&(cfg->ap_ip_info), val);
+            break;
+        case cfg_tag_sta_ssid:
+            tlv_get_str(sta->ssid, sizeof(sta->ssid), val, len);
+            break;
+        case cfg_tag_sta_pass:
+            tlv_get_str(sta->password, sizeof(sta->password), val, len);
+            break;
+        case cfg_tag_sta_bssid:
+            memcpy(sta->bssid, val, sizeof(sta->bssid));
+            sta->bssid_set = true;
+            break;
+        case cfg_tag_sta_chan:
+            sta->channel = val[0];
+            break;
+        case cfg_tag_sta_scan:
+            sta->scan_method = (wifi_scan_method_t) val[0];
+            break;
+        case cfg_tag_sta_listen:
+            sta->listen_interval = val[0] | (val[1] << 8);
+            break;
+        case cfg_tag_sta_sort:
+            sta->sort_method = (wifi_sort_method_t) val[0];
+            break;
+        case cfg_tag_sta_thresh:
+            sta->threshold.rssi = (int8_t) val[0];
+            sta->threshold.authmode = (wifi_auth_mode_t) val[1];
+            break;
+        case cfg_tag_sta_pmf:
+            sta->pmf_cfg.capable = (val[0] & BIT0) != 0;
+            sta->pmf_cfg.required = (val[0] & BIT1) != 0;
+            break;
+        case cfg_tag_sta_ip:
+            tlv_get_ip_info(&(cfg->sta_ip_info), val);
+            break;
+        case cfg_tag_sta_dns:
+            if(val[0] < ARRAY_SIZE(cfg->sta_dns_info)){
+                cfg->sta_dns_info[val[0]].ip.type = IPADDR_TYPE_V4;
+                memcpy(&(cfg->sta_dns_info[val[0]].ip.u_addr.ip4.addr),
+                       &val[1], 4);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return have_mode ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+/*
+ * Read a config slot from NVS and check that it is complete and intact.
+ * On success, len will be set to the length of the slot's blob.
+ */
+static esp_err_t read_slot(nvs_handle handle, unsigned int idx,
+                           union nvs_slot_buf *buf, size_t *len)
+{
+    esp_err_t result;
+
+    *len = sizeof(*buf);
+    result = nvs_get_blob(handle, nvs_slot_keys[idx], buf, len);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    if(*len < sizeof(buf->hdr) || buf->hdr.magic != NVS_SLOT_MAGIC){
+        result = ESP_ERR_NOT_FOUND;
+        goto on_exit;
+    }
+
+    if(buf->hdr.version != NVS_CFG_VER){
+        result = ESP_ERR_INVALID_VERSION;
+        goto on_exit;
+    }
+
+    if(buf->hdr.crc != slot_crc(buf, *len)){
+        ESP_LOGW(TAG, "[%s] CRC mismatch in slot %u.", __func__, idx);
+        result = ESP_ERR_INVALID_CRC;
+        goto on_exit;
+    }
+
+on_exit:
+    return result;
+}
+
+/** Read saved configuration from NVS.
+ *
+ * Read configuration from NVS and store it in the struct wifi_cfg.
+ * The newest of the two config slots that passes the CRC check is used.
+ * If neither slot holds a valid config, a config in the version 1 layout
+ * will be read instead.
+ *
+ * @param[out] cfg Configuration read from NVS.
+ * @param[out] desc Slot the config was read from. The slot member is set
+ *                  to NVS_SLOT_NONE if it was read from the old layout.
+ *                  May be NULL.
+ * @return ESP_OK if valid configuration was found in NVS, ESP_ERR_* otherwise.
+ */
+static esp_err_t get_saved_config(struct wifi_cfg *cfg,
+                                  struct nvs_cfg_desc *desc)
+{
+    nvs_handle handle;
+    union nvs_slot_buf *bufs;
+    size_t lens[NVS_SLOTS];
+    unsigned int idx;
+    uint8_t active, found;
+    uint32_t found_seq;
+    esp_err_t result;
+
+    found = NVS_SLOT_NONE;
+    found_seq = 0;
+
+    memset(cfg, 0x0, sizeof(*cfg));
+
+    bufs = nvs_bufs_get();
+    if(bufs == NULL){
+        ESP_LOGE(TAG, "[%s] Out of memory.", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* Namespace does not exist until a config has been saved. */
+    result = nvs_open(WMNGR_NAMESPACE, NVS_READONLY, &handle);
+    if(result != ESP_OK){
+        if(result != ESP_ERR_NVS_NOT_FOUND){
+            ESP_LOGE(TAG, "[%s] nvs_open() failed.", __func__);
+        }
+        nvs_bufs_put(bufs);
+        return result;
+    }
+
+    /*
+     * The pointer key only decides between two valid slots with the same
+     * sequence number. A slot with a newer sequence number has been written
+     * and verified completely, even if we lost power before flipping the
+     * pointer over to it.
+     */
+    if(nvs_get_u8(handle, NVS_SLOT_KEY, &active) != ESP_OK){
+        active = NVS_SLOT_NONE;
+    }
+
+    for(idx = 0; idx < NVS_SLOTS; ++idx){
+        if(read_slot(handle, idx, &bufs[idx], &lens[idx]) != ESP_OK){
+            continue;
+        }
+
+        if(found == NVS_SLOT_NONE
+           || (int32_t) (bufs[idx].hdr.seq - found_seq) > 0
+           || (bufs[idx].hdr.seq == found_seq && idx == active))
+        {
+            found = idx;
+            found_seq = bufs[idx].hdr.seq;
+        }
+    }
+
+    if(found == NVS_SLOT_NONE){
+        result = get_legacy_config(handle, cfg);
+    } else {
+        result = cfg_from_tlv(bufs[found].slot.data,
+                              lens[found] - sizeof(bufs[found].hdr), cfg);
+    }
+
+    /* Having no config stored at all is not an error. */
+    if(result != ESP_OK && result != ESP_ERR_NVS_NOT_FOUND){
+        ESP_LOGE(TAG, "[%s] Reading config failed.", __func__);
+    }
+
+    if(result != ESP_OK){
+        found = NVS_SLOT_NONE;
+        found_seq = 0;
+    }
+
+    if(desc != NULL){
+        desc->present = (result == ESP_OK);
+        desc->slot = found;
+        desc->seq = found_seq;
+        if(found != NVS_SLOT_NONE){
+            desc->version = bufs[found].hdr.version;
+            desc->crc = bufs[found].hdr.crc;
+        } else {
+            desc->version = desc->present ? NVS_CFG_VER_LEGACY : 0;
+            desc->crc = 0;
+        }
+    }
+
+    nvs_close(handle);
+    nvs_bufs_put(bufs);
+
+    return result;
+}
+
+/*
+ * Write an encoded config to the slot not holding the currently saved
+ * config, read it back and verify it and only then flip the pointer to
+ * the active slot over.
+ */
+static esp_err_t write_slot(nvs_handle handle, union nvs_slot_buf *buf,
+                            size_t len)
+{
+    uint8_t target;
+    uint32_t seq, crc;
+    esp_err_t result;
+
+    target = (cfg_state.nvs.slot == 0) ? 1 : 0;
+    seq = cfg_state.nvs.seq + 1;
+    crc = buf->hdr.crc;
+
+    result = nvs_set_blob(handle, nvs_slot_keys[target], buf, len);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    result = nvs_commit(handle);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    /* Make sure the slot made it to the flash before activating it. */
+    memset(buf, 0x0, sizeof(*buf));
+    result = read_slot(handle, target, buf, &len);
+    if(result == ESP_OK
+       && (buf->hdr.seq != seq || buf->hdr.version != NVS_CFG_VER
+           || buf->hdr.crc != crc))
+    {
+        result = ESP_ERR_INVALID_CRC;
+    }
+
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    result = nvs_set_u8(handle, NVS_SLOT_KEY, target);
+    if(result != ESP_OK){
+        goto on_exit;
+    }
+
+    /* Config is now safely stored in its slot, drop the old layout. */
+    if(cfg_state.nvs.slot == NVS_SLOT_NONE){
+        erase_legacy_config(handle);
+    }
+
+    cfg_state.nvs.present = true;
+    cfg_state.nvs.version = NVS_CFG_VER;
+    cfg_state.nvs.slot = target;
+    cfg_state.nvs.seq = seq;
+    cfg_state.nvs.crc = crc;
+    ++cfg_state.flash_stats.saves;
+
+on_exit:
+    return result;
+}
+
+/* Write or erase the fast connect data if it has changed. */
+static void save_fast_connect(nvs_handle handle)
+{
+#if defined(CONFIG_WMNGR_FAST_CONNECT)
+    esp_err_t result;
+
+    if(!cfg_state.fast.dirty){
+        return;
+    }
+
+    if(cfg_state.fast.valid){
+        result = nvs_set_blob(handle, "fast", &(cfg_state.fast.data),
+                              sizeof(cfg_state.fast.data));
+    } else {
+        result = nvs_erase_key(handle, "fast");
+        result = (result == ESP_ERR_NVS_NOT_FOUND) ? ESP_OK : result;
+    }
+
+    /* Fast connect data is optional, so do not fail if it can not be set. */
+    if(result == ESP_OK){
+        cfg_state.fast.dirty = false;
+        ++cfg_state.flash_stats.fast_writes;
+    } else {
+        ESP_LOGW(TAG, "[%s] Writing fast connect data failed.", __func__);
+    }
+#endif
+}
+
+/** Save configuration to NVS.
+ *
+ * Store the wifi_cfg in NVS. The config is written to the slot not holding
+ * the currently saved config, so on return there will always be either
+ * the old or the new config stored in NVS, even if power fails while
+ * writing.
+ * Nothing is written if the encoded config matches the one already stored.
+ *
+ * @param[in] cfg Configuration to be saved.
+ * @return ESP_OK if configuration was saved, ESP_ERR_* otherwise.
+ */
+static esp_err_t save_config(struct wifi_cfg *cfg)
+{
+    nvs_handle handle;
+    union nvs_slot_buf *buf;
+    struct tlv_buf tlv;
+    size_t len;
+    esp_err_t result;
+
+    /* No point in saving the factory default settings. */
+    if(cfg->is_default){
+        return clear_config();
+    }
+
+    buf = nvs_bufs_get();
+    if(buf == NULL){
+        ESP_LOGE(TAG, "[%s] Out of memory.", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(&tlv, 0x0, sizeof(tlv));
+    tlv.data = buf->slot.data;
+    tlv.size = sizeof(buf->slot.data);
+
+    result = cfg_to_tlv(cfg, &tlv);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Encoding config failed.", __func__);
+        nvs_bufs_put(buf);
+        return result;
+    }
+
+    len = sizeof(buf->hdr) + tlv.len;
+
+    buf->hdr.magic = NVS_SLOT_MAGIC;
+    buf->hdr.version = NVS_CFG_VER;
+    buf->hdr.seq = cfg_state.nvs.seq + 1;
+    buf->hdr.crc = slot_crc(buf, len);
+
+    if(cfg_state.nvs.slot != NVS_SLOT_NONE
+       && buf->hdr.crc == cfg_state.nvs.crc
+       && !cfg_state.fast.dirty)
+    {
+        ESP_LOGD(TAG, "[%s] Config unchanged, not saving.", __func__);
+        ++cfg_state.flash_stats.skipped;
+        nvs_bufs_put(buf);
+        return ESP_OK;
+    }
+
+    result = nvs_open(WMNGR_NAMESPACE, NVS_READWRITE, &handle);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] nvs_open() failed.", __func__);
+        nvs_bufs_put(buf);
+        return result;
+    }
+
+    if(cfg_state.nvs.slot != NVS_SLOT_NONE
+       && buf->hdr.crc == cfg_state.nvs.crc)
+    {
+        ++cfg_state.flash_stats.skipped;
+    } else {
+        result = write_slot(handle, buf, len);
+        if(result != ESP_OK){
+            /* The previously active slot has not been touched. */
+            ESP_LOGE(TAG, "[%s] Writing config failed.", __func__);
+            ++cfg_state.flash_stats.failures;
+            goto on_exit;
+        }
+    }
+
+    save_fast_connect(handle);
+
+on_exit:
+    (void) nvs_commit(handle);
+    nvs_close(handle);
+    nvs_bufs_put(buf);
+
+    return result;
+}
+
+static esp_err_t load_config(void)
+{
+    struct cfg_obj *obj;
+    esp_err_t result;
+
+    obj = cfg_obj_alloc();
+    if(obj == NULL){
+        return ESP_ERR_NO_MEM;
+    }
+
+    /*
+     * Restore saved WiFi config or fall back to compiled-in defaults.
+     * Setting state to update will trigger applying this config.
+     */
+    result = get_saved_config(&(obj->cfg), &cfg_state.nvs);
+    if(result != ESP_OK){
+        ESP_LOGI(TAG, "[%s] No saved config found, setting defaults",
+                 __func__);
+        set_defaults(&(obj->cfg));
+
+        memset(&cfg_state.nvs, 0x0, sizeof(cfg_state.nvs));
+        cfg_state.nvs.slot = NVS_SLOT_NONE;
+    }
+
+    /* Any config read from NVS or restored from defaults should be valid. */
+    obj->cfg.is_valid = true;
+
+    /* Make sure we do not fall back to defaults if configured AP is down. */
+    cfg_obj_set(&cfg_state.new, obj);
+    cfg_obj_set(&cfg_state.saved, obj);
+    cfg_obj_set(&cfg_state.current, obj);
+    cfg_obj_put(obj);
+
+    load_fast_connect();
+
+    return ESP_OK;
+}
+
+/* Helper function to check if WiFi is connected in station mode. */
+static bool sta_connected(void)
+{
+    EventBits_t events;
 
     events = xEventGroupGetBits(wifi_events);
 
-    /* Finally, start a scan. Unless there is one running already. */
-    if(!(events & (BIT_SCAN_RUNNING | BIT_SCAN_DONE))){
-        ESP_LOGI(TAG, "[%s] Starting scan.", __func__);
+    return !!(events & BIT_STA_CONNECTED);
+}
+
+/*
+ * Helper to set up a STA config for connecting directly to the AP we were
+ * associated with last, skipping the full channel scan. The cached BSSID
+ * is only used if it belongs to the configured SSID and the user did not
+ * set a BSSID explicitly.
+ */
+static void fast_connect_apply(wifi_config_t *sta)
+{
+    cfg_state.fast.active = false;
+
+#if defined(CONFIG_WMNGR_FAST_CONNECT)
+    if(!cfg_state.fast.valid || sta->sta.bssid_set){
+        return;
+    }
+
+    if(memcmp(sta->sta.ssid, cfg_state.fast.data.ssid, sizeof(sta->sta.ssid))){
+        return;
+    }
+
+    ESP_LOGI(TAG, "[%s] Fast connect on channel %d.",
+             __func__, cfg_state.fast.data.channel);
+
+    sta->sta.bssid_set = true;
+    memcpy(sta->sta.bssid, cfg_state.fast.data.bssid, sizeof(sta->sta.bssid));
+    sta->sta.channel = cfg_state.fast.data.channel;
+    cfg_state.fast.active = true;
+#endif
+}
+
+/* Helper to record BSSID and channel of the AP we are associated with. */
+static void fast_connect_update(void)
+{
+#if defined(CONFIG_WMNGR_FAST_CONNECT)
+    wifi_ap_record_t ap_info;
+    struct fast_connect_nvs data;
+    esp_err_t result;
+
+    result = esp_wifi_sta_get_ap_info(&ap_info);
+    if(result != ESP_OK){
+        ESP_LOGW(TAG, "[%s] esp_wifi_sta_get_ap_info(): %d %s",
+                 __func__, result, esp_err_to_name(result));
+        return;
+    }
+
+    memset(&data, 0x0, sizeof(data));
+    memcpy(data.ssid, cfg_state.current->cfg.sta.sta.ssid, sizeof(data.ssid));
+    memcpy(data.bssid, ap_info.bssid, sizeof(data.bssid));
+    data.channel = ap_info.primary;
+
+    if(!cfg_state.fast.valid
+       || memcmp(&data, &(cfg_state.fast.data), sizeof(data)))
+    {
+        memcpy(&(cfg_state.fast.data), &data, sizeof(cfg_state.fast.data));
+        cfg_state.fast.valid = true;
+        cfg_state.fast.dirty = true;
+    }
+#endif
+}
+
+/*
+ * Helpers for comparing configurations field by field. Comparing the raw
+ * structs does not work, because they contain padding, unused bytes
+ * after NUL terminated strings and members that get rewritten by the WiFi
+ * driver or by us.
+ */
+
+/* Compare two NUL terminated or max_len sized strings. */
+static bool strs_are_equal(const uint8_t *a, const uint8_t *b, size_t max_len)
+{
+    return !strncmp((const char *) a, (const char *) b, max_len);
+}
+
+static bool ip_infos_are_equal(const esp_netif_ip_info_t *a,
+                               const esp_netif_ip_info_t *b)
+{
+    return ip4_addr_cmp(&(a->ip), &(b->ip))
+           && ip4_addr_cmp(&(a->netmask), &(b->netmask))
+           && ip4_addr_cmp(&(a->gw), &(b->gw));
+}
+
+static bool ap_cfgs_are_equal(const wifi_ap_config_t *a,
+                              const wifi_ap_config_t *b)
+{
+    size_t len_a, len_b;
+
+    /* SSID is either ssid_len bytes long or NUL terminated. */
+    len_a = (a->ssid_len > 0) ? MIN(a->ssid_len, sizeof(a->ssid))
+                              : strnlen((const char *) a->ssid, sizeof(a->ssid));
+    len_b = (b->ssid_len > 0) ? MIN(b->ssid_len, sizeof(b->ssid))
+                              : strnlen((const char *) b->ssid, sizeof(b->ssid));
+    if(len_a != len_b || memcmp(a->ssid, b->ssid, len_a)){
+        return false;
+    }
+
+    if(a->authmode != b->authmode){
+        return false;
+    }
+
+    /* Password is not used for open APs. */
+    if(a->authmode != WIFI_AUTH_OPEN
+       && !strs_are_equal(a->password, b->password, sizeof(a->password)))
+    {
+        return false;
+    }
+
+    /*
+     * max_connection is not compared, it is always set to MAX_AP_CLIENTS.
+     * A beacon_interval of 0 makes the driver use its default of 100.
+     */
+    return a->channel == b->channel
+           && a->ssid_hidden == b->ssid_hidden
+           && (a->beacon_interval ? a->beacon_interval : 100)
+               == (b->beacon_interval ? b->beacon_interval : 100);
+}
+
+static bool sta_cfgs_are_equal(const wifi_sta_config_t *a,
+                               const wifi_sta_config_t *b)
+{
+    if(!strs_are_equal(a->ssid, b->ssid, sizeof(a->ssid))
+       || !strs_are_equal(a->password, b->password, sizeof(a->password)))
+    {
+        return false;
+    }
+
+    if(a->bssid_set != b->bssid_set
+       || (a->bssid_set && memcmp(a->bssid, b->bssid, sizeof(a->bssid))))
+    {
+        return false;
+    }
+
+    /* A listen_interval of 0 makes the driver use its default of 3. */
+    return a->scan_method == b->scan_method
+           && a->channel == b->channel
+           && (a->listen_interval ? a->listen_interval : 3)
+               == (b->listen_interval ? b->listen_interval : 3)
+           && a->sort_method == b->sort_method
+           && a->threshold.rssi == b->threshold.rssi
+           && a->threshold.authmode == b->threshold.authmode
+           && a->pmf_cfg.capable == b->pmf_cfg.capable
+           && a->pmf_cfg.required == b->pmf_cfg.required;
+}
+
+/*
+ * Find out which parts of the system need to be reconfigured when
+ * changing from config "old" to config "new".
+ */
+static unsigned int cfg_changes(struct wifi_cfg *new, struct wifi_cfg *old)
+{
+    unsigned int changes;
+    unsigned int idx;
+
+    changes = 0;
+
+    if(new->mode != old->mode){
+        changes |= CFG_CHG_MODE;
+    }
+
+    if(!ap_cfgs_are_equal(&(new->ap.ap), &(old->ap.ap))
+       || !ip_infos_are_equal(&(new->ap_ip_info), &(old->ap_ip_info)))
+    {
+        changes |= CFG_CHG_AP;
+    }
+
+    if(!sta_cfgs_are_equal(&(new->sta.sta), &(old->sta.sta))
+       || new->sta_connect != old->sta_connect)
+    {
+        changes |= CFG_CHG_STA;
+    }
+
+    if(new->sta_static != old->sta_static){
+        changes |= CFG_CHG_NETIF;
+    } else if(new->sta_static){
+        if(!ip_infos_are_equal(&(new->sta_ip_info), &(old->sta_ip_info))){
+            changes |= CFG_CHG_NETIF;
+        }
+
+        for(idx = 0; idx < ARRAY_SIZE(new->sta_dns_info); ++idx){
+            if(!ip_addr_cmp(&(new->sta_dns_info[idx].ip),
+                            &(old->sta_dns_info[idx].ip)))
+            {
+                changes |= CFG_CHG_NETIF;
+            }
+        }
+    }
+
+    return changes;
+}
+
+/*
+ * Check if two configs are equal. Settings of an interface that is not
+ * used in the configured WiFi mode are ignored.
+ */
+static bool cfgs_are_equal(struct wifi_cfg *a, struct wifi_cfg *b)
+{
+    unsigned int changes;
+
+    changes = cfg_changes(a, b);
+
+    if(a->mode == WIFI_MODE_STA){
+        changes &= ~CFG_CHG_AP;
+    } else if(a->mode == WIFI_MODE_AP){
+        changes &= ~(CFG_CHG_STA | CFG_CHG_NETIF);
+    }
+
+    return changes == 0;
+}
+
+/* Helper to set the AP interface's WiFi config. */
+static esp_err_t apply_ap_cfg(const struct wifi_cfg *cfg)
+{
+    esp_netif_ip_info_t ip_info;
+    wifi_config_t ap;
+    esp_err_t result;
+
+    /* The config object is shared and must not be modified. */
+    memcpy(&ap, &(cfg->ap), sizeof(ap));
+    ap.ap.max_connection = MAX_AP_CLIENTS;
+
+    result = esp_wifi_set_config(WIFI_IF_AP, &ap);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] esp_wifi_set_config() AP: %d %s",
+                 __func__, result, esp_err_to_name(result));
+        goto on_exit;
+    }
+
+    /*
+     * Only restart the DHCP server if the AP's address actually changes,
+     * clients would lose their leases otherwise.
+     */
+    if(esp_netif_get_ip_info(ap_netif, &ip_info) == ESP_OK
+       && ip_infos_are_equal(&ip_info, &(cfg->ap_ip_info)))
+    {
+        goto on_exit;
+    }
+
+    (void) esp_netif_dhcps_stop(ap_netif);
+
+    result = esp_netif_set_ip_info(ap_netif, &(cfg->ap_ip_info));
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] esp_netif_set_ip_info() AP: %d %s",
+                 __func__, result, esp_err_to_name(result));
+    }
+
+    /* Bring the DHCP server back up even if the address was rejected. */
+    if(esp_netif_dhcps_start(ap_netif) != ESP_OK){
+        ESP_LOGE(TAG, "[%s] esp_netif_dhcps_start() failed.", __func__);
+    }
+
+on_exit:
+    return result;
+}
+
+/* Helper to set the STA interface's WiFi config. */
+static esp_err_t apply_sta_cfg(struct wifi_cfg *cfg)
+{
+    wifi_config_t sta;
+    esp_err_t result;
+
+    memcpy(&sta, &(cfg->sta), sizeof(sta));
+    fast_connect_apply(&sta);
+
+    result = esp_wifi_set_config(WIFI_IF_STA, &sta);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] esp_wifi_set_config() STA: %d %s",
+                 __func__, result, esp_err_to_name(result));
+    }
+
+    return result;
+}
+
+/* Helper to set the STA interface's IP and DNS config. */
+static esp_err_t apply_netif_cfg(struct wifi_cfg *cfg)
+{
+    unsigned int idx;
+    esp_err_t result;
+
+    result = ESP_OK;
 
-        memset(&scan_cfg, 0x0, sizeof(scan_cfg));
-        scan_cfg.show_hidden = true;
-        scan_cfg.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+    if(cfg->sta_static){
+        (void) esp_netif_dhcpc_stop(sta_netif);
 
-        xEventGroupSetBits(wifi_events, BIT_SCAN_START);
-        result = esp_wifi_scan_start(&scan_cfg, false);
-        if(result == ESP_OK){
-            ESP_LOGI(TAG, "[%s] Scan started.", __func__);
-            xEventGroupSetBits(wifi_events, BIT_SCAN_RUNNING);
-        } else {
-            ESP_LOGE(TAG, "[%s] Starting AP scan failed.", __func__);
+        result = esp_netif_set_ip_info(sta_netif, &cfg->sta_ip_info);
+        if(result != ESP_OK){
+            ESP_LOGE(TAG, "[%s] esp_netif_set_ip_info() STA: %d %s",
+                    __func__, result, esp_err_to_name(result));
+        }
+
+        for(idx = 0; idx < ARRAY_SIZE(cfg->sta_dns_info); ++idx){
+            if(ip_addr_isany_val(cfg->sta_dns_info[idx].ip)){
+                continue;
+            }
+
+            result = esp_netif_set_dns_info(sta_netif,
+                                            idx,
+                                            &(cfg->sta_dns_info[idx]));
+            if(result != ESP_OK){
+                ESP_LOGE(TAG, "[%s] Setting DNS server IP failed.",
+                        __func__);
+            }
         }
     } else {
-        ESP_LOGI(TAG, "[%s] Scan aleady running.", __func__);
+        (void) esp_netif_dhcpc_start(sta_netif);
     }
 
-on_exit:
-    return;
+    return result;
 }
 
-/** Read saved configuration from NVS.
+/*
+ * Helper function to set WiFi configuration from a config object.
  *
- * Read configuration from NVS and store it in the struct wifi_cfg.
- * @param[out] cfg Configuration read from NVS.
- * @return ESP_OK if valid configuration was found in NVS, ESP_ERR_* otherwise.
+ * Unless a full reconfiguration is requested, only the parts that differ
+ * from the config currently applied get changed. A changed mode always
+ * requires resetting and restarting the WiFi driver, changed AP or STA
+ * settings only require updating the respective interface, and changed
+ * IP or DNS settings do not touch the WiFi driver at all.
  */
-static esp_err_t get_saved_config(struct wifi_cfg *cfg)
+static esp_err_t set_wifi_cfg(struct cfg_obj *obj, bool full)
 {
-    nvs_handle handle;
-    size_t len;
-    uint32_t tmp;
+    struct wifi_cfg *cfg;
+    unsigned int changes;
+    bool has_ap, has_sta;
     esp_err_t result;
 
+    ESP_LOGD(TAG, "[%s] Called.", __FUNCTION__);
+
+    /*
+     * FIXME: we should check for errors. OTOH, this is also used
+     *        for the fall-back mechanism, so aborting on error is
+     *        probably a bad idea.
+     */
+
+    cfg = &(obj->cfg);
+    changes = cfg_changes(cfg, &(cfg_state.current->cfg));
+    if(full || (changes & CFG_CHG_MODE)){
+        changes = CFG_CHG_ALL;
+    }
+
+    ESP_LOGI(TAG, "[%s] Applying changes: %s%s%s%s", __func__,
+             (changes & CFG_CHG_MODE) ? "mode " : "",
+             (changes & CFG_CHG_AP) ? "AP " : "",
+             (changes & CFG_CHG_STA) ? "STA " : "",
+             (changes & CFG_CHG_NETIF) ? "netif" : "");
+
+    cfg_obj_set(&cfg_state.current, obj);
+
+    has_ap = (cfg->mode == WIFI_MODE_APSTA || cfg->mode == WIFI_MODE_AP);
+    has_sta = (cfg->mode == WIFI_MODE_APSTA || cfg->mode == WIFI_MODE_STA);
     result = ESP_OK;
 
-    memset(cfg, 0x0, sizeof(*cfg));
+    /* Tear down STA connection if its settings are about to change. */
+    if(changes & (CFG_CHG_MODE | CFG_CHG_STA)){
+        (void) esp_wifi_scan_stop();
+        (void) esp_wifi_disconnect();
+        xEventGroupClearBits(wifi_events, BIT_STA_CONNECTED | BIT_STA_GOT_IP);
+    }
 
-    result = nvs_open(WMNGR_NAMESPACE, NVS_READONLY, &handle);
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] nvs_open() failed.", __func__);
-        return result;
+    if(changes & CFG_CHG_MODE){
+        result = esp_wifi_restore();
+        if(result != ESP_OK){
+            ESP_LOGE(TAG, "[%s] esp_wifi_restore(): %d %s",
+                     __func__, result, esp_err_to_name(result));
+        }
+
+        result = esp_wifi_set_mode(cfg->mode);
+        if(result != ESP_OK){
+            ESP_LOGE(TAG, "[%s] esp_wifi_set_mode(): %d %s",
+                     __func__, result, esp_err_to_name(result));
+        }
     }
 
-    /* Make sure we know how to handle the stored configuration. */
-    result = nvs_get_u32(handle, "version", &tmp);
-    if(result != ESP_OK){
-        goto on_exit;
+    if(has_ap && (changes & CFG_CHG_AP)){
+        result = apply_ap_cfg(cfg);
     }
 
-    if(tmp > NVS_CFG_VER){
-        result = ESP_ERR_INVALID_VERSION;
-        goto on_exit;
+    if(has_sta && (changes & CFG_CHG_STA)){
+        result = apply_sta_cfg(cfg);
     }
 
-    /* Read back the base type components of the struct wifi_cfg. */
-    result = nvs_get_u32(handle, "mode", &(tmp));
-    if(result != ESP_OK){
-        goto on_exit;
+    if(has_sta && (changes & CFG_CHG_NETIF)){
+        result = apply_netif_cfg(cfg);
     }
-    cfg->mode = (wifi_mode_t) tmp;
 
-    result = nvs_get_u32(handle, "sta_static", &tmp);
-    if(result != ESP_OK){
-        goto on_exit;
+    if(changes & CFG_CHG_MODE){
+        result = esp_wifi_start();
+        if(result != ESP_OK){
+            ESP_LOGE(TAG, "[%s] esp_wifi_start(): %d %s",
+                     __func__, result, esp_err_to_name(result));
+        }
     }
-    cfg->sta_static = (bool) tmp;
 
-    result = nvs_get_u32(handle, "sta_connect", &tmp);
-    if(result != ESP_OK){
-        goto on_exit;
+    if(has_sta && cfg->sta_connect && (changes & CFG_CHG_STA)){
+        result = esp_wifi_connect();
+        if(result != ESP_OK){
+            ESP_LOGE(TAG, "[%s] esp_wifi_connect(): %d %s",
+                     __func__, result, esp_err_to_name(result));
+        }
     }
-    cfg->sta_connect = (bool) tmp;
+
+    return result;
+}
+
+/*
+ * Helper to fetch current WiFi configuration from the system and store it in
+ * a wifi_cfg struct.
+ */
+static esp_err_t get_wifi_cfg(struct wifi_cfg *cfg)
+{
+    esp_netif_dhcp_status_t dhcp_status;
+    unsigned int idx;
+    esp_err_t result;
+
+    result = ESP_OK;
+    memset(cfg, 0x0, sizeof(*cfg));
 
     /*
-     * The esp-idf types are stored as binary blobs. This is problematic
-     * because their memory layout and padding might change between esp-idf
-     * releases or by using a different toolchain or compiler options.
-     * We do a very basic sanity check by comparing the types' sizes to the
-     * records' lengths, but this is not guaranteed to catch every case.
+     * Unless we are currently connected, we can not know for sure if
+     * esp_wifi_connect() has been called. If we are not connected, we just
+     * take the value from cfg_state.current.
      */
+    if(sta_connected() || cfg_state.current->cfg.sta_connect){
+        cfg->sta_connect = true;
+    }
 
-    len = sizeof(cfg->ap);
-    result = nvs_get_blob(handle, "ap", &(cfg->ap), &len);
-    if(result != ESP_OK || len != sizeof(cfg->ap)){
-        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+    result = esp_wifi_get_mode(&(cfg->mode));
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Error fetching WiFi mode.", __func__);
         goto on_exit;
     }
 
-    len = sizeof(cfg->sta);
-    result = nvs_get_blob(handle, "sta", &(cfg->sta), &len);
-    if(result != ESP_OK || len != sizeof(cfg->sta)){
-        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+    result = esp_wifi_get_config(WIFI_IF_STA, &(cfg->sta));
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Error fetching STA config.", __func__);
         goto on_exit;
     }
 
-    len = sizeof(cfg->ap_ip_info);
-    result = nvs_get_blob(handle, "ap_ip", &(cfg->ap_ip_info), &len);
-    if(result != ESP_OK || len != sizeof(cfg->ap_ip_info)){
-        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
-        goto on_exit;
+    /* Hide the BSSID and channel set up for fast connecting. */
+    if(cfg_state.fast.active){
+        cfg->sta.sta.bssid_set = cfg_state.current->cfg.sta.sta.bssid_set;
+        memcpy(cfg->sta.sta.bssid, cfg_state.current->cfg.sta.sta.bssid,
+               sizeof(cfg->sta.sta.bssid));
+        cfg->sta.sta.channel = cfg_state.current->cfg.sta.sta.channel;
     }
 
-    len = sizeof(cfg->sta_ip_info);
-    result = nvs_get_blob(handle, "sta_ip", &(cfg->sta_ip_info), &len);
-    if(result != ESP_OK || len != sizeof(cfg->sta_ip_info)){
-        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+    result = esp_netif_dhcpc_get_status(sta_netif, &dhcp_status);
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Error fetching DHCP status.", __func__);
         goto on_exit;
     }
 
-    len = sizeof(cfg->sta_dns_info);
-    result = nvs_get_blob(handle, "sta_dns", &(cfg->sta_dns_info), &len);
-    if(result != ESP_OK || len != sizeof(cfg->sta_dns_info)){
-        result = (result != ESP_OK) ? result : ESP_ERR_NOT_FOUND;
+    if(dhcp_status == ESP_NETIF_DHCP_STOPPED){
+        cfg->sta_static = 1;
+
+        result = esp_netif_get_ip_info(sta_netif, &cfg->sta_ip_info);
+        if(result != ESP_OK){
+            ESP_LOGE(TAG, "[%s] esp_netif_get_ip_info() STA: %d %s",
+                    __func__, result, esp_err_to_name(result));
+            goto on_exit;
+        }
+
+        for(idx = 0; idx < ARRAY_SIZE(cfg->sta_dns_info); ++idx){
+            result = esp_netif_get_dns_info(sta_netif,
+                                            idx,
+                                            &(cfg->sta_dns_info[idx]));
+            if(result != ESP_OK){
+                ESP_LOGE(TAG, "[%s] Getting DNS server IP failed.",
+                         __func__);
+                goto on_exit;
+            }
+
+        }
+    }
+
+    result = esp_wifi_get_config(WIFI_IF_AP, &(cfg->ap));
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Error fetching AP config.", __func__);
         goto on_exit;
     }
 
-on_exit:
+    result = esp_netif_get_ip_info(ap_netif, &cfg->ap_ip_info);
     if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] Reading config failed.", __func__);
+        ESP_LOGE(TAG, "[%s] esp_netif_get_ip_info() AP: %d %s",
+                __func__, result, esp_err_to_name(result));
+        goto on_exit;
     }
 
-    nvs_close(handle);
+    cfg->is_valid = true;
+
+on_exit:
     return result;
 }
 
-static esp_err_t clear_config(void)
+/*
+ * Change the state, wake up tasks waiting for the new state and post a
+ * WMNGR_EVENT_STATE_CHANGED event. Must be called with cfg_state.lock held.
+ */
+static void set_state(enum wmngr_state state)
 {
-    nvs_handle handle;
+    struct wmngr_event_state data;
     esp_err_t result;
 
-    result = nvs_open(WMNGR_NAMESPACE, NVS_READWRITE, &handle);
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] nvs_open() failed.", __func__);
-        return result;
+    if(state == cfg_state.state){
+        return;
     }
 
-    result = nvs_erase_all(handle);
+    data.old_state = cfg_state.state;
+    data.new_state = state;
+
+    cfg_state.state = state;
+    stats_state(data.old_state, state);
+    trace_put(wmngr_trace_state, data.old_state, state, 0, ESP_OK);
+
+    xEventGroupClearBits(state_events, STATE_BITS & ~WMNGR_STATE_BIT(state));
+    xEventGroupSetBits(state_events, WMNGR_STATE_BIT(state));
+
+    /* Do not block the state machine if the event queue is full. */
+    result = esp_event_post(WMNGR_EVENT, WMNGR_EVENT_STATE_CHANGED,
+                            &data, sizeof(data), 0);
     if(result != ESP_OK){
-        goto on_exit;
+        ESP_LOGD(TAG, "[%s] Posting state change failed: %d %s",
+                 __func__, result, esp_err_to_name(result));
     }
+}
 
-    result = nvs_commit(handle);
-    if(result != ESP_OK){
-        goto on_exit;
+/*
+ * Get the config the WiFi Manager is heading for. This is the latest
+ * requested config while a change is in progress, the current one
+ * otherwise. Must be called with cfg_state.lock held.
+ */
+static struct cfg_obj *latest_cfg(void)
+{
+    if(cfg_state.cmd.obj != NULL){
+        return cfg_state.cmd.obj;
     }
 
-on_exit:
-    nvs_close(handle);
+    if(!state_is_stable(cfg_state.state)){
+        return cfg_state.new;
+    }
 
-    return result;
+    return cfg_state.current;
 }
 
-/** Save configuration to NVS.
- *
- * Store the wifi_cfg in NVS. The previously stored configuration will be
- * erased and not be recovered on error, so on return there will either be
- * a valid config or no config at all stored in the NVS.
- * This guarantees that the device is either reachable by the last valid
- * configuration or recoverable by the factory default settings.
- *
- * @param[in] cfg Configuration to be saved.
- * @return ESP_OK if configuration was saved, ESP_ERR_* otherwise.
+/*
+ * Release replaced snapshots. A reader might have loaded a pointer to one
+ * of them just before it got replaced and not have taken its reference
+ * yet. Once no reader is inside snap_get(), none of them can be loaded
+ * any more. Must be called with cfg_state.lock held.
  */
-static esp_err_t save_config(struct wifi_cfg *cfg)
+static void snap_reclaim(void)
 {
-    nvs_handle handle;
-    esp_err_t result;
+    unsigned int idx;
 
-    result = nvs_open(WMNGR_NAMESPACE, NVS_READWRITE, &handle);
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] nvs_open() failed.", __func__);
-        return result;
+    if(cfg_state.snap_num_retired == 0
+       || atomic_load(&cfg_state.snap_readers) != 0)
+    {
+        return;
     }
 
-    /*
-     * Erase the previous config so that we can be sure that we do not end up
-     * with a mix of the old and new in case of a power-fail.
-     *
-     * FIXME: We should use a two slot mechanism so that the old config will
-     *        not be touched until the new one has been written successfully.
-     */
-    result = clear_config();
-    if(result != ESP_OK){
-        goto on_exit;
+    for(idx = 0; idx < cfg_state.snap_num_retired; ++idx){
+        cfg_obj_put(cfg_state.snap_retired[idx]);
+        cfg_state.snap_retired[idx] = NULL;
     }
 
-    /* No point in saving the factory default settings. */
-    if(cfg->is_default){
-        result = ESP_OK;
-        goto on_exit;
-    }
+    cfg_state.snap_num_retired = 0;
+}
 
-    /*
-     * Write all elements of the struct wifi_cfg individually. This gives
-     * us a chance to extend it later without forcing the user into a
-     * "factory reset" after a firmware update.
-     */
+/*
+ * Make the latest config available to lock-free readers if it has changed.
+ * This never waits for readers. If too many replaced snapshots could not
+ * be released yet, the old snapshot stays published until the next call.
+ * Must be called with cfg_state.lock held.
+ */
+static void publish_cfg(void)
+{
+    struct cfg_obj *obj, *old;
 
-    result = nvs_set_u32(handle, "version", NVS_CFG_VER);
-    if(result != ESP_OK){
-        goto on_exit;
+    snap_reclaim();
+
+    obj = latest_cfg();
+    if(obj == NULL || obj == atomic_load(&cfg_state.snap)){
+        return;
     }
 
-    result = nvs_set_u32(handle, "mode", cfg->mode);
-    if(result != ESP_OK){
-        goto on_exit;
+    if(cfg_state.snap_num_retired == SNAP_RETIRED){
+        return;
     }
 
-    result = nvs_set_u32(handle, "sta_static", cfg->sta_static);
-    if(result != ESP_OK){
-        goto on_exit;
+    kref_get(&(obj->ref_cnt));
+    old = atomic_exchange(&cfg_state.snap, obj);
+    atomic_store(&cfg_state.snap_gen, obj->gen);
+
+    if(old != NULL){
+        cfg_state.snap_retired[cfg_state.snap_num_retired] = old;
+        ++cfg_state.snap_num_retired;
+        snap_reclaim();
     }
+}
+
+/* Pin the current config snapshot. Does not take cfg_state.lock. */
+static struct cfg_obj *snap_get(void)
+{
+    struct cfg_obj *obj;
+
+    atomic_fetch_add(&cfg_state.snap_readers, 1);
 
-    result = nvs_set_u32(handle, "sta_connect", cfg->sta_connect);
-    if(result != ESP_OK){
-        goto on_exit;
+    obj = atomic_load(&cfg_state.snap);
+    if(obj != NULL && !kref_get_unless_zero(&(obj->ref_cnt))){
+        obj = NULL;
     }
 
-    /* Store the esp-idf types as blobs. */
-    /* FIXME: we should also store them component-wise. */
-    result = nvs_set_blob(handle, "ap", &(cfg->ap), sizeof(cfg->ap));
-    if(result != ESP_OK){
-        goto on_exit;
-    }
+    atomic_fetch_sub(&cfg_state.snap_readers, 1);
 
-    result = nvs_set_blob(handle, "sta", &(cfg->sta), sizeof(cfg->sta));
-    if(result != ESP_OK){
-        goto on_exit;
-    }
+    return obj;
+}
 
-    result = nvs_set_blob(handle, "ap_ip", &(cfg->ap_ip_info),
-                            sizeof(cfg->ap_ip_info));
-    if(result != ESP_OK){
-        goto on_exit;
+/* Hand out a new ticket. Must be called with cfg_state.lock held. */
+static uint32_t cmd_ticket(void)
+{
+    /* Ticket 0 is reserved for "none". */
+    ++cfg_state.cmd.issued;
+    if(cfg_state.cmd.issued == 0){
+        ++cfg_state.cmd.issued;
     }
 
-    result = nvs_set_blob(handle, "sta_ip", &(cfg->sta_ip_info),
-                            sizeof(cfg->sta_ip_info));
-    if(result != ESP_OK){
-        goto on_exit;
-    }
+    return cfg_state.cmd.issued;
+}
 
-    result = nvs_set_blob(handle, "sta_dns", &(cfg->sta_dns_info),
-                            sizeof(cfg->sta_dns_info));
-    if(result != ESP_OK){
-        goto on_exit;
+/*
+ * Record the result of the request with the given ticket and wake up
+ * esp_wmngr_wait_ticket() callers, so they can check whether it was
+ * theirs. Must be called with cfg_state.lock held.
+ */
+static void cmd_complete(uint32_t ticket, esp_err_t result)
+{
+    struct cmd_result *rec;
+
+    rec = &(cfg_state.cmd.results[cfg_state.cmd.next]);
+    rec->ticket = ticket;
+    rec->result = result;
+    cfg_state.cmd.next = (cfg_state.cmd.next + 1) % CMD_RESULTS;
+
+    xEventGroupSetBits(wifi_events, BIT_CMD_DONE);
+}
+
+/*
+ * Get the result of the request with the given ticket. Returns
+ * ESP_ERR_NOT_FINISHED while it is still waiting or being applied and
+ * ESP_ERR_NOT_FOUND if its result has already been dropped from the ring.
+ * Must be called with cfg_state.lock held.
+ */
+static esp_err_t cmd_result(uint32_t ticket)
+{
+    unsigned int idx;
+
+    if(ticket == cfg_state.cmd.active
+       || (cfg_state.cmd.obj != NULL && ticket == cfg_state.cmd.queued))
+    {
+        return ESP_ERR_NOT_FINISHED;
     }
 
-on_exit:
-    if(result != ESP_OK){
-        /* we do not want to leave a half-written config lying around. */
-        ESP_LOGE(TAG, "[%s] Writing config failed.", __func__);
-        (void) nvs_erase_all(handle);
+    for(idx = 0; idx < CMD_RESULTS; ++idx){
+        if(cfg_state.cmd.results[idx].ticket == ticket){
+            return cfg_state.cmd.results[idx].result;
+        }
     }
 
-    (void) nvs_commit(handle);
-    nvs_close(handle);
+    return ESP_ERR_NOT_FOUND;
+}
 
-    return result;
+/*
+ * Get the result of the config being applied from the current state. It
+ * only succeeds once the config is up and, if configured, connected.
+ * Returns ESP_ERR_NOT_FINISHED while there is no outcome yet.
+ */
+static esp_err_t cmd_state_result(void)
+{
+    switch(cfg_state.state){
+    case wmngr_state_connected:
+    case wmngr_state_idle:
+        return ESP_OK;
+    case wmngr_state_failed:
+        return ESP_FAIL;
+    default:
+        return ESP_ERR_NOT_FINISHED;
+    }
 }
 
-static esp_err_t load_config(void)
+/*
+ * Start switching to the config in obj. The current configuration is
+ * backed up for fall-back first. If the config differs from the current
+ * one, the state is set to wmngr_state_update and the caller has to make
+ * sure that the state machine gets triggered. Must be called with
+ * cfg_state.lock held and cfg_state.state in a stable state.
+ */
+static esp_err_t apply_cfg(struct cfg_obj *obj, uint32_t ticket)
 {
+    struct cfg_obj *saved;
     esp_err_t result;
 
-    /*
-     * Restore saved WiFi config or fall back to compiled-in defaults.
-     * Setting state to update will trigger applying this config.
-     */
-    result = get_saved_config(&cfg_state.new);
+    /* A request still waiting for a connection is replaced by this one. */
+    if(cfg_state.cmd.active != 0){
+        cmd_complete(cfg_state.cmd.active, CMD_SUPERSEDED);
+        cfg_state.cmd.active = 0;
+    }
+
+    /* Save current configuration for fall-back. */
+    saved = cfg_obj_alloc();
+    result = (saved != NULL) ? get_wifi_cfg(&(saved->cfg)) : ESP_ERR_NO_MEM;
     if(result != ESP_OK){
-        ESP_LOGI(TAG, "[%s] No saved config found, setting defaults",
+        ESP_LOGI(TAG, "[%s] Error fetching current WiFi config.",
                  __func__);
-        set_defaults(&cfg_state.new);
+        goto on_exit;
     }
 
-    /* Any config read from NVS or restored from defaults should be valid. */
-    cfg_state.new.is_valid = true;
+    cfg_obj_set(&cfg_state.saved, saved);
 
-    /* Make sure we do not fall back to defaults if configured AP is down. */
-    memcpy(&cfg_state.saved, &cfg_state.new, sizeof(cfg_state.saved));
-    memcpy(&cfg_state.current, &cfg_state.new, sizeof(cfg_state.current));
+    /*
+     * Always save new config if WiFi Manager is stopped. Otherwise check
+     * first if it is an actual configuration change.
+     */
+    if(cfg_state.state == wmngr_state_stopped
+       || !cfgs_are_equal(&(obj->cfg), &(saved->cfg)))
+    {
+        cfg_obj_set(&cfg_state.new, obj);
+        cfg_state.cmd.active = ticket;
 
-    return ESP_OK;
-}
+        /*
+         * The update will be applied once #esp_wmngr_start() gets called
+         * if WiFi Manager is currently stopped.
+         */
+        if(cfg_state.state != wmngr_state_stopped){
+            set_state(wmngr_state_update);
+        }
+    } else {
+        /* Nothing to change, it shares the outcome of the current config. */
+        cfg_state.cmd.active = ticket;
+        result = cmd_state_result();
+        if(result != ESP_ERR_NOT_FINISHED){
+            cfg_state.cmd.active = 0;
+            cmd_complete(ticket, result);
+        }
 
-/* Helper function to check if WiFi is connected in station mode. */
-static bool sta_connected(void)
-{
-    EventBits_t events;
+        result = ESP_OK;
+    }
 
-    events = xEventGroupGetBits(wifi_events);
+on_exit:
+    cfg_obj_put(saved);
 
-    return !!(events & BIT_STA_CONNECTED);
+    return result;
 }
 
-/* Helper function to set WiFi configuration from struct wifi_cfg. */
-static esp_err_t set_wifi_cfg(struct wifi_cfg *cfg)
+/*
+ * Submit a config change. The config object must not be shared yet. If a
+ * change is in progress, it is put into the mailbox and will be picked up
+ * by the state machine once it reaches a stable state.
+ */
+static esp_err_t submit_cfg(struct cfg_obj *obj, uint32_t *ticket)
 {
-    unsigned int idx;
+    uint32_t tmp;
     esp_err_t result;
 
-    ESP_LOGD(TAG, "[%s] Called.", __FUNCTION__);
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+    configASSERT(cfg_state.lock != NULL);
 
-    /*
-     * FIXME: we should check for errors. OTOH, this is also used
-     *        for the fall-back mechanism, so aborting on error is
-     *        probably a bad idea.
-     */
+    obj->cfg.is_default = false;
+    obj->cfg.is_valid = false;
+
+    if(cfg_lock(wmngr_lock_submit_cfg, CFG_DELAY) != pdTRUE){
+        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
+        return ESP_ERR_TIMEOUT;
+    }
 
-    memmove(&cfg_state.current, cfg, sizeof(*cfg));
+    tmp = cmd_ticket();
 
-    result = esp_wifi_restore();
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] esp_wifi_restore(): %d %s",
-                 __func__, result, esp_err_to_name(result));
+    if(!state_is_stable(cfg_state.state)){
+        if(cfg_state.cmd.obj != NULL){
+            ESP_LOGD(TAG, "[%s] Request %u superseded by %u.",
+                     __func__, cfg_state.cmd.queued, tmp);
+            cmd_complete(cfg_state.cmd.queued, CMD_SUPERSEDED);
+        }
+
+        cfg_obj_set(&cfg_state.cmd.obj, obj);
+        cfg_state.cmd.queued = tmp;
+        result = ESP_OK;
+        goto on_exit;
     }
 
-    result = esp_wifi_set_mode(cfg->mode);
+    result = apply_cfg(obj, tmp);
     if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] esp_wifi_set_mode(): %d %s",
-                 __func__, result, esp_err_to_name(result));
+        cmd_complete(tmp, result);
+        goto on_exit;
     }
 
-    if(cfg->mode == WIFI_MODE_APSTA || cfg->mode == WIFI_MODE_AP){
-        cfg->ap.ap.max_connection = MAX_AP_CLIENTS;
-        result = esp_wifi_set_config(WIFI_IF_AP, &(cfg->ap));
-        if(result != ESP_OK){
-            ESP_LOGE(TAG, "[%s] esp_wifi_set_config() AP: %d %s",
-                     __func__, result, esp_err_to_name(result));
+    /*
+     * Trigger an asynchronous update. This gives the httpd some time to
+     * send out the reply before possibly tearing down the connection.
+     */
+    if(cfg_state.state == wmngr_state_update){
+        if(xTimerChangePeriod(config_timer, CFG_DELAY, CFG_DELAY) != pdPASS){
+            set_state(wmngr_state_failed);
+            cfg_state.cmd.active = 0;
+            cmd_complete(tmp, ESP_ERR_TIMEOUT);
+            result = ESP_ERR_TIMEOUT;
+            goto on_exit;
         }
     }
 
-    if(cfg->mode == WIFI_MODE_APSTA || cfg->mode == WIFI_MODE_STA){
-        result = esp_wifi_set_config(WIFI_IF_STA, &(cfg->sta));
-        if(result != ESP_OK){
-            ESP_LOGE(TAG, "[%s] esp_wifi_set_config() STA: %d %s",
-                     __func__, result, esp_err_to_name(result));
-        }
-        if(cfg->sta_static){
-            (void) esp_netif_dhcpc_stop(sta_netif);
+on_exit:
+    cfg_unlock(wmngr_lock_submit_cfg);
 
-            result = esp_netif_set_ip_info(sta_netif, &cfg->sta_ip_info);
-            if(result != ESP_OK){
-                ESP_LOGE(TAG, "[%s] esp_netif_set_ip_info() STA: %d %s",
-                        __func__, result, esp_err_to_name(result));
-            }
+    if(result == ESP_OK && ticket != NULL){
+        *ticket = tmp;
+    }
 
-            for(idx = 0; idx < ARRAY_SIZE(cfg->sta_dns_info); ++idx){
-                if(ip_addr_isany_val(cfg->sta_dns_info[idx].ip)){
-                    continue;
-                }
+    return result;
+}
 
-                result = esp_netif_set_dns_info(sta_netif,
-                                                idx,
-                                                &(cfg->sta_dns_info[idx]));
-                if(result != ESP_OK){
-                    ESP_LOGE(TAG, "[%s] Setting DNS server IP failed.",
-                            __func__);
-                }
-            }
-        } else {
-            (void) esp_netif_dhcpc_start(sta_netif);
+/*
+ * Complete the request that has just been applied and take the next one
+ * out of the mailbox. Called by the state machine once it has reached a
+ * stable state. While reconnecting, the request stays active until the
+ * connection is made, it fails or a later request replaces it.
+ */
+static void cmd_process(void)
+{
+    struct cfg_obj *obj;
+    esp_err_t result;
+
+    if(cfg_state.cmd.active != 0){
+        result = cmd_state_result();
+        if(result != ESP_ERR_NOT_FINISHED){
+            cmd_complete(cfg_state.cmd.active, result);
+            cfg_state.cmd.active = 0;
         }
     }
 
-    result = esp_wifi_start();
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] esp_wifi_start(): %d %s",
-                 __func__, result, esp_err_to_name(result));
+    if(cfg_state.cmd.obj == NULL){
+        return;
     }
 
-    if(cfg->sta_connect
-       && (   cfg->mode == WIFI_MODE_STA
-           || cfg->mode == WIFI_MODE_APSTA))
-    {
-        result = esp_wifi_connect();
-        if(result != ESP_OK){
-            ESP_LOGE(TAG, "[%s] esp_wifi_connect(): %d %s",
-                     __func__, result, esp_err_to_name(result));
-        }
+    ESP_LOGI(TAG, "[%s] Applying queued request %u.",
+             __func__, cfg_state.cmd.queued);
+
+    obj = cfg_state.cmd.obj;
+    cfg_state.cmd.obj = NULL;
+
+    result = apply_cfg(obj, cfg_state.cmd.queued);
+    if(result != ESP_OK){
+        cfg_state.cmd.active = 0;
+        cmd_complete(cfg_state.cmd.queued, result);
     }
 
-    return result;
+    cfg_obj_put(obj);
 }
 
-static bool cfgs_are_equal(struct wifi_cfg *a, struct wifi_cfg *b)
+/* Helper function to update the STA connect setting of the latest config */
+static esp_err_t set_connect(bool connect)
 {
-    unsigned int idx;
-    bool result;
-
-    result = false;
+    struct cfg_obj *obj;
+    EventBits_t events;
+    esp_err_t result;
 
-    /*
-     * Do some naive checks to see if the new configuration is an actual
-     * change. Should be more thorough by actually comparing the elements.
-     */
-    if(a->mode != b->mode){
-        goto on_exit;
-    }
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+    configASSERT(cfg_state.lock != NULL);
 
-    if(a->mode == WIFI_MODE_AP || a->mode == WIFI_MODE_APSTA){
-        if(!ip4_addr_cmp(&(a->ap_ip_info.ip), &(b->ap_ip_info.ip))){
-            goto on_exit;
-        }
+    obj = NULL;
 
-        if(memcmp(&(a->ap), &(b->ap), sizeof(a->ap))){
-            goto on_exit;
-        }
+    /* Abort if wifi manager has been stopped. */
+    events = xEventGroupGetBits(wifi_events);
+    if(events & BIT_STOPPED){
+        result = ESP_ERR_INVALID_STATE;
+        goto on_exit;
     }
 
-    if((a->mode == WIFI_MODE_STA || a->mode == WIFI_MODE_APSTA)
-       && memcmp(&(a->sta), &(b->sta), sizeof(a->sta)))
-    {
+    /* Work on a private copy of the latest config, not on the stack. */
+    if(cfg_lock(wmngr_lock_set_connect, CFG_DELAY) != pdTRUE){
+        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
+        result = ESP_ERR_TIMEOUT;
         goto on_exit;
     }
 
-    if(a->sta_connect != b->sta_connect){
+    obj = cfg_obj_new(&(latest_cfg()->cfg));
+    result = (obj != NULL) ? ESP_OK : ESP_ERR_NO_MEM;
+
+    cfg_unlock(wmngr_lock_set_connect);
+
+    if(result != ESP_OK){
         goto on_exit;
     }
 
-    if(a->sta_static != b->sta_static){
+    if(obj->cfg.mode != WIFI_MODE_APSTA && obj->cfg.mode != WIFI_MODE_STA){
+        result = ESP_ERR_INVALID_STATE;
         goto on_exit;
     }
 
-    if(a->sta_static){
-        if(!ip4_addr_cmp(&(a->sta_ip_info.ip), &(b->sta_ip_info.ip))){
-            goto on_exit;
-        }
+    obj->cfg.sta_connect = connect;
 
-        if(!ip4_addr_cmp(&(a->sta_ip_info.netmask), &(b->sta_ip_info.netmask))){
-            goto on_exit;
-        }
+    result = submit_cfg(obj, NULL);
 
-        if(!ip4_addr_cmp(&(a->sta_ip_info.gw), &(b->sta_ip_info.gw))){
-            goto on_exit;
-        }
+on_exit:
+    cfg_obj_put(obj);
 
-        for(idx = 0; idx < ARRAY_SIZE(a->sta_dns_info); ++idx){
-            if(!ip_addr_cmp(&(a->sta_dns_info[idx].ip),
-                            &(b->sta_dns_info[idx].ip)))
-            {
-                goto on_exit;
-            }
-        }
-    }
+    return result;
+}
 
-    result = true;
+/*
+ * Get the delay until the state machine has to check on a transitional
+ * state with the given deadline again. When polling, this is the regular
+ * CFG_TICKS interval. In event driven mode, the task gets woken up by
+ * all relevant events, so it only needs to run again once the deadline
+ * has passed.
+ */
+static TickType_t wait_delay(TickType_t deadline, TickType_t now)
+{
+#if defined(CONFIG_WMNGR_EVENT_DRIVEN)
+    if(time_before(now, deadline)){
+        /* Deadline is checked with time_after(), so add one tick. */
+        return deadline - now + 1;
+    }
 
-on_exit:
-    return result;
+    return 1;
+#else
+    return CFG_TICKS;
+#endif
 }
 
 /*
- * Helper to fetch current WiFi configuration from the system and store it in
- * a wifi_cfg struct.
+ * Get the time to wait before the next reconnect attempt. The delay grows
+ * exponentially with the number of retries, up to RECONNECT_MAX ms. The
+ * actual delay is randomly chosen from the upper half of that range, so
+ * that devices losing their AP at the same time do not all come back at
+ * the same time.
  */
-static esp_err_t get_wifi_cfg(struct wifi_cfg *cfg)
+static TickType_t reconnect_backoff(unsigned int retries)
 {
-    esp_netif_dhcp_status_t dhcp_status;
     unsigned int idx;
-    esp_err_t result;
+    uint32_t delay;
 
-    result = ESP_OK;
-    memset(cfg, 0x0, sizeof(*cfg));
-
-    /*
-     * Unless we are currently connected, we can not know for sure if
-     * esp_wifi_connect() has been called. If we are not connected, we just
-     * take the value from cfg_state.current.
-     */
-    if(sta_connected() || cfg_state.current.sta_connect){
-        cfg->sta_connect = true;
+    delay = RECONNECT_BASE;
+    for(idx = 0; idx < retries && delay < RECONNECT_MAX; ++idx){
+        delay *= 2;
     }
+    delay = MIN(delay, RECONNECT_MAX);
 
-    result = esp_wifi_get_mode(&(cfg->mode));
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] Error fetching WiFi mode.", __func__);
-        goto on_exit;
-    }
+    delay = delay / 2 + esp_random() % (delay / 2 + 1);
 
-    result = esp_wifi_get_config(WIFI_IF_STA, &(cfg->sta));
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] Error fetching STA config.", __func__);
-        goto on_exit;
-    }
+    return MAX(pdMS_TO_TICKS(delay), 1);
+}
 
-    result = esp_netif_dhcpc_get_status(sta_netif, &dhcp_status);
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] Error fetching DHCP status.", __func__);
-        goto on_exit;
+/* Run a job in the current context. */
+static esp_err_t exec_job(enum wmngr_job type, struct cfg_obj *obj)
+{
+    switch(type){
+    case wmngr_job_apply:
+        return set_wifi_cfg(obj, false);
+    case wmngr_job_apply_full:
+        return set_wifi_cfg(obj, true);
+    case wmngr_job_save:
+        return save_config(&(obj->cfg));
+    default:
+        return ESP_ERR_INVALID_ARG;
     }
+}
 
-    if(dhcp_status == ESP_NETIF_DHCP_STOPPED){
-        cfg->sta_static = 1;
+/* Helper to check if the worker task is busy. */
+static bool job_pending(void)
+{
+#if defined(CONFIG_WMNGR_WORKER)
+    return cfg_state.job.type != wmngr_job_none && !cfg_state.job.done;
+#else
+    return false;
+#endif
+}
 
-        result = esp_netif_get_ip_info(sta_netif, &cfg->sta_ip_info);
-        if(result != ESP_OK){
-            ESP_LOGE(TAG, "[%s] esp_netif_get_ip_info() STA: %d %s",
-                    __func__, result, esp_err_to_name(result));
-            goto on_exit;
-        }
+/*
+ * Run a slow operation. With the worker task enabled, the job gets handed
+ * off to it and ESP_ERR_NOT_FINISHED is returned until it has been run.
+ * Callers must keep calling this function with the same arguments to
+ * collect the result. Without the worker task, the job is run directly.
+ * Must be called with cfg_state.lock held.
+ */
+static esp_err_t run_job(enum wmngr_job type, struct cfg_obj *obj)
+{
+#if defined(CONFIG_WMNGR_WORKER)
+    struct worker_job *job;
+    esp_err_t result;
 
-        for(idx = 0; idx < ARRAY_SIZE(cfg->sta_dns_info); ++idx){
-            result = esp_netif_get_dns_info(sta_netif,
-                                            idx,
-                                            &(cfg->sta_dns_info[idx]));
-            if(result != ESP_OK){
-                ESP_LOGE(TAG, "[%s] Getting DNS server IP failed.",
-                         __func__);
-                goto on_exit;
-            }
+    job = &(cfg_state.job);
 
+    if(job->type == type && job->obj == obj){
+        if(!job->done){
+            return ESP_ERR_NOT_FINISHED;
         }
-    }
 
-    result = esp_wifi_get_config(WIFI_IF_AP, &(cfg->ap));
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] Error fetching AP config.", __func__);
-        goto on_exit;
+        result = job->result;
+        job->type = wmngr_job_none;
+        cfg_obj_set(&(job->obj), NULL);
+
+        return result;
     }
 
-    result = esp_netif_get_ip_info(ap_netif, &cfg->ap_ip_info);
-    if(result != ESP_OK){
-        ESP_LOGE(TAG, "[%s] esp_netif_get_ip_info() AP: %d %s",
-                __func__, result, esp_err_to_name(result));
-        goto on_exit;
+    /* Wait for the worker if it is busy with a different job. */
+    if(job_pending()){
+        return ESP_ERR_NOT_FINISHED;
     }
 
-    cfg->is_valid = true;
+    /*
+     * Any finished job left in the slot has been abandoned by its caller,
+     * e.g. because the WiFi Manager was stopped in the meantime.
+     */
+    job->type = type;
+    cfg_obj_set(&(job->obj), obj);
+    job->done = false;
+    xEventGroupSetBits(wifi_events, BIT_JOB);
 
-on_exit:
-    return result;
+    return ESP_ERR_NOT_FINISHED;
+#else
+    return exec_job(type, obj);
+#endif
 }
 
-/* Helper function to update the STA connect setting of the current config */
-static esp_err_t set_connect(bool connect)
+/* Helper to get the deadline for the current connection attempt. */
+static TickType_t connect_deadline(void)
 {
-    struct wifi_cfg cfg;
-    EventBits_t events;
-    esp_err_t result;
+    if(cfg_state.fast.active){
+        return cfg_state.cfg_timestamp + FAST_TIMEOUT;
+    }
 
-    configASSERT(cfg_state.state != wmngr_state_deinit);
-    configASSERT(cfg_state.lock != NULL);
+    return cfg_state.cfg_timestamp + CFG_TIMEOUT;
+}
 
-    /* Abort if wifi manager has been stopped. */
-    events = xEventGroupGetBits(wifi_events);
-    if(events & BIT_STOPPED){
-        result = ESP_ERR_INVALID_STATE;
-        goto on_exit;
+/*
+ * Schedule writing the saved config to NVS. Further requests made before
+ * the pending save is due are merged into it, so a flapping connection
+ * will cause at most one write every SAVE_DELAY.
+ */
+static void request_save(TickType_t now)
+{
+    if(cfg_state.save_pending){
+        ++cfg_state.flash_stats.coalesced;
+        return;
     }
 
-    result = esp_wmngr_get_cfg(&cfg);
-    if(result != ESP_OK){
-        goto on_exit;
+    cfg_state.save_pending = true;
+    cfg_state.save_tstamp = now + SAVE_DELAY;
+}
+
+/*
+ * Write back the saved config if a save is pending and due. Returns the
+ * number of ticks until it is due or 0 if no save is pending.
+ */
+static TickType_t flush_config(TickType_t now)
+{
+    esp_err_t result;
+
+    if(!cfg_state.save_pending){
+        return 0;
     }
 
-    if(cfg.mode != WIFI_MODE_APSTA && cfg.mode != WIFI_MODE_STA){
-        result = ESP_ERR_INVALID_STATE;
-        goto on_exit;
+    if(!time_after(now, cfg_state.save_tstamp)){
+        return wait_delay(cfg_state.save_tstamp, now);
     }
 
-    cfg.sta_connect = connect;
+    result = run_job(wmngr_job_save, cfg_state.saved);
+    if(result == ESP_ERR_NOT_FINISHED){
+        return CFG_TICKS;
+    }
 
-    result = esp_wmngr_set_cfg(&cfg);
+    cfg_state.save_pending = false;
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "[%s] Saving config failed.", __func__);
+    }
 
-on_exit:
-    return result;
+    return 0;
 }
 
 /*
@@ -891,7 +3505,8 @@ on_exit:
  * wrong WiFi credentials in STA-only mode.
  *
  * This function will keep triggering itself until it reaches a "stable"
- * (deinit, stopped, idle, connected, failed) state in cfg_state.state.
+ * (deinit, stopped, idle, connected, failed, reconnecting) state in
+ * cfg_state.state.
  *
  * cfg_state must not be modified without first obtaining the cfg_state.lock
  * mutex and then checking that cfg_state.state is in a stable state.
@@ -905,9 +3520,9 @@ static void handle_wifi(TimerHandle_t timer)
 {
     bool connected;
     wifi_mode_t mode;
-    esp_wps_config_t config = WPS_CONFIG_INIT_DEFAULT(WPS_TYPE_PBC);
-    TickType_t now, delay;
+    TickType_t now, delay, scan_delay, save_delay;
     EventBits_t events;
+    struct cfg_obj *obj;
     esp_err_t result;
 
     ESP_LOGD(TAG, "[%s] Called. State: %s",
@@ -918,7 +3533,7 @@ static void handle_wifi(TimerHandle_t timer)
      * timer. If that also fails, we are SOL...
      * Maybe we should trigger a reboot.
      */
-    if(xSemaphoreTake(cfg_state.lock, 0) != pdTRUE){
+    if(cfg_lock(wmngr_lock_handle_wifi, 0) != pdTRUE){
         if(xTimerChangePeriod(config_timer, CFG_DELAY, CFG_DELAY) != pdPASS){
             ESP_LOGE(TAG, "[%s] Failure to get config lock and change timer.",
                      __func__);
@@ -927,8 +3542,11 @@ static void handle_wifi(TimerHandle_t timer)
         return;
     }
 
+    ++cfg_state.runs;
+
     /* If delay gets set later, the timer will be re-scheduled on exit. */
     delay = 0;
+    result = ESP_OK;
 
     /* Abort and stop timer if wifi manager has been stopped. */
     events = xEventGroupGetBits(wifi_events);
@@ -944,10 +3562,12 @@ static void handle_wifi(TimerHandle_t timer)
     result = esp_wifi_get_mode(&mode);
     if(result != ESP_OK){
         ESP_LOGE(TAG, "[%s] Error fetching WiFi mode.", __func__);
-        cfg_state.state = wmngr_state_failed;
+        set_state(wmngr_state_failed);
         goto on_exit;
     }
 
+    STACK_ENTER_STATE();
+
     switch(cfg_state.state){
     case wmngr_state_wps_start:
         ESP_LOGI(TAG, "[%s] Starting WPS.", __func__);
@@ -955,35 +3575,40 @@ static void handle_wifi(TimerHandle_t timer)
          * Try connecting to AP with WPS. First, tear down any connection
          * we might currently have.
          */
-        result = get_wifi_cfg(&cfg_state.new);
+        obj = cfg_obj_alloc();
+        result = (obj != NULL) ? get_wifi_cfg(&(obj->cfg)) : ESP_ERR_NO_MEM;
         if(result != ESP_OK){
             ESP_LOGE(TAG, "[%s] WPS start: Error getting current config.",
                      __func__);
-            cfg_state.state = wmngr_state_fallback;
+            cfg_obj_put(obj);
+            set_state(wmngr_state_fallback);
             delay = CFG_DELAY;
             goto on_exit;
         }
 
-        memset(&cfg_state.new.sta, 0x0, sizeof(cfg_state.new.sta));
-        cfg_state.new.mode = WIFI_MODE_APSTA;
-        cfg_state.new.sta_connect = false;
+        memset(&(obj->cfg.sta), 0x0, sizeof(obj->cfg.sta));
+        obj->cfg.mode = WIFI_MODE_APSTA;
+        obj->cfg.sta_connect = false;
+
+        cfg_obj_set(&cfg_state.new, obj);
+        cfg_obj_put(obj);
 
-        result = set_wifi_cfg(&cfg_state.new);
+        result = set_wifi_cfg(cfg_state.new, false);
         if(result != ESP_OK){
             ESP_LOGE(TAG, "[%s] WPS start: Error setting temp config.",
                      __func__);
-            cfg_state.state = wmngr_state_fallback;
+            set_state(wmngr_state_fallback);
             delay = CFG_DELAY;
             goto on_exit;
         }
 
         /* Clear previous results and start WPS. */
         xEventGroupClearBits(wifi_events, BITS_WPS);
-        result = esp_wifi_wps_enable(&config);
+        result = esp_wifi_wps_enable(&wps_config);
         if(result != ESP_OK){
             ESP_LOGE(TAG, "[%s] esp_wifi_wps_enable() failed: %d %s",
                      __func__, result, esp_err_to_name(result));
-            cfg_state.state = wmngr_state_fallback;
+            set_state(wmngr_state_fallback);
             delay = CFG_DELAY;
             goto on_exit;
         }
@@ -992,15 +3617,15 @@ static void handle_wifi(TimerHandle_t timer)
         if(result != ESP_OK){
             ESP_LOGE(TAG, "[%s] esp_wifi_wps_start() failed: %d %s",
                      __func__, result, esp_err_to_name(result));
-            cfg_state.state = wmngr_state_fallback;
+            set_state(wmngr_state_fallback);
             delay = CFG_DELAY;
             goto on_exit;
         }
 
         /* WPS is running, set time stamp and transition to next state. */
         cfg_state.cfg_timestamp = now;
-        cfg_state.state = wmngr_state_wps_active;
-        delay = CFG_TICKS;
+        set_state(wmngr_state_wps_active);
+        delay = wait_delay(now + CFG_TIMEOUT, now);
         break;
     case wmngr_state_wps_active:
         /* WPS is running. Check for events and timeout. */
@@ -1020,10 +3645,19 @@ static void handle_wifi(TimerHandle_t timer)
              * Get received STA config, then force APSTA mode, set
              * connect flag and trigger update.
              */
-            get_wifi_cfg(&cfg_state.new);
-            cfg_state.new.mode = WIFI_MODE_APSTA;
-            cfg_state.new.sta_connect = true;
-            cfg_state.state = wmngr_state_update;
+            obj = cfg_obj_alloc();
+            if(obj != NULL){
+                get_wifi_cfg(&(obj->cfg));
+                obj->cfg.mode = WIFI_MODE_APSTA;
+                obj->cfg.sta_connect = true;
+
+                cfg_obj_set(&cfg_state.new, obj);
+                cfg_obj_put(obj);
+
+                set_state(wmngr_state_update);
+            } else {
+                set_state(wmngr_state_fallback);
+            }
             delay = CFG_DELAY;
         } else if(time_after(now, (cfg_state.cfg_timestamp + CFG_TIMEOUT))
                   || (events & BIT_WPS_FAILED))
@@ -1038,34 +3672,46 @@ static void handle_wifi(TimerHandle_t timer)
                         __func__, result, esp_err_to_name(result));
             }
 
-            cfg_state.state = wmngr_state_fallback;
+            set_state(wmngr_state_fallback);
             delay = CFG_DELAY;
         } else {
             /* Still waiting. Set up next check. */
-            delay = CFG_TICKS;
+            delay = wait_delay(cfg_state.cfg_timestamp + CFG_TIMEOUT, now);
         }
         break;
     case wmngr_state_update:
-        ESP_LOGI(TAG, "[%s] Setting new configuration.", __func__);
+        if(!job_pending()){
+            ESP_LOGI(TAG, "[%s] Setting new configuration.", __func__);
+        }
+
         /* Start changing WiFi to new configuration. */
-        (void) esp_wifi_scan_stop();
-        (void) esp_wifi_disconnect();
-        result = set_wifi_cfg(&(cfg_state.new));
+        result = run_job(cfg_state.full_apply ? wmngr_job_apply_full
+                                              : wmngr_job_apply,
+                         cfg_state.new);
+        if(result == ESP_ERR_NOT_FINISHED){
+            /* The worker task will trigger us once it is done. */
+            delay = CFG_TICKS;
+            break;
+        }
+
+        cfg_state.full_apply = false;
         if(result != ESP_OK){
-            cfg_state.state = wmngr_state_fallback;
+            set_state(wmngr_state_fallback);
             delay = CFG_DELAY;
             goto on_exit;
         }
 
-        if(cfg_state.new.mode == WIFI_MODE_AP || !cfg_state.new.sta_connect){
+        if(cfg_state.new->cfg.mode == WIFI_MODE_AP
+           || !cfg_state.new->cfg.sta_connect)
+        {
             /* AP-only mode or not connecting, we are done. */
-            cfg_state.state = wmngr_state_idle;
-            cfg_state.current.is_valid = 1;
+            set_state(wmngr_state_idle);
+            cfg_mark_valid();
         } else {
             /* System should now connect to the AP. */
             cfg_state.cfg_timestamp = now;
-            cfg_state.state = wmngr_state_connecting;
-            delay = CFG_TICKS;
+            set_state(wmngr_state_connecting);
+            delay = wait_delay(connect_deadline(), now);
         }
         break;
     case wmngr_state_connecting:
@@ -1073,33 +3719,59 @@ static void handle_wifi(TimerHandle_t timer)
         if(connected){
             /* We have a connection! \o/ */
             ESP_LOGI(TAG, "[%s] Established connection to AP.", __func__);
-            cfg_state.state = wmngr_state_connected;
+            set_state(wmngr_state_connected);
+            cfg_state.retries = 0;
 
             /*
              * New config is valid. Make sure we do not fall back to previous
              * config if the AP goes away and then try saving it to the NVS.
              */
-            cfg_state.current.is_valid = true;
-            memcpy(&cfg_state.saved, &cfg_state.current,
-                    sizeof(cfg_state.saved));
+            cfg_mark_valid();
+            cfg_obj_set(&cfg_state.saved, cfg_state.current);
 
-            result = save_config(&cfg_state.current);
-            if(result != ESP_OK){
-                ESP_LOGE(TAG, "[%s] Saving config failed.", __func__);
+            fast_connect_update();
+            request_save(now);
+        } else if(cfg_state.fast.active
+                  && time_after(now, (cfg_state.cfg_timestamp + FAST_TIMEOUT)))
+        {
+            /*
+             * The AP is not where we last saw it. Forget about it and
+             * re-apply only the STA config, connecting with a full channel
+             * scan. A full apply would restart the driver and drop the
+             * clients of our own AP.
+             */
+            ESP_LOGI(TAG, "[%s] Fast connect failed, doing full scan.",
+                     __func__);
+            cfg_state.fast.valid = false;
+            cfg_state.fast.dirty = true;
+
+            (void) esp_wifi_disconnect();
+            result = apply_sta_cfg(&(cfg_state.current->cfg));
+            if(result == ESP_OK){
+                result = esp_wifi_connect();
+                if(result != ESP_OK){
+                    ESP_LOGW(TAG, "[%s] esp_wifi_connect(): %d %s",
+                             __func__, result, esp_err_to_name(result));
+                }
             }
+
+            cfg_state.cfg_timestamp = now;
+            delay = wait_delay(connect_deadline(), now);
         } else if(time_after(now, (cfg_state.cfg_timestamp + CFG_TIMEOUT))){
-            if(cfg_state.current.is_valid){
+            if(cfg_state.current->cfg.is_valid){
                 /*
                  * We know that the config is valid, so just keep prodding
-                 * the WiFI core and hope for the best.
+                 * the WiFI core and hope for the best. Back off first, so
+                 * we do not hammer an AP that is coming back up.
                  */
-                ESP_LOGW(TAG, "[%s] Timeout connecting, re-applying config.",
-                        __func__);
-
-                memcpy(&cfg_state.new, &cfg_state.current,
-                        sizeof(cfg_state.new));
-                cfg_state.state = wmngr_state_update;
-                delay = CFG_TICKS;
+                cfg_state.retry_tstamp = now
+                                    + reconnect_backoff(cfg_state.retries);
+                set_state(wmngr_state_reconnecting);
+                delay = wait_delay(cfg_state.retry_tstamp, now);
+
+                ESP_LOGW(TAG, "[%s] Timeout connecting, retrying in %d ms.",
+                        __func__, (cfg_state.retry_tstamp - now)
+                                    * portTICK_PERIOD_MS);
             } else {
                 /*
                  * Timeout while waiting for connection. Try falling back to
@@ -1107,34 +3779,78 @@ static void handle_wifi(TimerHandle_t timer)
                  */
                 ESP_LOGI(TAG, "[%s] Timed out waiting for connection to AP.",
                         __func__);
-                cfg_state.state = wmngr_state_fallback;
+                set_state(wmngr_state_fallback);
                 delay = CFG_DELAY;
             }
         } else {
             /* Twiddle our thumbs and keep waiting for the connection.  */
-            delay = CFG_TICKS;
+            delay = wait_delay(connect_deadline(), now);
         }
         break;
     case wmngr_state_disconnecting:
         break;
     case wmngr_state_fallback:
         /* Something went wrong, try going back to the previous config. */
-        ESP_LOGI(TAG, "[%s] Falling back to previous configuration.",
-                    __func__);
-        (void) esp_wifi_disconnect();
-        (void) set_wifi_cfg(&(cfg_state.saved));
-        cfg_state.state = wmngr_state_failed;
+        if(!job_pending()){
+            ESP_LOGI(TAG, "[%s] Falling back to previous configuration.",
+                        __func__);
+        }
+
+        result = run_job(wmngr_job_apply_full, cfg_state.saved);
+        if(result == ESP_ERR_NOT_FINISHED){
+            delay = CFG_TICKS;
+            break;
+        }
+
+        set_state(wmngr_state_failed);
         break;
     case wmngr_state_connected:
         if(!connected){
             /*
-             * We should be connected, but are not. Change into update state
-             * so current configuration gets re-applied.
+             * We should be connected, but are not. Change into reconnecting
+             * state and try to get the connection back after a short delay.
              */
             ESP_LOGI(TAG, "[%s] Connection to AP lost, retrying.", __func__);
-            memcpy(&cfg_state.new, &cfg_state.current, sizeof(cfg_state.new));
-            cfg_state.state = wmngr_state_update;
-            delay = CFG_DELAY;
+            stats_conn_lost();
+            cfg_state.retries = 0;
+            cfg_state.retry_tstamp = now + reconnect_backoff(0);
+            set_state(wmngr_state_reconnecting);
+            delay = wait_delay(cfg_state.retry_tstamp, now);
+        }
+        break;
+    case wmngr_state_reconnecting:
+        if(connected){
+            ESP_LOGI(TAG, "[%s] Connection to AP re-established.", __func__);
+            cfg_state.retries = 0;
+            set_state(wmngr_state_connected);
+        } else if(time_after(now, cfg_state.retry_tstamp)){
+            ++cfg_state.retries;
+            stats_reconnect();
+            if(cfg_state.retries <= RECONNECT_LIGHT){
+                /* Just ask the WiFi driver to connect again. */
+                ESP_LOGI(TAG, "[%s] Reconnect attempt %u.",
+                         __func__, cfg_state.retries);
+
+                result = esp_wifi_connect();
+                if(result != ESP_OK){
+                    ESP_LOGW(TAG, "[%s] esp_wifi_connect(): %d %s",
+                             __func__, result, esp_err_to_name(result));
+                }
+
+                cfg_state.retry_tstamp = now
+                                    + reconnect_backoff(cfg_state.retries);
+                delay = wait_delay(cfg_state.retry_tstamp, now);
+            } else {
+                /* That did not work, re-apply the whole configuration. */
+                ESP_LOGI(TAG, "[%s] Reconnect attempt %u, re-applying config.",
+                         __func__, cfg_state.retries);
+                cfg_obj_set(&cfg_state.new, cfg_state.current);
+                cfg_state.full_apply = true;
+                set_state(wmngr_state_update);
+                delay = CFG_DELAY;
+            }
+        } else {
+            delay = wait_delay(cfg_state.retry_tstamp, now);
         }
         break;
     case wmngr_state_idle:
@@ -1142,32 +3858,63 @@ static void handle_wifi(TimerHandle_t timer)
         break;
     default:
         ESP_LOGE(TAG, "[%s] Illegal state: 0x%x", __func__, cfg_state.state);
-        cfg_state.state = wmngr_state_failed;
+        set_state(wmngr_state_failed);
     }
 
-    if(cfg_state.state <= wmngr_state_idle){
-        if(events & BIT_SCAN_START){
-            wifi_scan_start();
-        } else if(events & BIT_SCAN_DONE){
+    STACK_LEAVE_STATE();
+
+    /* Pick up requests that came in while we were busy. */
+    if(state_is_stable(cfg_state.state)){
+        cmd_process();
+        if(cfg_state.state == wmngr_state_update){
+            delay = CFG_DELAY;
+        }
+    }
+
+    if(state_is_stable(cfg_state.state)){
+        /*
+         * Write back the config once it has been stable for a while. Do
+         * not lose the delay set above, e.g. for a pending reconnect.
+         */
+        save_delay = flush_config(now);
+        if(save_delay > 0){
+            delay = (delay > 0) ? MIN(delay, save_delay) : save_delay;
+        }
+
+        /*
+         * Collect finished scans first. During a sliced scan sweep, do
+         * not start the next slice until it is due.
+         */
+        if(events & BIT_SCAN_DONE){
             wifi_scan_done();
+        } else if((events & BIT_SCAN_START) && scan_slice_delay(now) == 0){
+            wifi_scan_start();
         }
 
         /* Check the SCAN bits and re-schedule if necessary. */
         events = xEventGroupGetBits(wifi_events);
         if(events & (BIT_SCAN_START | BIT_SCAN_DONE)){
-            delay = CFG_DELAY;
+            scan_delay = scan_slice_delay(xTaskGetTickCount());
+            scan_delay = (scan_delay > 0) ? scan_delay : CFG_DELAY;
+            delay = (delay > 0) ? MIN(delay, scan_delay) : scan_delay;
         }
     }
 
 on_exit:
+    /* Waiting for the worker task to finish a job is not an error. */
+    if(result != ESP_OK && result != ESP_ERR_NOT_FINISHED){
+        trace_put(wmngr_trace_error, cfg_state.state, cfg_state.state,
+                  0, result);
+    }
+
     if(delay > 0){
         /* We are in a transitional state, re-arm the timer. */
         if(xTimerChangePeriod(config_timer, delay, CFG_DELAY) != pdPASS){
-            cfg_state.state = wmngr_state_failed;
+            set_state(wmngr_state_failed);
         }
     }
 
-    xSemaphoreGive(cfg_state.lock);
+    cfg_unlock(wmngr_lock_handle_wifi);
 
     ESP_LOGD(TAG, "[%s] Leaving. State: %s delay: %d",
              __func__, wmngr_state_names[cfg_state.state], delay);
@@ -1177,15 +3924,29 @@ on_exit:
 
 static void handle_timer(TimerHandle_t timer)
 {
+    int64_t start;
+    uint32_t duration;
+
     ESP_LOGD(TAG, "[%s] Called.\n", __FUNCTION__);
 
-#if defined(CONFIG_WMNGR_TASK)
+    /* Keep track of how long we block the timer service task. */
+    start = esp_timer_get_time();
+
+#if defined(CONFIG_WMNGR_EVENT_DRIVEN)
+    /* One-shot timer for a deadline has expired, trigger the task. */
+    xEventGroupSetBits(wifi_events, BIT_TRIGGER);
+#elif defined(CONFIG_WMNGR_TASK)
     /* Reset timer to regular tick rate and trigger the task. */
     (void) xTimerChangePeriod(timer, CFG_TICKS, CFG_DELAY);
     xEventGroupSetBits(wifi_events, BIT_TRIGGER);
 #else
     handle_wifi(timer);
 #endif
+
+    duration = (uint32_t) (esp_timer_get_time() - start);
+    if(duration > cfg_state.timer_max_us){
+        cfg_state.timer_max_us = duration;
+    }
 }
 
 /*
@@ -1212,10 +3973,17 @@ static void event_handler(void* args, esp_event_base_t base,
     if(base == WIFI_EVENT){
         switch(id){
         case WIFI_EVENT_SCAN_DONE:
+            /*
+             * Also collect the results of failed or aborted scans, so that
+             * the driver's records get freed, the scan bits get cleared and
+             * a running scan sweep moves on to its next channel.
+             */
             scan_data = (wifi_event_sta_scan_done_t *) data;
-            if(scan_data->status == ESP_OK){
-                xEventGroupSetBits(wifi_events, BIT_SCAN_DONE);
+            if(scan_data->status != ESP_OK){
+                ESP_LOGI(TAG, "[%s] Scan failed: %d",
+                         __func__, scan_data->status);
             }
+            xEventGroupSetBits(wifi_events, BIT_SCAN_DONE);
             xEventGroupClearBits(wifi_events, BIT_SCAN_START);
             break;
         case WIFI_EVENT_STA_START:
@@ -1226,9 +3994,11 @@ static void event_handler(void* args, esp_event_base_t base,
             break;
         case WIFI_EVENT_STA_CONNECTED:
             xEventGroupSetBits(wifi_events, BIT_STA_CONNECTED);
+            stats_assoc(true, false);
             break;
         case WIFI_EVENT_STA_DISCONNECTED:
             xEventGroupClearBits(wifi_events, BIT_STA_CONNECTED);
+            stats_assoc(false, false);
             break;
         case WIFI_EVENT_AP_START:
             xEventGroupSetBits(wifi_events, BIT_AP_START);
@@ -1253,6 +4023,7 @@ static void event_handler(void* args, esp_event_base_t base,
         switch(id){
         case IP_EVENT_STA_GOT_IP:
             xEventGroupSetBits(wifi_events, BIT_STA_GOT_IP);
+            stats_assoc(false, true);
             break;
         case IP_EVENT_STA_LOST_IP:
             xEventGroupClearBits(wifi_events, BIT_STA_GOT_IP);
@@ -1264,12 +4035,15 @@ static void event_handler(void* args, esp_event_base_t base,
 
     new = xEventGroupGetBits(wifi_events);
 
+    trace_put(wmngr_trace_event, cfg_state.state, cfg_state.state,
+              (base == IP_EVENT) ? 1 : 0, id);
+
     if(old != new){
 #if defined(CONFIG_WMNGR_TASK)
         xEventGroupSetBits(wifi_events, BIT_TRIGGER);
 #else
         if(xTimerChangePeriod(config_timer, CFG_DELAY, CFG_DELAY) != pdPASS){
-            cfg_state.state = wmngr_state_failed;
+            set_state(wmngr_state_failed);
         }
 #endif
     }
@@ -1294,6 +4068,52 @@ void esp_wmngr_task(void *pvParameters)
 }
 #endif /* defined(CONFIG_WMNGR_TASK) */
 
+#if defined(CONFIG_WMNGR_WORKER)
+/*
+ * Run the job posted by the state machine, if there is one. This is one
+ * pass of the worker task's loop, the host tests call it directly.
+ */
+static void worker_run(void)
+{
+    struct worker_job *job;
+
+    job = &(cfg_state.job);
+
+    /* Jobs work on cfg_state, so they need the lock just like us. */
+    if(cfg_lock(wmngr_lock_worker, portMAX_DELAY) != pdTRUE){
+        return;
+    }
+
+    /* Drop jobs posted before the WiFi Manager was stopped. */
+    if(job->type != wmngr_job_none && !job->done){
+        if(xEventGroupGetBits(wifi_events) & BIT_STOPPED){
+            job->result = ESP_ERR_INVALID_STATE;
+        } else {
+            job->result = exec_job(job->type, job->obj);
+        }
+        job->done = true;
+    }
+
+    cfg_unlock(wmngr_lock_worker);
+
+    /* Trigger the state machine to collect the result. */
+    (void) xTimerChangePeriod(config_timer, CFG_DELAY, CFG_DELAY);
+}
+
+/*
+ * Worker task running the slow jobs posted by the state machine, so that
+ * they do not block the timer service task.
+ */
+static void esp_wmngr_worker(void *pvParameters)
+{
+    do{
+        (void) xEventGroupWaitBits(wifi_events, BIT_JOB,
+                                   true, false, portMAX_DELAY);
+        worker_run();
+    } while(1);
+}
+#endif /* defined(CONFIG_WMNGR_WORKER) */
+
 /*****************************************************************************\
  *  API functions                                                            *
 \*****************************************************************************/
@@ -1311,11 +4131,12 @@ void esp_wmngr_task(void *pvParameters)
  */
 esp_err_t esp_wmngr_init(void)
 {
-#if defined(CONFIG_WMNGR_TASK)
+#if defined(CONFIG_WMNGR_TASK) || defined(CONFIG_WMNGR_WORKER)
     BaseType_t status;
 #endif
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     esp_err_t result;
+    STACK_ENTER();
 
     configASSERT(cfg_state.state == wmngr_state_deinit);
     configASSERT(cfg_state.lock == NULL);
@@ -1325,8 +4146,24 @@ esp_err_t esp_wmngr_init(void)
     result = ESP_OK;
     memset(&cfg_state, 0x0, sizeof(cfg_state));
     cfg_state.state = wmngr_state_deinit;
+#if defined(CONFIG_WMNGR_STATS)
+    cfg_state.state_tstamp = xTaskGetTickCount();
+#endif
+
+    trace_init();
+
+#if defined(CONFIG_WMNGR_SCAN_PASSIVE)
+    cfg_state.scan_cfg.passive = true;
+#endif
+    cfg_state.scan_cfg.dwell_time = CONFIG_WMNGR_SCAN_DWELL_TIME;
+    cfg_state.scan_cfg.slice_chans = CONFIG_WMNGR_SCAN_SLICE_CHANS;
+    cfg_state.scan_cfg.home_time = CONFIG_WMNGR_SCAN_HOME_TIME;
 
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    wifi_events = xEventGroupCreateStatic(&(static_mem.events));
+#else
     wifi_events = xEventGroupCreate();
+#endif
     if(wifi_events == NULL){
         ESP_LOGE(TAG, "Unable to create event group.");
         result = ESP_ERR_NO_MEM;
@@ -1336,13 +4173,36 @@ esp_err_t esp_wmngr_init(void)
     /* Make sure we do not handle any events until we have been started. */
     xEventGroupSetBits(wifi_events, BIT_STOPPED);
 
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    state_events = xEventGroupCreateStatic(&(static_mem.state_events));
+#else
+    state_events = xEventGroupCreate();
+#endif
+    if(state_events == NULL){
+        ESP_LOGE(TAG, "Unable to create state event group.");
+        result = ESP_ERR_NO_MEM;
+        goto on_exit;
+    }
+
+    xEventGroupSetBits(state_events, WMNGR_STATE_BIT(wmngr_state_deinit));
+
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    cfg_state.lock = xSemaphoreCreateMutexStatic(&(static_mem.lock));
+#else
     cfg_state.lock = xSemaphoreCreateMutex();
+#endif
     if(cfg_state.lock == NULL){
         ESP_LOGE(TAG, "Unable to create state lock.");
         result = ESP_ERR_NO_MEM;
         goto on_exit;
     }
 
+    result = scan_mem_init(&(cfg_state.scan_table));
+    if(result != ESP_OK){
+        ESP_LOGE(TAG, "Unable to allocate scan table.");
+        goto on_exit;
+    }
+
     result = esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
                                         &event_handler, NULL);
     if(result != ESP_OK){
@@ -1397,15 +4257,16 @@ esp_err_t esp_wmngr_init(void)
         goto on_exit;
     }
 
-#if defined(CONFIG_WMNGR_TASK)
-    config_timer = xTimerCreate("WMngr_Timer",
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    config_timer = xTimerCreateStatic("WMngr_Timer",
                               CFG_TICKS,
-                              pdTRUE, NULL, handle_timer);
+                              TIMER_RELOAD, NULL, handle_timer,
+                              &(static_mem.timer));
 #else
     config_timer = xTimerCreate("WMngr_Timer",
                               CFG_TICKS,
-                              pdFALSE, NULL, handle_timer);
-#endif /* defined(CONFIG_WMNGR_TASK) */
+                              TIMER_RELOAD, NULL, handle_timer);
+#endif /* defined(CONFIG_WMNGR_STATIC_ALLOC) */
 
     if(config_timer == NULL){
         ESP_LOGE(TAG, "[%s] Failed to create config validation timer",
@@ -1415,20 +4276,55 @@ esp_err_t esp_wmngr_init(void)
     }
 
 #if defined(CONFIG_WMNGR_TASK)
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    status = xTaskCreateStatic(&esp_wmngr_task, "WMngr_Task",
+                        CONFIG_WMNGR_TASK_STACK,
+                        NULL,
+                        CONFIG_WMNGR_TASK_PRIO,
+                        static_mem.task_stack,
+                        &(static_mem.task)) != NULL ? pdPASS : pdFAIL;
+#else
     status = xTaskCreate(&esp_wmngr_task, "WMngr_Task",
                         CONFIG_WMNGR_TASK_STACK,
                         NULL,
                         CONFIG_WMNGR_TASK_PRIO,
                         NULL);
+#endif
     if(status != pdPASS){
         ESP_LOGE(TAG, "[%s] Creating WiFi Manager task failed.", __func__);
         result = ESP_ERR_NO_MEM;
     }
 #endif
 
-    cfg_state.state = wmngr_state_stopped;
+#if defined(CONFIG_WMNGR_WORKER)
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    status = xTaskCreateStatic(&esp_wmngr_worker, "WMngr_Worker",
+                        CONFIG_WMNGR_WORKER_STACK,
+                        NULL,
+                        CONFIG_WMNGR_WORKER_PRIO,
+                        static_mem.worker_stack,
+                        &(static_mem.worker)) != NULL ? pdPASS : pdFAIL;
+#else
+    status = xTaskCreate(&esp_wmngr_worker, "WMngr_Worker",
+                        CONFIG_WMNGR_WORKER_STACK,
+                        NULL,
+                        CONFIG_WMNGR_WORKER_PRIO,
+                        NULL);
+#endif
+    if(status != pdPASS){
+        ESP_LOGE(TAG, "[%s] Creating WiFi Manager worker failed.", __func__);
+        result = ESP_ERR_NO_MEM;
+    }
+#endif
+
+    set_state(wmngr_state_stopped);
     xEventGroupSetBits(wifi_events, BIT_STOPPED);
 
+    /* Make the loaded config available to lock-free readers. */
+    if(result == ESP_OK){
+        publish_cfg();
+    }
+
 on_exit:
     if(result != ESP_OK){
         if(wifi_events != NULL){
@@ -1436,17 +4332,29 @@ on_exit:
             wifi_events = NULL;
         }
 
+        if(state_events != NULL){
+            vEventGroupDelete(state_events);
+            state_events = NULL;
+        }
+
         if(cfg_state.lock != NULL){
             vSemaphoreDelete(cfg_state.lock);
             cfg_state.lock = NULL;
         }
 
+        scan_mem_free(&(cfg_state.scan_table));
+
+        cfg_obj_set(&cfg_state.new, NULL);
+        cfg_obj_set(&cfg_state.current, NULL);
+        cfg_obj_set(&cfg_state.saved, NULL);
+
         if(config_timer != NULL){
             xTimerDelete(config_timer, 0);
             config_timer = NULL;
         }
     }
 
+    STACK_LEAVE(wmngr_api_init);
     return result;
 }
 
@@ -1462,13 +4370,15 @@ esp_err_t esp_wmngr_start(void)
 {
     BaseType_t status;
     esp_err_t result;
+    STACK_ENTER();
 
     configASSERT(cfg_state.state != wmngr_state_deinit);
     configASSERT(cfg_state.lock != NULL);
 
-    if(xSemaphoreTake(cfg_state.lock, CFG_DELAY) != pdTRUE){
+    if(cfg_lock(wmngr_lock_start, CFG_DELAY) != pdTRUE){
         ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
-        return ESP_ERR_TIMEOUT;
+        result = ESP_ERR_TIMEOUT;
+        goto on_unlocked;
     }
 
     if(cfg_state.state != wmngr_state_stopped){
@@ -1484,13 +4394,18 @@ esp_err_t esp_wmngr_start(void)
         goto on_exit;
     }
 
-    cfg_state.state = wmngr_state_update;
+    /* We do not know what happened to the WiFi driver while stopped. */
+    cfg_state.full_apply = true;
+    set_state(wmngr_state_update);
     xEventGroupClearBits(wifi_events, BIT_STOPPED);
 
     result = ESP_OK;
 
 on_exit:
-    xSemaphoreGive(cfg_state.lock);
+    cfg_unlock(wmngr_lock_start);
+
+on_unlocked:
+    STACK_LEAVE(wmngr_api_start);
     return result;
 }
 
@@ -1507,13 +4422,15 @@ esp_err_t esp_wmngr_stop(void)
 {
     BaseType_t status;
     esp_err_t result;
+    STACK_ENTER();
 
     configASSERT(cfg_state.state != wmngr_state_deinit);
     configASSERT(cfg_state.lock != NULL);
 
-    if(xSemaphoreTake(cfg_state.lock, CFG_DELAY) != pdTRUE){
+    if(cfg_lock(wmngr_lock_stop, CFG_DELAY) != pdTRUE){
         ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
-        return ESP_ERR_TIMEOUT;
+        result = ESP_ERR_TIMEOUT;
+        goto on_unlocked;
     }
 
     if(cfg_state.state == wmngr_state_stopped){
@@ -1523,7 +4440,7 @@ esp_err_t esp_wmngr_stop(void)
     }
 
     xEventGroupSetBits(wifi_events, BIT_STOPPED);
-    cfg_state.state = wmngr_state_stopped;
+    set_state(wmngr_state_stopped);
 
     status = xTimerStop(config_timer, CFG_TICKS);
     if(status != pdPASS){
@@ -1531,11 +4448,32 @@ esp_err_t esp_wmngr_stop(void)
         ESP_LOGW(TAG, "[%s] Stopping config timer failed.", __func__);
     }
 
+    /* Keep the latest request, it will be applied on start. */
+    if(cfg_state.cmd.obj != NULL){
+        if(cfg_state.cmd.active != 0){
+            cmd_complete(cfg_state.cmd.active, CMD_SUPERSEDED);
+        }
+
+        cfg_obj_set(&cfg_state.new, cfg_state.cmd.obj);
+        cfg_obj_set(&cfg_state.cmd.obj, NULL);
+        cfg_state.cmd.active = cfg_state.cmd.queued;
+    }
+
+    /* Do not lose a pending save, the state machine will not run again. */
+    if(cfg_state.save_pending){
+        cfg_state.save_pending = false;
+        if(save_config(&(cfg_state.saved->cfg)) != ESP_OK){
+            ESP_LOGE(TAG, "[%s] Saving config failed.", __func__);
+        }
+    }
+
     result = ESP_OK;
 
 on_exit:
-    xSemaphoreGive(cfg_state.lock);
+    cfg_unlock(wmngr_lock_stop);
 
+on_unlocked:
+    STACK_LEAVE(wmngr_api_stop);
     return result;
 }
 
@@ -1545,7 +4483,9 @@ on_exit:
  * configuration is backed up and an asynchronous update process is triggered.
  *
  * If WiFI Manager is in state #wmngr_state_stopped, the new config will be
- * applied once esp_wmngr_start() is called.
+ * applied once esp_wmngr_start() is called. If a configuration change is
+ * in progress, the new config will be applied once it has finished. It
+ * replaces any config set in the meantime that has not been applied yet.
  *
  * If setting the new configuration succeeds, the state reported by
  * #esp_wmngr_get_state will change to #wmngr_state_connected (in STA or
@@ -1559,93 +4499,205 @@ on_exit:
 esp_err_t esp_wmngr_set_cfg(struct wifi_cfg *new)
 {
     esp_err_t result;
+    STACK_ENTER();
 
-    configASSERT(cfg_state.state != wmngr_state_deinit);
-    configASSERT(cfg_state.lock != NULL);
+    result = esp_wmngr_submit_cfg(new, NULL);
 
-    if(xSemaphoreTake(cfg_state.lock, CFG_DELAY) != pdTRUE){
-        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
-        return ESP_ERR_TIMEOUT;
-    }
+    STACK_LEAVE(wmngr_api_set_cfg);
+    return result;
+}
 
-    if(cfg_state.state > wmngr_state_idle){
-        ESP_LOGI(TAG, "[%s] WiFi change in progress.", __func__);
-        result = ESP_ERR_INVALID_STATE;
-        goto on_exit;
-    }
+/** Submit a new WiFi Manager configuration.
+ *
+ * Works like #esp_wmngr_set_cfg(), but also returns a ticket that can be
+ * passed to #esp_wmngr_wait_ticket() to wait for the configuration to be
+ * applied.
+ *
+ * @param[in] cfg New WiFi Manager configuration to be set.
+ * @param[out] ticket Ticket for the request. May be NULL.
+ * @return ESP_OK if config was set or queued, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_submit_cfg(const struct wifi_cfg *cfg, uint32_t *ticket)
+{
+    struct cfg_obj *obj;
+    esp_err_t result;
 
-    /* Save current configuration for fall-back. */
-    result = get_wifi_cfg(&(cfg_state.saved));
-    if(result != ESP_OK){
-        ESP_LOGI(TAG, "[%s] Error fetching current WiFi config.",
-                 __func__);
-        goto on_exit;
+    obj = cfg_obj_new(cfg);
+    if(obj == NULL){
+        return ESP_ERR_NO_MEM;
     }
 
-    /*
-     * Always save new config if WiFi Manager is stopped. Otherwise check
-     * first if it is an actual configuration change.
-     */
-    if(cfg_state.state == wmngr_state_stopped
-       || !cfgs_are_equal(new, &(cfg_state.saved)))
-    {
-        memmove(&(cfg_state.new), new, sizeof(cfg_state.new));
-        cfg_state.new.is_default = false;
-        cfg_state.new.is_valid = false;
+    result = submit_cfg(obj, ticket);
+    cfg_obj_put(obj);
 
-        /*
-         * Trigger an asynchronous update if WiFi Manager is not currently
-         * stopped. Otherwise it will be applied once #esp_wmngr_start()
-         * gets called.
-         * This gives the httpd some time to send out the reply before possibly
-         * tearing down the connection.
-         */
-        if(cfg_state.state != wmngr_state_stopped){
-            cfg_state.state = wmngr_state_update;
-            if(xTimerChangePeriod(config_timer, CFG_DELAY, CFG_DELAY) !=pdPASS){
-                cfg_state.state = wmngr_state_failed;
-                result = ESP_ERR_TIMEOUT;
-                goto on_exit;
-            }
+    return result;
+}
+
+/** Wait for a configuration request to finish.
+ *
+ * A request has been applied once the WiFi Manager is idle or, if the
+ * configuration connects to an AP, connected. The results of the last
+ * few requests are kept, so this may also be called after the request
+ * has finished.
+ *
+ * @param[in] ticket Ticket returned by #esp_wmngr_submit_cfg().
+ * @param[in] timeout Maximum number of ticks to wait.
+ * @return ESP_OK if the configuration has been applied, ESP_FAIL if it
+ *         failed and the previous one was restored, ESP_ERR_INVALID_STATE
+ *         if a later request replaced it before it was applied,
+ *         ESP_ERR_TIMEOUT if the request has not finished in time,
+ *         ESP_ERR_NOT_FOUND if its result is no longer available,
+ *         ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_wait_ticket(uint32_t ticket, TickType_t timeout)
+{
+    TickType_t start, elapsed;
+    esp_err_t result;
+
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+    configASSERT(cfg_state.lock != NULL);
+
+    start = xTaskGetTickCount();
+    do{
+        if(cfg_lock(wmngr_lock_wait_ticket, CFG_DELAY) != pdTRUE){
+            ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
+            return ESP_ERR_TIMEOUT;
+        }
+
+        if(ticket == 0 || ticket_after(ticket, cfg_state.cmd.issued)){
+            result = ESP_ERR_INVALID_ARG;
+        } else {
+            result = cmd_result(ticket);
+        }
+
+        cfg_unlock(wmngr_lock_wait_ticket);
+
+        if(result != ESP_ERR_NOT_FINISHED){
+            return result;
         }
-    }
 
-    result = ESP_OK;
+        elapsed = xTaskGetTickCount() - start;
+        if(elapsed >= timeout){
+            return ESP_ERR_TIMEOUT;
+        }
 
-on_exit:
-    xSemaphoreGive(cfg_state.lock);
-    return result;
+        /*
+         * BIT_CMD_DONE gets set whenever a request finishes and stays set
+         * until a waiter wakes up, so a completion between releasing the
+         * lock and blocking here is not lost. With several waiters, the
+         * first one to wake up clears it for the ones that have not
+         * blocked yet, so they also check back once in a while.
+         */
+        (void) xEventGroupWaitBits(wifi_events, BIT_CMD_DONE, pdTRUE, pdFALSE,
+                                   MIN(timeout - elapsed, CFG_TICKS));
+    } while(1);
 }
 
 /** Get current WiFi Manager configuration.
+ *
+ * While a configuration change is in progress, this is the latest config
+ * set via #esp_wmngr_set_cfg(). This function does not take the config
+ * state lock, so it will not block while the configuration is being
+ * changed.
+ *
  * @param[out] cfg Pointer to a #wifi_cfg struct the current configuration
  *             will be copied into.
  * @return ESP_OK on success, ESP_ERR_* otherwise.
  */
 esp_err_t esp_wmngr_get_cfg(struct wifi_cfg *cfg)
 {
+    struct cfg_obj *obj;
     esp_err_t result;
+    STACK_ENTER();
 
     configASSERT(cfg_state.state != wmngr_state_deinit);
-    configASSERT(cfg_state.lock != NULL);
 
-    if(xSemaphoreTake(cfg_state.lock, CFG_DELAY) != pdTRUE){
-        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
-        return ESP_ERR_TIMEOUT;
+    obj = snap_get();
+    if(obj != NULL){
+        memmove(cfg, &(obj->cfg), sizeof(*cfg));
+        cfg_obj_put(obj);
+        result = ESP_OK;
+    } else {
+        result = ESP_ERR_INVALID_STATE;
     }
 
-    if(cfg_state.state > wmngr_state_idle){
-        ESP_LOGI(TAG, "[%s] WiFi change in progress.", __func__);
-        result = ESP_ERR_INVALID_STATE;
-        goto on_exit;
+    STACK_LEAVE(wmngr_api_get_cfg);
+    return result;
+}
+
+/** Get a snapshot of the current WiFi Manager configuration.
+ *
+ * Fetches a reference counted pointer to the configuration that
+ * #esp_wmngr_get_cfg() would return. The snapshot does not change while
+ * it is being held. Once the configuration has been applied successfully,
+ * a new snapshot with the is_valid flag set replaces it. Caller must
+ * release it by calling #esp_wmngr_put_cfg_snap() as soon as possible, as
+ * it keeps the configuration's memory in use.
+ * This function does not take the config state lock, so it will not block
+ * while the WiFi configuration is being changed.
+ *
+ * With static allocation, snapshots come out of a fixed pool. Then at most
+ * WMNGR_SNAP_PINNED snapshots may be held at the same time and this
+ * function returns NULL if all of them are in use.
+ *
+ * @param[out] gen Generation of the snapshot. May be NULL.
+ * @return Pointer to a #wifi_cfg or NULL
+ */
+const struct wifi_cfg *esp_wmngr_get_cfg_snap(uint32_t *gen)
+{
+    struct cfg_obj *obj;
+
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    /* Do not let readers use up the config objects needed for updates. */
+    if(atomic_fetch_add(&cfg_state.snap_pinned, 1) >= SNAP_PINNED){
+        atomic_fetch_sub(&cfg_state.snap_pinned, 1);
+        ESP_LOGW(TAG, "[%s] Too many snapshots held.", __func__);
+        return NULL;
+    }
+#endif
+
+    obj = snap_get();
+    if(obj == NULL){
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+        atomic_fetch_sub(&cfg_state.snap_pinned, 1);
+#endif
+        return NULL;
     }
 
-    memmove(cfg, &cfg_state.current, sizeof(*cfg));
-    result = ESP_OK;
+    if(gen != NULL){
+        *gen = obj->gen;
+    }
 
-on_exit:
-    xSemaphoreGive(cfg_state.lock);
-    return result;
+    return &(obj->cfg);
+}
+
+/** Drop a reference to a configuration snapshot, possibly freeing it.
+ * @param[in] cfg Snapshot returned by #esp_wmngr_get_cfg_snap().
+ * @return Void
+ */
+void esp_wmngr_put_cfg_snap(const struct wifi_cfg *cfg)
+{
+    configASSERT(cfg != NULL);
+
+    cfg_obj_put(container_of(cfg, struct cfg_obj, cfg));
+
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    atomic_fetch_sub(&cfg_state.snap_pinned, 1);
+#endif
+}
+
+/** Get the generation of the current configuration snapshot.
+ *
+ * The generation changes whenever a different configuration gets
+ * published, so callers can skip fetching a snapshot they already have.
+ *
+ * @return Generation of the current snapshot, 0 if there is none.
+ */
+uint32_t esp_wmngr_get_cfg_gen(void)
+{
+    return atomic_load(&cfg_state.snap_gen);
 }
 
 /** Connect to AP with WPS.
@@ -1656,9 +4708,10 @@ on_exit:
  */
 esp_err_t esp_wmngr_start_wps(void)
 {
-    struct wifi_cfg cfg;
+    struct cfg_obj *obj;
     esp_err_t result;
     EventBits_t events;
+    STACK_ENTER();
 
     configASSERT(cfg_state.state != wmngr_state_deinit);
     configASSERT(cfg_state.lock != NULL);
@@ -1666,16 +4719,18 @@ esp_err_t esp_wmngr_start_wps(void)
     /* Abort early if wifi manager has been stopped. */
     events = xEventGroupGetBits(wifi_events);
     if(events & BIT_STOPPED){
-        return ESP_ERR_INVALID_STATE;
+        result = ESP_ERR_INVALID_STATE;
+        goto on_unlocked;
     }
 
     /* Make sure we are not in the middle of setting a new WiFi config. */
-    if(xSemaphoreTake(cfg_state.lock, CFG_DELAY) != pdTRUE){
+    if(cfg_lock(wmngr_lock_start_wps, CFG_DELAY) != pdTRUE){
         ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
-        return ESP_ERR_TIMEOUT;
+        result = ESP_ERR_TIMEOUT;
+        goto on_unlocked;
     }
 
-    if(cfg_state.state > wmngr_state_idle){
+    if(!state_is_stable(cfg_state.state)){
         ESP_LOGI(TAG, "[%s] Can not change config in current state", __func__);
         result = ESP_ERR_INVALID_STATE;
         goto on_exit;
@@ -1684,21 +4739,27 @@ esp_err_t esp_wmngr_start_wps(void)
     ESP_LOGI(TAG, "[%s] Starting WPS.", __func__);
 
     /* Save current config for fall-back. */
-    result = get_wifi_cfg(&cfg);
+    obj = cfg_obj_alloc();
+    result = (obj != NULL) ? get_wifi_cfg(&(obj->cfg)) : ESP_ERR_NO_MEM;
     if(result != ESP_OK){
         ESP_LOGE(TAG, "[%s] Error fetching WiFi config.", __func__);
+        cfg_obj_put(obj);
         goto on_exit;
     }
 
-    memmove(&cfg_state.saved, &cfg, sizeof(cfg_state.saved));
-    cfg_state.state = wmngr_state_wps_start;
+    cfg_obj_set(&cfg_state.saved, obj);
+    cfg_obj_put(obj);
+    set_state(wmngr_state_wps_start);
 
     if(xTimerChangePeriod(config_timer, CFG_DELAY, CFG_DELAY) != pdTRUE){
-        cfg_state.state = wmngr_state_failed;
+        set_state(wmngr_state_failed);
     }
 
 on_exit:
-    xSemaphoreGive(cfg_state.lock);
+    cfg_unlock(wmngr_lock_start_wps);
+
+on_unlocked:
+    STACK_LEAVE(wmngr_api_start_wps);
     return result;
 }
 
@@ -1710,12 +4771,14 @@ on_exit:
  * Once the scan has completed, the acquired data can be fetched by calling
  * #esp_wmngr_get_scan.
  *
- * @return ESP_OK on success, ESP_ERR_* otherwise.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if all scan data sets are
+ *         still in use, ESP_ERR_* otherwise.
  */
 esp_err_t esp_wmngr_start_scan(void)
 {
     esp_err_t result;
     EventBits_t events;
+    STACK_ENTER();
 
     configASSERT(cfg_state.state != wmngr_state_deinit);
     configASSERT(cfg_state.lock != NULL);
@@ -1729,46 +4792,110 @@ esp_err_t esp_wmngr_start_scan(void)
         goto on_exit;
     }
 
+    /* The results could not be published if all slabs are pinned. */
+    if(scan_slab_find(&(cfg_state.scan_table)) == NULL){
+        ESP_LOGW(TAG, "[%s] All scan data sets in use.", __func__);
+        result = ESP_ERR_NO_MEM;
+        goto on_exit;
+    }
+
     xEventGroupSetBits(wifi_events, (BIT_SCAN_START | BIT_TRIGGER));
 
 #if !defined(CONFIG_WMNGR_TASK)
     if(xTimerChangePeriod(config_timer, CFG_DELAY, CFG_DELAY) != pdPASS){
-        cfg_state.state = wmngr_state_failed;
+        set_state(wmngr_state_failed);
         result = ESP_FAIL;
     }
 #endif
 
 on_exit:
+    STACK_LEAVE(wmngr_api_start_scan);
     return result;
 }
 
+/** Set the parameters used for AP scans.
+ *
+ * The new parameters will be used starting with the next scan. A scan
+ * sweep that is already running will keep its channel range.
+ *
+ * @param[in] cfg New scan parameters.
+ * @return ESP_OK on success, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_set_scan_cfg(const struct scan_cfg *cfg)
+{
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+    configASSERT(cfg_state.lock != NULL);
+
+    if(cfg == NULL || cfg->slice_chans > SCAN_MAX_CHAN){
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if(cfg_lock(wmngr_lock_set_scan_cfg, CFG_DELAY) != pdTRUE){
+        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    memmove(&(cfg_state.scan_cfg), cfg, sizeof(cfg_state.scan_cfg));
+
+    cfg_unlock(wmngr_lock_set_scan_cfg);
+
+    return ESP_OK;
+}
+
+/** Get the parameters used for AP scans.
+ * @param[out] cfg Pointer to a #scan_cfg struct the current parameters
+ *             will be copied into.
+ * @return ESP_OK on success, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_get_scan_cfg(struct scan_cfg *cfg)
+{
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+    configASSERT(cfg_state.lock != NULL);
+
+    if(cfg_lock(wmngr_lock_get_scan_cfg, CFG_DELAY) != pdTRUE){
+        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    memmove(cfg, &(cfg_state.scan_cfg), sizeof(*cfg));
+
+    cfg_unlock(wmngr_lock_get_scan_cfg);
+
+    return ESP_OK;
+}
+
 /** Get a pointer to a set of AP scan data.
  *
  * Fetches a reference counted pointer to the latest set of AP scan
  * data. Caller must at some point release the data by calling
  * #esp_wmngr_put_scan.
+ * This function does not take the config state lock, so it will not block
+ * while the WiFi configuration is being changed.
  *
  * @return Pointer to a #scan_data or NULL
  */
 struct scan_data *esp_wmngr_get_scan(void)
 {
+    struct scan_data_ref *ref;
     struct scan_data *data;
 
     configASSERT(cfg_state.state != wmngr_state_deinit);
-    configASSERT(cfg_state.lock != NULL);
 
     data = NULL;
-    if(cfg_state.scan_ref == NULL){
-        goto on_exit;
-    }
 
-    if(xSemaphoreTake(cfg_state.lock, CFG_DELAY) == pdTRUE){
-        data = &(cfg_state.scan_ref->data);
-        kref_get(&(cfg_state.scan_ref->ref_cnt));
-        xSemaphoreGive(cfg_state.lock);
+    /*
+     * Let wifi_scan_done() know that we might be holding a pointer to
+     * the current data set without having a reference to it yet.
+     */
+    atomic_fetch_add(&cfg_state.scan_readers, 1);
+
+    ref = atomic_load(&cfg_state.scan_ref);
+    if(ref != NULL && kref_get_unless_zero(&(ref->ref_cnt))){
+        data = &(ref->data);
     }
 
-on_exit:
+    atomic_fetch_sub(&cfg_state.scan_readers, 1);
+
     return data;
 }
 
@@ -1799,7 +4926,13 @@ bool esp_wmngr_is_connected(void)
  */
 esp_err_t esp_wmngr_connect(void)
 {
-    return set_connect(true);
+    esp_err_t result;
+    STACK_ENTER();
+
+    result = set_connect(true);
+
+    STACK_LEAVE(wmngr_api_connect);
+    return result;
 }
 
 /** Disconnect from currently configured AP.
@@ -1807,7 +4940,13 @@ esp_err_t esp_wmngr_connect(void)
  */
 esp_err_t esp_wmngr_disconnect(void)
 {
-    return set_connect(false);
+    esp_err_t result;
+    STACK_ENTER();
+
+    result = set_connect(false);
+
+    STACK_LEAVE(wmngr_api_disconnect);
+    return result;
 }
 
 /** Fetch current WiFI Manager state.
@@ -1818,19 +4957,292 @@ enum wmngr_state esp_wmngr_get_state(void)
     return cfg_state.state;
 }
 
+/** Wait for the WiFi Manager to enter one of a set of states.
+ *
+ * State changes are also posted as #WMNGR_EVENT_STATE_CHANGED events on
+ * the default event loop.
+ *
+ * @param[in] mask Bit mask of states to wait for, built with
+ *            #WMNGR_STATE_BIT().
+ * @param[in] timeout Maximum number of ticks to wait.
+ * @return ESP_OK if WiFi Manager is in one of the states, ESP_ERR_TIMEOUT
+ *         if it did not enter any of them in time, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_wait_state(uint32_t mask, TickType_t timeout)
+{
+    EventBits_t bits;
+
+    if(state_events == NULL){
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    mask &= STATE_BITS;
+    if(mask == 0){
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    bits = xEventGroupWaitBits(state_events, mask, false, false, timeout);
+
+    return (bits & mask) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
 /** Check if a valid configuration is stored in NVS.
+ *
+ * After initialisation, this is answered from a cached description of the
+ * stored configuration and does not access the flash.
+ *
  * @return true if valid config is found, false otherwise.
  */
 bool esp_wmngr_nvs_valid(void)
 {
-    struct wifi_cfg cfg;
+    struct cfg_obj *obj;
     esp_err_t result;
 
-    result = get_saved_config(&cfg);
+    if(cfg_state.state != wmngr_state_deinit){
+        return cfg_state.nvs.present;
+    }
+
+    obj = cfg_obj_alloc();
+    if(obj == NULL){
+        return false;
+    }
+
+    result = get_saved_config(&(obj->cfg), NULL);
+    cfg_obj_put(obj);
 
     return result == ESP_OK;
 }
 
+/** Get a description of the configuration stored in NVS.
+ *
+ * This does not access the flash.
+ *
+ * @param[out] info Pointer to a #wmngr_nvs_info struct the description
+ *             will be copied into.
+ * @return ESP_OK on success, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_get_nvs_info(struct wmngr_nvs_info *info)
+{
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+    configASSERT(cfg_state.lock != NULL);
+
+    if(cfg_lock(wmngr_lock_get_nvs_info, CFG_DELAY) != pdTRUE){
+        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    memset(info, 0x0, sizeof(*info));
+    info->present = cfg_state.nvs.present;
+    info->version = cfg_state.nvs.version;
+    info->generation = cfg_state.nvs.seq;
+    info->checksum = cfg_state.nvs.crc;
+
+    cfg_unlock(wmngr_lock_get_nvs_info);
+
+    return ESP_OK;
+}
+
+/** Get the longest time spent in the WiFi Manager's timer call back.
+ *
+ * The call back runs in the FreeRTOS timer service task and delays all
+ * other software timers while it is running.
+ *
+ * @return Longest run time in microseconds.
+ */
+uint32_t esp_wmngr_get_timer_max(void)
+{
+    return cfg_state.timer_max_us;
+}
+
+/** Get the number of times the WiFi Manager's state machine has run.
+ *
+ * Useful for comparing how much work different configurations or
+ * scenarios cause.
+ *
+ * @return Number of state machine runs since initialisation.
+ */
+uint32_t esp_wmngr_get_run_count(void)
+{
+    return cfg_state.runs;
+}
+
+/** Get the most recent trace records.
+ *
+ * The trace survives software resets, so this includes the records
+ * leading up to the last reset. Only available if the WMNGR_TRACE option
+ * is set.
+ *
+ * @param[out] recs Array the records will be copied into, oldest first.
+ * @param[in] max Number of records that fit into recs.
+ * @return Number of records copied.
+ */
+size_t esp_wmngr_get_trace(struct wmngr_trace_rec *recs, size_t max)
+{
+#if defined(CONFIG_WMNGR_TRACE)
+    uint32_t head, idx;
+    size_t num, cnt;
+
+    head = atomic_load(&(trace_ring.head));
+    num = MIN(MIN(head, TRACE_ENTRIES), max);
+
+    cnt = 0;
+    for(idx = head - num; idx != head; ++idx){
+        if(trace_read(idx, &(recs[cnt]))){
+            ++cnt;
+        }
+    }
+
+    return cnt;
+#else
+    (void) recs;
+    (void) max;
+
+    return 0;
+#endif
+}
+
+/** Print the trace records to the log.
+ *
+ * Prints one line per record, oldest first. The output can be turned into
+ * a timeline with tools/wmngr_trace.py. Only available if the WMNGR_TRACE
+ * option is set.
+ */
+void esp_wmngr_dump_trace(void)
+{
+#if defined(CONFIG_WMNGR_TRACE)
+    struct wmngr_trace_rec rec;
+    uint32_t head, idx;
+
+    head = atomic_load(&(trace_ring.head));
+
+    ESP_LOGI(TAG, "trace begin %u", head);
+    for(idx = head - MIN(head, TRACE_ENTRIES); idx != head; ++idx){
+        if(!trace_read(idx, &rec)){
+            continue;
+        }
+
+        ESP_LOGI(TAG, "trace %08x %08x %02x %02x %02x %02x %08x %08x",
+                 rec.seq, rec.tick, rec.kind, rec.old_state, rec.new_state,
+                 rec.base, rec.events, (uint32_t) rec.err);
+    }
+    ESP_LOGI(TAG, "trace end");
+#endif
+}
+
+/** Get the contention profile of the WiFi Manager's lock.
+ *
+ * Only available if the WMNGR_LOCK_PROFILE option is set.
+ *
+ * @param[out] stats Pointer to a #wmngr_lock_stats struct the profile
+ *             will be copied into.
+ * @param[in] clear Reset the profile after copying it.
+ * @return ESP_OK on success, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_get_lock_stats(struct wmngr_lock_stats *stats, bool clear)
+{
+#if defined(CONFIG_WMNGR_LOCK_PROFILE)
+    portENTER_CRITICAL(&lock_mux);
+    memmove(stats, &lock_stats, sizeof(*stats));
+    if(clear){
+        memset(&lock_stats, 0x0, sizeof(lock_stats));
+    }
+    portEXIT_CRITICAL(&lock_mux);
+
+    return ESP_OK;
+#else
+    (void) stats;
+    (void) clear;
+
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/** Get runtime statistics.
+ *
+ * Only available if the WMNGR_STATS option is set.
+ *
+ * @param[out] stats Pointer to a #wmngr_stats struct the statistics
+ *             will be copied into.
+ * @return ESP_OK on success, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_get_stats(struct wmngr_stats *stats)
+{
+#if defined(CONFIG_WMNGR_STATS)
+    TickType_t now;
+
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+
+    now = xTaskGetTickCount();
+
+    portENTER_CRITICAL(&stats_mux);
+    memmove(stats, &(cfg_state.stats), sizeof(*stats));
+
+    /* Include the time spent in the current state so far. */
+    stats->state_ms[cfg_state.state] += (uint64_t) (now
+                                                - cfg_state.state_tstamp)
+                                        * portTICK_PERIOD_MS;
+    portEXIT_CRITICAL(&stats_mux);
+
+    return ESP_OK;
+#else
+    (void) stats;
+
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/** Get the stack depth recorded per code path.
+ *
+ * Each entry holds the deepest stack use measured for that path, together
+ * with the task it ran in and the free stack that task had left at that
+ * point. The state entries refer to the task running the WiFi Manager's
+ * state machine. Only available if the WMNGR_STACK_STATS option is set.
+ *
+ * The measurement repaints the unused part of the calling task's stack,
+ * so uxTaskGetStackHighWaterMark() only reflects stack use since the last
+ * instrumented call in such a task.
+ *
+ * @param[out] stats Pointer to a #wmngr_stack_stats struct the values
+ *             will be copied into.
+ * @return ESP_OK on success, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_get_stack_stats(struct wmngr_stack_stats *stats)
+{
+#if defined(CONFIG_WMNGR_STACK_STATS)
+    portENTER_CRITICAL(&stack_mux);
+    memmove(stats, &(cfg_state.stack_stats), sizeof(*stats));
+    portEXIT_CRITICAL(&stack_mux);
+
+    return ESP_OK;
+#else
+    (void) stats;
+
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/** Get counters of NVS write operations.
+ * @param[out] stats Pointer to a #wmngr_flash_stats struct the counters
+ *             will be copied into.
+ * @return ESP_OK on success, ESP_ERR_* otherwise.
+ */
+esp_err_t esp_wmngr_get_flash_stats(struct wmngr_flash_stats *stats)
+{
+    configASSERT(cfg_state.state != wmngr_state_deinit);
+    configASSERT(cfg_state.lock != NULL);
+
+    if(cfg_lock(wmngr_lock_get_flash_stats, CFG_DELAY) != pdTRUE){
+        ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    memmove(stats, &(cfg_state.flash_stats), sizeof(*stats));
+
+    cfg_unlock(wmngr_lock_get_flash_stats);
+
+    return ESP_OK;
+}
+
 /** Reset the WiFi Manager configuration.
  *
  * Clear and reset the stored and loaded configuration to compile time
@@ -1840,13 +5252,15 @@ bool esp_wmngr_nvs_valid(void)
 esp_err_t esp_wmngr_reset_cfg(void)
 {
     esp_err_t result;
+    STACK_ENTER();
 
     configASSERT(cfg_state.state != wmngr_state_deinit);
     configASSERT(cfg_state.lock != NULL);
 
-    if(xSemaphoreTake(cfg_state.lock, CFG_DELAY) != pdTRUE){
+    if(cfg_lock(wmngr_lock_reset_cfg, CFG_DELAY) != pdTRUE){
         ESP_LOGE(TAG, "[%s] Error taking mutex.", __func__);
-        return ESP_ERR_TIMEOUT;
+        result = ESP_ERR_TIMEOUT;
+        goto on_unlocked;
     }
 
     if(cfg_state.state != wmngr_state_stopped){
@@ -1868,7 +5282,9 @@ esp_err_t esp_wmngr_reset_cfg(void)
     }
 
 on_exit:
-    xSemaphoreGive(cfg_state.lock);
+    cfg_unlock(wmngr_lock_reset_cfg);
 
+on_unlocked:
+    STACK_LEAVE(wmngr_api_reset_cfg);
     return result;
 }
@@ -0,0 +1,823 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/*
+ * Minimal single threaded stand-ins for the parts of FreeRTOS, the event
+ * loop, NVS, esp_netif and the WiFi driver used by the WiFi Manager.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "freertos/event_groups.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+#include "esp_wps.h"
+#include "esp_netif.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "lwip/ip_addr.h"
+
+#include "host.h"
+
+#define ARRAY_SIZE(a)   (sizeof(a) / sizeof((a)[0]))
+
+struct host_wifi host_wifi;
+struct host_nvs host_nvs;
+struct host_cost host_cost;
+TickType_t host_ticks;
+int64_t host_cost_us;
+unsigned int host_events_posted;
+unsigned int host_failures;
+
+/*****************************************************************************\
+ *  FreeRTOS                                                                 *
+\*****************************************************************************/
+
+struct host_mutex {
+    bool taken;
+};
+
+struct host_events {
+    EventBits_t bits;
+};
+
+struct host_timer {
+    TimerCallbackFunction_t callback;
+    TickType_t period;
+    TickType_t expiry;
+    bool reload;
+    bool active;
+};
+
+TickType_t xTaskGetTickCount(void)
+{
+    return host_ticks;
+}
+
+/* Tasks never run, tests call their loop bodies directly. */
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t prio, TaskHandle_t *task)
+{
+    if(task != NULL){
+        *task = NULL;
+    }
+
+    return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t func, const char *name,
+                               uint32_t stack, void *arg, UBaseType_t prio,
+                               StackType_t *stack_mem, StaticTask_t *task)
+{
+    return (TaskHandle_t) task;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return calloc(1, sizeof(struct host_mutex));
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *mem)
+{
+    _Static_assert(sizeof(*mem) >= sizeof(struct host_mutex), "too small");
+
+    memset(mem, 0x0, sizeof(*mem));
+
+    return (SemaphoreHandle_t) mem;
+}
+
+/* Nobody else could release the mutex, so never wait for it. */
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    struct host_mutex *mutex = sem;
+
+    if(mutex->taken){
+        return pdFALSE;
+    }
+
+    mutex->taken = true;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    struct host_mutex *mutex = sem;
+
+    if(!mutex->taken){
+        return pdFALSE;
+    }
+
+    mutex->taken = false;
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    free(sem);
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    return calloc(1, sizeof(struct host_events));
+}
+
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t *mem)
+{
+    _Static_assert(sizeof(*mem) >= sizeof(struct host_events), "too small");
+
+    memset(mem, 0x0, sizeof(*mem));
+
+    return (EventGroupHandle_t) mem;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    struct host_events *events = group;
+
+    events->bits |= bits;
+    return events->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    struct host_events *events = group;
+    EventBits_t old;
+
+    old = events->bits;
+    events->bits &= ~bits;
+    return old;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    struct host_events *events = group;
+
+    return events->bits;
+}
+
+/* Nobody else could set the bits, so never wait for them. */
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+                                BaseType_t clear, BaseType_t all,
+                                TickType_t timeout)
+{
+    struct host_events *events = group;
+    EventBits_t result;
+    bool done;
+
+    result = events->bits;
+    done = all ? ((result & bits) == bits) : ((result & bits) != 0);
+    if(done && clear){
+        events->bits &= ~bits;
+    }
+
+    return result;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    free(group);
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+                           UBaseType_t reload, void *id,
+                           TimerCallbackFunction_t callback)
+{
+    struct host_timer *timer;
+
+    timer = calloc(1, sizeof(*timer));
+    if(timer != NULL){
+        timer->callback = callback;
+        timer->period = period;
+        timer->reload = reload;
+    }
+
+    return timer;
+}
+
+TimerHandle_t xTimerCreateStatic(const char *name, TickType_t period,
+                                 UBaseType_t reload, void *id,
+                                 TimerCallbackFunction_t callback,
+                                 StaticTimer_t *mem)
+{
+    struct host_timer *timer;
+
+    _Static_assert(sizeof(*mem) >= sizeof(*timer), "too small");
+
+    memset(mem, 0x0, sizeof(*mem));
+    timer = (struct host_timer *) mem;
+    timer->callback = callback;
+    timer->period = period;
+    timer->reload = reload;
+
+    return timer;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t handle, TickType_t period,
+                              TickType_t timeout)
+{
+    struct host_timer *timer = handle;
+
+    /* Like the real thing, this also starts a dormant timer. */
+    timer->period = period;
+    timer->expiry = host_ticks + period;
+    timer->active = true;
+
+    return pdPASS;
+}
+
+BaseType_t xTimerStart(TimerHandle_t handle, TickType_t timeout)
+{
+    struct host_timer *timer = handle;
+
+    timer->expiry = host_ticks + timer->period;
+    timer->active = true;
+
+    return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t handle, TickType_t timeout)
+{
+    struct host_timer *timer = handle;
+
+    timer->active = false;
+
+    return pdPASS;
+}
+
+BaseType_t xTimerDelete(TimerHandle_t handle, TickType_t timeout)
+{
+    free(handle);
+
+    return pdPASS;
+}
+
+bool host_timer_fire(TimerHandle_t handle)
+{
+    struct host_timer *timer = handle;
+
+    if(timer == NULL || !timer->active){
+        return false;
+    }
+
+    if((int32_t) (timer->expiry - host_ticks) > 0){
+        host_ticks = timer->expiry;
+    }
+
+    if(timer->reload){
+        timer->expiry = host_ticks + timer->period;
+    } else {
+        timer->active = false;
+    }
+
+    timer->callback(handle);
+
+    return true;
+}
+
+/*****************************************************************************\
+ *  Event loop                                                               *
+\*****************************************************************************/
+
+ESP_EVENT_DEFINE_BASE(WIFI_EVENT);
+ESP_EVENT_DEFINE_BASE(IP_EVENT);
+
+static struct {
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void *arg;
+} handlers[8];
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id,
+                                     esp_event_handler_t handler, void *arg)
+{
+    unsigned int idx;
+
+    for(idx = 0; idx < ARRAY_SIZE(handlers); ++idx){
+        if(handlers[idx].handler == NULL){
+            handlers[idx].base = base;
+            handlers[idx].id = id;
+            handlers[idx].handler = handler;
+            handlers[idx].arg = arg;
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_NO_MEM;
+}
+
+void host_event_post(esp_event_base_t base, int32_t id, void *data)
+{
+    unsigned int idx;
+
+    for(idx = 0; idx < ARRAY_SIZE(handlers); ++idx){
+        if(handlers[idx].handler != NULL && handlers[idx].base == base
+           && (handlers[idx].id == ESP_EVENT_ANY_ID || handlers[idx].id == id))
+        {
+            handlers[idx].handler(handlers[idx].arg, base, id, data);
+        }
+    }
+}
+
+esp_err_t esp_event_post(esp_event_base_t base, int32_t id, void *data,
+                         size_t size, TickType_t timeout)
+{
+    ++host_events_posted;
+    host_event_post(base, id, data);
+
+    return ESP_OK;
+}
+
+/*****************************************************************************\
+ *  NVS                                                                      *
+\*****************************************************************************/
+
+/* One flat store, namespaces are ignored. */
+static struct {
+    bool used;
+    char key[16];
+    uint8_t data[1024];
+    size_t len;
+} nvs_store[16];
+
+static int nvs_find(const char *key)
+{
+    unsigned int idx;
+
+    for(idx = 0; idx < ARRAY_SIZE(nvs_store); ++idx){
+        if(nvs_store[idx].used && !strncmp(nvs_store[idx].key, key,
+                                           sizeof(nvs_store[idx].key)))
+        {
+            return idx;
+        }
+    }
+
+    return -1;
+}
+
+static esp_err_t nvs_get(const char *key, void *val, size_t *len)
+{
+    int idx;
+
+    ++host_nvs.reads;
+    idx = nvs_find(key);
+    if(idx < 0){
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    if(val != NULL){
+        if(*len < nvs_store[idx].len){
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(val, nvs_store[idx].data, nvs_store[idx].len);
+    }
+    *len = nvs_store[idx].len;
+
+    return ESP_OK;
+}
+
+static esp_err_t nvs_set(const char *key, const void *val, size_t len)
+{
+    unsigned int idx;
+    int found;
+
+    ++host_nvs.writes;
+    host_cost_us += host_cost.nvs_write;
+    if(len > sizeof(nvs_store[0].data)){
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    found = nvs_find(key);
+    if(found < 0){
+        for(idx = 0; idx < ARRAY_SIZE(nvs_store); ++idx){
+            if(!nvs_store[idx].used){
+                found = idx;
+                break;
+            }
+        }
+    }
+
+    if(found < 0){
+        return ESP_ERR_NO_MEM;
+    }
+
+    nvs_store[found].used = true;
+    snprintf(nvs_store[found].key, sizeof(nvs_store[found].key), "%s", key);
+    memcpy(nvs_store[found].data, val, len);
+    nvs_store[found].len = len;
+
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle)
+{
+    *handle = 1;
+
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle handle)
+{
+}
+
+esp_err_t nvs_get_u32(nvs_handle handle, const char *key, uint32_t *val)
+{
+    size_t len = sizeof(*val);
+
+    return nvs_get(key, val, &len);
+}
+
+esp_err_t nvs_set_u32(nvs_handle handle, const char *key, uint32_t val)
+{
+    return nvs_set(key, &val, sizeof(val));
+}
+
+esp_err_t nvs_get_u8(nvs_handle handle, const char *key, uint8_t *val)
+{
+    size_t len = sizeof(*val);
+
+    return nvs_get(key, val, &len);
+}
+
+esp_err_t nvs_set_u8(nvs_handle handle, const char *key, uint8_t val)
+{
+    return nvs_set(key, &val, sizeof(val));
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *val,
+                       size_t *len)
+{
+    return nvs_get(key, val, len);
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *val,
+                       size_t len)
+{
+    return nvs_set(key, val, len);
+}
+
+esp_err_t nvs_erase_all(nvs_handle handle)
+{
+    ++host_nvs.erases;
+    memset(nvs_store, 0x0, sizeof(nvs_store));
+
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char *key)
+{
+    int idx;
+
+    ++host_nvs.erases;
+    idx = nvs_find(key);
+    if(idx < 0){
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    nvs_store[idx].used = false;
+
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle handle)
+{
+    ++host_nvs.commits;
+    host_cost_us += host_cost.nvs_commit;
+
+    return ESP_OK;
+}
+
+/*****************************************************************************\
+ *  esp_netif and lwIP                                                       *
+\*****************************************************************************/
+
+struct esp_netif_obj {
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns_info[ESP_NETIF_DNS_MAX];
+    esp_netif_dhcp_status_t dhcpc;
+    esp_netif_dhcp_status_t dhcps;
+};
+
+static struct esp_netif_obj sta_netif, ap_netif;
+
+unsigned int host_dhcps_starts;
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void)
+{
+    sta_netif.dhcpc = ESP_NETIF_DHCP_STARTED;
+
+    return &sta_netif;
+}
+
+/* Same defaults as the real AP interface. */
+esp_netif_t *esp_netif_create_default_wifi_ap(void)
+{
+    IP4_ADDR(&(ap_netif.ip_info.ip), 192, 168, 4, 1);
+    IP4_ADDR(&(ap_netif.ip_info.gw), 192, 168, 4, 1);
+    IP4_ADDR(&(ap_netif.ip_info.netmask), 255, 255, 255, 0);
+    ap_netif.dhcps = ESP_NETIF_DHCP_STARTED;
+
+    return &ap_netif;
+}
+
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *netif)
+{
+    netif->dhcpc = ESP_NETIF_DHCP_STOPPED;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *netif)
+{
+    netif->dhcpc = ESP_NETIF_DHCP_STARTED;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcps_stop(esp_netif_t *netif)
+{
+    if(netif->dhcps == ESP_NETIF_DHCP_STOPPED){
+        return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED;
+    }
+
+    netif->dhcps = ESP_NETIF_DHCP_STOPPED;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcps_start(esp_netif_t *netif)
+{
+    if(netif->dhcps == ESP_NETIF_DHCP_STARTED){
+        return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED;
+    }
+
+    netif->dhcps = ESP_NETIF_DHCP_STARTED;
+    ++host_dhcps_starts;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_get_status(esp_netif_t *netif,
+                                     esp_netif_dhcp_status_t *status)
+{
+    *status = netif->dhcpc;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_ip_info(esp_netif_t *netif,
+                                const esp_netif_ip_info_t *info)
+{
+    /* The real thing refuses to change the address under the server. */
+    if(netif->dhcps == ESP_NETIF_DHCP_STARTED){
+        return ESP_ERR_ESP_NETIF_DHCP_NOT_STOPPED;
+    }
+
+    netif->ip_info = *info;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *netif,
+                                esp_netif_ip_info_t *info)
+{
+    *info = netif->ip_info;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_dns_info(esp_netif_t *netif,
+                                 esp_netif_dns_type_t type,
+                                 esp_netif_dns_info_t *dns)
+{
+    netif->dns_info[type] = *dns;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_dns_info(esp_netif_t *netif,
+                                 esp_netif_dns_type_t type,
+                                 esp_netif_dns_info_t *dns)
+{
+    *dns = netif->dns_info[type];
+
+    return ESP_OK;
+}
+
+int ip4addr_aton(const char *str, ip4_addr_t *addr)
+{
+    unsigned int a, b, c, d;
+
+    if(sscanf(str, "%u.%u.%u.%u", &a, &b, &c, &d) != 4
+       || a > 255 || b > 255 || c > 255 || d > 255)
+    {
+        return 0;
+    }
+
+    IP4_ADDR(addr, a, b, c, d);
+
+    return 1;
+}
+
+/*****************************************************************************\
+ *  WiFi driver                                                              *
+\*****************************************************************************/
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config)
+{
+    host_wifi.initialised = true;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_restore(void)
+{
+    ++host_wifi.restores;
+    memset(&host_wifi.sta, 0x0, sizeof(host_wifi.sta));
+    memset(&host_wifi.ap, 0x0, sizeof(host_wifi.ap));
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+    host_wifi.mode = mode;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mode(wifi_mode_t *mode)
+{
+    *mode = host_wifi.mode;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t iface, wifi_config_t *conf)
+{
+    host_cost_us += host_cost.wifi_set_config;
+
+    if(iface == WIFI_IF_STA){
+        host_wifi.sta = *conf;
+    } else {
+        host_wifi.ap = *conf;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_config(wifi_interface_t iface, wifi_config_t *conf)
+{
+    *conf = (iface == WIFI_IF_STA) ? host_wifi.sta : host_wifi.ap;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+    host_cost_us += host_cost.wifi_start;
+    host_wifi.started = true;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void)
+{
+    host_cost_us += host_cost.wifi_stop;
+    host_wifi.started = false;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void)
+{
+    ++host_wifi.connects;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void)
+{
+    ++host_wifi.disconnects;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *config, bool block)
+{
+    ++host_wifi.scans;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_stop(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_num(uint16_t *number)
+{
+    *number = host_wifi.num_scan_aps;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t *number,
+                                       wifi_ap_record_t *records)
+{
+    if(*number > host_wifi.num_scan_aps){
+        *number = host_wifi.num_scan_aps;
+    }
+    memcpy(records, host_wifi.scan_aps, *number * sizeof(*records));
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *info)
+{
+    memset(info, 0x0, sizeof(*info));
+    memcpy(info->bssid, host_wifi.bssid, sizeof(info->bssid));
+    memcpy(info->ssid, host_wifi.sta.sta.ssid, sizeof(host_wifi.sta.sta.ssid));
+    info->primary = host_wifi.channel;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_country(wifi_country_t *country)
+{
+    memset(country, 0x0, sizeof(*country));
+    memcpy(country->cc, "01", sizeof("01"));
+    country->schan = 1;
+    country->nchan = 13;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_wps_enable(const esp_wps_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_wps_disable(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_wps_start(int timeout_ms)
+{
+    return ESP_OK;
+}
+
+/*****************************************************************************\
+ *  Miscellaneous                                                            *
+\*****************************************************************************/
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return "ERROR";
+}
+
+uint32_t esp_random(void)
+{
+    return (uint32_t) rand();
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t) host_ticks * portTICK_PERIOD_MS * 1000 + host_cost_us;
+}
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+    return ESP_RST_POWERON;
+}
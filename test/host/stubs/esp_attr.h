@@ -0,0 +1,5 @@
+#pragma once
+
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+#define __NOINIT_ATTR
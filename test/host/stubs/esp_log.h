@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * Errors and warnings always go to stderr. Other messages are only printed
+ * if HOST_VERBOSE is set to their level or above, e.g. make HOST_VERBOSE=2
+ */
+#ifndef HOST_VERBOSE
+#define HOST_VERBOSE 0
+#endif
+
+#define HOST_LOG(level, prefix, tag, fmt, ...)                          \
+    do{                                                                 \
+        if(HOST_VERBOSE >= (level)){                                    \
+            printf(prefix " %s: " fmt "\n", tag, ##__VA_ARGS__);        \
+        }                                                               \
+    }while(0)
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG(1, "I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOG(2, "D", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) HOST_LOG(3, "V", tag, fmt, ##__VA_ARGS__)
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "esp_err.h"
+#include "lwip/ip_addr.h"
+
+#define ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED  0x5004
+#define ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED  0x5005
+#define ESP_ERR_ESP_NETIF_DHCP_NOT_STOPPED      0x5007
+
+typedef struct esp_netif_obj esp_netif_t;
+
+typedef struct {
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef struct {
+    ip_addr_t ip;
+} esp_netif_dns_info_t;
+
+typedef enum {
+    ESP_NETIF_DNS_MAIN,
+    ESP_NETIF_DNS_BACKUP,
+    ESP_NETIF_DNS_FALLBACK,
+    ESP_NETIF_DNS_MAX,
+} esp_netif_dns_type_t;
+
+typedef enum {
+    ESP_NETIF_DHCP_INIT,
+    ESP_NETIF_DHCP_STARTED,
+    ESP_NETIF_DHCP_STOPPED,
+} esp_netif_dhcp_status_t;
+
+esp_err_t esp_netif_init(void);
+esp_netif_t *esp_netif_create_default_wifi_sta(void);
+esp_netif_t *esp_netif_create_default_wifi_ap(void);
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *netif);
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *netif);
+esp_err_t esp_netif_dhcpc_get_status(esp_netif_t *netif,
+                                     esp_netif_dhcp_status_t *status);
+esp_err_t esp_netif_dhcps_stop(esp_netif_t *netif);
+esp_err_t esp_netif_dhcps_start(esp_netif_t *netif);
+esp_err_t esp_netif_set_ip_info(esp_netif_t *netif,
+                                const esp_netif_ip_info_t *info);
+esp_err_t esp_netif_get_ip_info(esp_netif_t *netif,
+                                esp_netif_ip_info_t *info);
+esp_err_t esp_netif_set_dns_info(esp_netif_t *netif,
+                                 esp_netif_dns_type_t type,
+                                 esp_netif_dns_info_t *dns);
+esp_err_t esp_netif_get_dns_info(esp_netif_t *netif,
+                                 esp_netif_dns_type_t type,
+                                 esp_netif_dns_info_t *dns);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "esp_err.h"
+
+typedef enum { WPS_TYPE_DISABLE, WPS_TYPE_PBC, WPS_TYPE_PIN } wps_type_t;
+
+typedef struct {
+    char manufacturer[65];
+    char model_number[33];
+    char model_name[33];
+    char device_name[33];
+} wps_factory_information_t;
+
+typedef struct {
+    wps_type_t wps_type;
+    wps_factory_information_t factory_info;
+} esp_wps_config_t;
+
+#define WPS_CONFIG_INIT_DEFAULT(type) {                                 \
+    .wps_type = type,                                                   \
+    .factory_info = {                                                   \
+        .manufacturer = "ESPRESSIF",                                    \
+        .model_number = "ESP32",                                        \
+        .model_name = "ESPRESSIF IOT",                                  \
+        .device_name = "ESP STATION",                                   \
+    }                                                                   \
+}
+
+esp_err_t esp_wifi_wps_enable(const esp_wps_config_t *config);
+esp_err_t esp_wifi_wps_disable(void);
+esp_err_t esp_wifi_wps_start(int timeout_ms);
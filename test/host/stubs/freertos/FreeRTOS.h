@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "sdkconfig.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t StackType_t;
+
+typedef void *SemaphoreHandle_t;
+typedef void *TimerHandle_t;
+typedef void *TaskHandle_t;
+typedef void *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+
+typedef struct { int x[20]; } StaticSemaphore_t;
+typedef struct { int x[12]; } StaticTimer_t;
+typedef struct { int x[90]; } StaticTask_t;
+typedef struct { int x[8]; } StaticEventGroup_t;
+
+/* Everything runs in a single thread. */
+typedef struct { int dummy; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    { 0 }
+#define portENTER_CRITICAL(mux)         ((void)(mux))
+#define portEXIT_CRITICAL(mux)          ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux)     ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux)      ((void)(mux))
+
+#define portTICK_PERIOD_MS      10
+#define portMAX_DELAY           0xffffffffu
+#define pdMS_TO_TICKS(ms)       ((TickType_t)((ms) / portTICK_PERIOD_MS))
+#define pdTICKS_TO_MS(ticks)    ((ticks) * portTICK_PERIOD_MS)
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define pdFAIL                  0
+
+#define configASSERT(x)         assert(x)
+
+#define BIT0    (1u << 0)
+#define BIT1    (1u << 1)
+#define BIT2    (1u << 2)
+#define BIT3    (1u << 3)
+#define BIT4    (1u << 4)
+#define BIT5    (1u << 5)
+#define BIT6    (1u << 6)
+#define BIT7    (1u << 7)
+#define BIT8    (1u << 8)
+#define BIT9    (1u << 9)
+#define BIT10   (1u << 10)
+#define BIT11   (1u << 11)
+#define BIT12   (1u << 12)
+#define BIT13   (1u << 13)
+#define BIT14   (1u << 14)
+#define BIT15   (1u << 15)
+#define BIT16   (1u << 16)
+#define BIT17   (1u << 17)
+#define BIT18   (1u << 18)
+#define BIT19   (1u << 19)
+#define BIT20   (1u << 20)
+#define BIT21   (1u << 21)
+#define BIT22   (1u << 22)
+#define BIT23   (1u << 23)
+
+#include "freertos/task.h"
+#include "freertos/semphr.h"
@@ -0,0 +1,13 @@
+#pragma once
+
+typedef void (*TaskFunction_t)(void *arg);
+
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t prio, TaskHandle_t *task);
+TaskHandle_t xTaskCreateStatic(TaskFunction_t func, const char *name,
+                               uint32_t stack, void *arg, UBaseType_t prio,
+                               StackType_t *stack_mem, StaticTask_t *task);
+void vTaskDelay(TickType_t ticks);
+uint8_t *pxTaskGetStackStart(TaskHandle_t task);
+char *pcTaskGetTaskName(TaskHandle_t task);
@@ -0,0 +1,113 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/*
+ * Controls for the fake FreeRTOS, event loop, NVS and WiFi driver used by
+ * the host tests. Everything runs in a single thread: time only advances
+ * when a test fires a timer or sets host_ticks, and events are delivered
+ * synchronously.
+ */
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+
+/* State of the fake WiFi driver. */
+struct host_wifi {
+    bool initialised;
+    bool started;
+    wifi_mode_t mode;
+    wifi_config_t sta;
+    wifi_config_t ap;
+    uint8_t bssid[6];           /* BSSID reported while connected */
+    uint8_t channel;            /* Channel reported while connected */
+    unsigned int restores;
+    unsigned int connects;
+    unsigned int disconnects;
+    unsigned int scans;
+    wifi_ap_record_t scan_aps[8]; /* APs reported by scans */
+    uint16_t num_scan_aps;
+};
+
+extern struct host_wifi host_wifi;
+
+/* Accesses to the fake NVS. Each read or write is a page scan on flash. */
+struct host_nvs {
+    unsigned int reads;
+    unsigned int writes;
+    unsigned int erases;
+    unsigned int commits;
+};
+
+extern struct host_nvs host_nvs;
+
+/*
+ * Modelled run time of slow driver and NVS calls in microseconds, all 0 by
+ * default. Each call adds its cost to host_cost_us, which advances
+ * esp_timer_get_time() but not host_ticks.
+ */
+struct host_cost {
+    unsigned int wifi_start;
+    unsigned int wifi_stop;
+    unsigned int wifi_set_config;
+    unsigned int nvs_write;     /* Per nvs_set_*() */
+    unsigned int nvs_commit;
+};
+
+extern struct host_cost host_cost;
+extern int64_t host_cost_us;
+
+/* Number of times the AP's DHCP server has been (re)started. */
+extern unsigned int host_dhcps_starts;
+
+/* Current time in ticks, returned by xTaskGetTickCount(). */
+extern TickType_t host_ticks;
+
+/* Number of events posted with esp_event_post(). */
+extern unsigned int host_events_posted;
+
+/*
+ * Fire the timer if it is armed. Time is advanced to the timer's expiry
+ * first. Returns false if the timer was not armed.
+ */
+bool host_timer_fire(TimerHandle_t timer);
+
+/* Deliver an event to the handlers registered for it. */
+void host_event_post(esp_event_base_t base, int32_t id, void *data);
+
+/* Number of failed checks so far. */
+extern unsigned int host_failures;
+
+#define CHECK(cond)                                                     \
+    do{                                                                 \
+        if(!(cond)){                                                    \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            ++host_failures;                                            \
+        }                                                               \
+    }while(0)
+
+#endif /* HOST_H_ */
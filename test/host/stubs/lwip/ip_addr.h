@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct { uint32_t addr; } ip4_addr_t;
+typedef ip4_addr_t esp_ip4_addr_t;
+
+typedef struct {
+    union {
+        ip4_addr_t ip4;
+        uint32_t ip6[4];
+    } u_addr;
+    uint8_t type;
+} ip_addr_t;
+
+#define IPADDR_TYPE_V4          0
+
+#define ip_addr_isany_val(a)    ((a).u_addr.ip4.addr == 0)
+#define ip_addr_cmp(a, b)       ((a)->type == (b)->type                 \
+                                 && (a)->u_addr.ip4.addr == (b)->u_addr.ip4.addr)
+#define ip4_addr_cmp(a, b)      ((a)->addr == (b)->addr)
+#define IP4_ADDR(a, b, c, d, e) ((a)->addr = (uint32_t)(b)              \
+                                             | (uint32_t)(c) << 8       \
+                                             | (uint32_t)(d) << 16      \
+                                             | (uint32_t)(e) << 24)
+
+int ip4addr_aton(const char *str, ip4_addr_t *addr);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef uint32_t nvs_handle;
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode;
+
+#define ESP_ERR_NVS_NOT_FOUND   0x1102
+
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle);
+void nvs_close(nvs_handle handle);
+esp_err_t nvs_get_u32(nvs_handle handle, const char *key, uint32_t *val);
+esp_err_t nvs_set_u32(nvs_handle handle, const char *key, uint32_t val);
+esp_err_t nvs_get_u8(nvs_handle handle, const char *key, uint8_t *val);
+esp_err_t nvs_set_u8(nvs_handle handle, const char *key, uint8_t val);
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *val,
+                       size_t *len);
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *val,
+                       size_t len);
+esp_err_t nvs_erase_all(nvs_handle handle);
+esp_err_t nvs_erase_key(nvs_handle handle, const char *key);
+esp_err_t nvs_commit(nvs_handle handle);
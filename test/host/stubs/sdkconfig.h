@@ -0,0 +1,24 @@
+/*
+ * Configuration used for the host tests: WiFi Manager running from the
+ * timer, without separate task or worker, so the tests can drive the state
+ * machine directly.
+ */
+#pragma once
+
+#define CONFIG_WMNGR_ENABLED 1
+#define CONFIG_WMNGR_AP_SSID "ESP WiFi Manager"
+#define CONFIG_WMNGR_AP_IP "192.168.4.1"
+#define CONFIG_WMNGR_AP_GW "192.168.4.1"
+#define CONFIG_WMNGR_AP_MASK "255.255.255.0"
+#define CONFIG_WMNGR_SCAN_MAX_AGE 300
+#define CONFIG_WMNGR_SCAN_SLABS 3
+#define CONFIG_WMNGR_SCAN_DWELL_TIME 120
+#define CONFIG_WMNGR_SCAN_SLICE_CHANS 0
+#define CONFIG_WMNGR_SCAN_HOME_TIME 300
+#define CONFIG_WMNGR_FAST_CONNECT_TIMEOUT 5000
+#define CONFIG_WMNGR_RECONNECT_BASE 1000
+#define CONFIG_WMNGR_RECONNECT_MAX 300000
+#define CONFIG_WMNGR_RECONNECT_LIGHT 3
+#define CONFIG_WMNGR_SAVE_DELAY 10000
+#define CONFIG_WMNGR_TRACE_ENTRIES 64
+#define CONFIG_WMNGR_SNAP_PINNED 2
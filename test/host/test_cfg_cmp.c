@@ -0,0 +1,257 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/* Tests for the config comparison helpers. */
+
+#include "wifi_manager.c"
+
+#include "host.h"
+
+static void set_str(uint8_t *dst, size_t len, const char *src)
+{
+    memset(dst, 0x0, len);
+    memcpy(dst, src, MIN(strlen(src), len));
+}
+
+static void init_ap(wifi_ap_config_t *ap)
+{
+    memset(ap, 0x0, sizeof(*ap));
+    set_str(ap->ssid, sizeof(ap->ssid), "MyAP");
+    set_str(ap->password, sizeof(ap->password), "secret123");
+    ap->authmode = WIFI_AUTH_WPA2_PSK;
+    ap->channel = 6;
+    ap->max_connection = MAX_AP_CLIENTS;
+    ap->beacon_interval = 100;
+}
+
+static void init_sta(wifi_sta_config_t *sta)
+{
+    memset(sta, 0x0, sizeof(*sta));
+    set_str(sta->ssid, sizeof(sta->ssid), "HomeNet");
+    set_str(sta->password, sizeof(sta->password), "password");
+    sta->listen_interval = 3;
+}
+
+static void init_cfg(struct wifi_cfg *cfg, wifi_mode_t mode)
+{
+    memset(cfg, 0x0, sizeof(*cfg));
+    cfg->mode = mode;
+    cfg->sta_connect = true;
+    init_ap(&(cfg->ap.ap));
+    init_sta(&(cfg->sta.sta));
+    IP4_ADDR(&(cfg->ap_ip_info.ip), 192, 168, 4, 1);
+    IP4_ADDR(&(cfg->ap_ip_info.gw), 192, 168, 4, 1);
+    IP4_ADDR(&(cfg->ap_ip_info.netmask), 255, 255, 255, 0);
+}
+
+static void test_ap_ssid_len(void)
+{
+    wifi_ap_config_t a, b;
+
+    /* Explicit length and NUL termination describe the same SSID. */
+    init_ap(&a);
+    init_ap(&b);
+    a.ssid_len = 4;
+    CHECK(ap_cfgs_are_equal(&a, &b));
+    CHECK(ap_cfgs_are_equal(&b, &a));
+
+    /* Bytes after ssid_len are not part of the SSID. */
+    set_str(a.ssid, sizeof(a.ssid), "MyAPjunk");
+    CHECK(ap_cfgs_are_equal(&a, &b));
+
+    /* A shorter ssid_len is a different SSID. */
+    a.ssid_len = 2;
+    CHECK(!ap_cfgs_are_equal(&a, &b));
+
+    /* As is a different NUL terminated one. */
+    init_ap(&a);
+    set_str(a.ssid, sizeof(a.ssid), "MyAP2");
+    CHECK(!ap_cfgs_are_equal(&a, &b));
+
+    /* SSIDs using the full buffer need not be NUL terminated. */
+    memset(a.ssid, 'x', sizeof(a.ssid));
+    memset(b.ssid, 'x', sizeof(b.ssid));
+    a.ssid_len = sizeof(a.ssid);
+    b.ssid_len = 0;
+    CHECK(ap_cfgs_are_equal(&a, &b));
+}
+
+static void test_ap_password(void)
+{
+    wifi_ap_config_t a, b;
+
+    init_ap(&a);
+    init_ap(&b);
+    set_str(b.password, sizeof(b.password), "other");
+    CHECK(!ap_cfgs_are_equal(&a, &b));
+
+    /* Open APs do not use the password. */
+    a.authmode = WIFI_AUTH_OPEN;
+    b.authmode = WIFI_AUTH_OPEN;
+    CHECK(ap_cfgs_are_equal(&a, &b));
+
+    /* But switching between open and protected is a change. */
+    b.authmode = WIFI_AUTH_WPA2_PSK;
+    set_str(b.password, sizeof(b.password), "secret123");
+    CHECK(!ap_cfgs_are_equal(&a, &b));
+}
+
+static void test_ap_defaults(void)
+{
+    wifi_ap_config_t a, b;
+
+    init_ap(&a);
+    init_ap(&b);
+
+    /* A beacon_interval of 0 means the driver's default of 100. */
+    a.beacon_interval = 0;
+    CHECK(ap_cfgs_are_equal(&a, &b));
+
+    b.beacon_interval = 200;
+    CHECK(!ap_cfgs_are_equal(&a, &b));
+
+    /* max_connection is always forced to MAX_AP_CLIENTS. */
+    init_ap(&a);
+    init_ap(&b);
+    a.max_connection = 0;
+    CHECK(ap_cfgs_are_equal(&a, &b));
+
+    b.channel = 11;
+    CHECK(!ap_cfgs_are_equal(&a, &b));
+}
+
+static void test_sta(void)
+{
+    wifi_sta_config_t a, b;
+
+    init_sta(&a);
+    init_sta(&b);
+    CHECK(sta_cfgs_are_equal(&a, &b));
+
+    /* Bytes after the NUL terminator do not matter. */
+    a.ssid[sizeof(a.ssid) - 1] = 'x';
+    CHECK(sta_cfgs_are_equal(&a, &b));
+
+    init_sta(&a);
+    set_str(a.password, sizeof(a.password), "other");
+    CHECK(!sta_cfgs_are_equal(&a, &b));
+
+    /* A listen_interval of 0 means the driver's default of 3. */
+    init_sta(&a);
+    a.listen_interval = 0;
+    CHECK(sta_cfgs_are_equal(&a, &b));
+
+    b.listen_interval = 5;
+    CHECK(!sta_cfgs_are_equal(&a, &b));
+
+    /* The BSSID only counts if it is used. */
+    init_sta(&a);
+    init_sta(&b);
+    memset(a.bssid, 0x11, sizeof(a.bssid));
+    CHECK(sta_cfgs_are_equal(&a, &b));
+
+    a.bssid_set = true;
+    b.bssid_set = true;
+    CHECK(!sta_cfgs_are_equal(&a, &b));
+}
+
+static void test_cfg_changes(void)
+{
+    struct wifi_cfg a, b;
+
+    init_cfg(&a, WIFI_MODE_APSTA);
+    init_cfg(&b, WIFI_MODE_APSTA);
+    CHECK(cfg_changes(&a, &b) == 0);
+
+    b.mode = WIFI_MODE_STA;
+    CHECK(cfg_changes(&a, &b) == CFG_CHG_MODE);
+
+    init_cfg(&b, WIFI_MODE_APSTA);
+    b.ap.ap.channel = 11;
+    CHECK(cfg_changes(&a, &b) == CFG_CHG_AP);
+
+    init_cfg(&b, WIFI_MODE_APSTA);
+    IP4_ADDR(&(b.ap_ip_info.ip), 192, 168, 5, 1);
+    CHECK(cfg_changes(&a, &b) == CFG_CHG_AP);
+
+    init_cfg(&b, WIFI_MODE_APSTA);
+    b.sta_connect = false;
+    CHECK(cfg_changes(&a, &b) == CFG_CHG_STA);
+
+    /* Static IP settings only count if static IP is used. */
+    init_cfg(&b, WIFI_MODE_APSTA);
+    IP4_ADDR(&(b.sta_ip_info.ip), 10, 0, 0, 2);
+    CHECK(cfg_changes(&a, &b) == 0);
+
+    a.sta_static = true;
+    CHECK(cfg_changes(&a, &b) == CFG_CHG_NETIF);
+
+    b.sta_static = true;
+    CHECK(cfg_changes(&a, &b) == CFG_CHG_NETIF);
+
+    IP4_ADDR(&(a.sta_ip_info.ip), 10, 0, 0, 2);
+    CHECK(cfg_changes(&a, &b) == 0);
+}
+
+static void test_cfgs_are_equal(void)
+{
+    struct wifi_cfg a, b;
+
+    /* Changes to the AP do not matter in STA mode... */
+    init_cfg(&a, WIFI_MODE_STA);
+    init_cfg(&b, WIFI_MODE_STA);
+    set_str(b.ap.ap.ssid, sizeof(b.ap.ap.ssid), "OtherAP");
+    CHECK(cfgs_are_equal(&a, &b));
+
+    /* ...but do in APSTA mode. */
+    a.mode = WIFI_MODE_APSTA;
+    b.mode = WIFI_MODE_APSTA;
+    CHECK(!cfgs_are_equal(&a, &b));
+
+    /* Changes to the STA and its IP settings do not matter in AP mode... */
+    init_cfg(&a, WIFI_MODE_AP);
+    init_cfg(&b, WIFI_MODE_AP);
+    set_str(b.sta.sta.ssid, sizeof(b.sta.sta.ssid), "OtherNet");
+    b.sta_static = true;
+    CHECK(cfgs_are_equal(&a, &b));
+
+    /* ...but do in APSTA mode. */
+    a.mode = WIFI_MODE_APSTA;
+    b.mode = WIFI_MODE_APSTA;
+    CHECK(!cfgs_are_equal(&a, &b));
+
+    /* A mode change is never masked. */
+    init_cfg(&a, WIFI_MODE_STA);
+    init_cfg(&b, WIFI_MODE_APSTA);
+    CHECK(!cfgs_are_equal(&a, &b));
+}
+
+int main(void)
+{
+    test_ap_ssid_len();
+    test_ap_password();
+    test_ap_defaults();
+    test_sta();
+    test_cfg_changes();
+    test_cfgs_are_equal();
+
+    printf("%s: %s\n", __FILE__, host_failures ? "FAILED" : "OK");
+
+    return host_failures ? 1 : 0;
+}
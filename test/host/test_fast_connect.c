@@ -0,0 +1,132 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/*
+ * Checks that a fast connect to an AP that has moved falls back to a full
+ * channel scan without reconfiguring the AP interface. Built with
+ * CONFIG_WMNGR_FAST_CONNECT.
+ */
+
+#include "wifi_manager.c"
+
+#include "host.h"
+
+static void run_until(enum wmngr_state state, TickType_t limit)
+{
+    TickType_t start;
+
+    start = host_ticks;
+    while(esp_wmngr_get_state() != state
+          && (host_ticks - start) < limit
+          && host_timer_fire(config_timer))
+        ;
+}
+
+static void link_up(void)
+{
+    host_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, NULL);
+    host_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, NULL);
+}
+
+static void sta_cfg(struct wifi_cfg *cfg, const char *ssid, const char *pass)
+{
+    CHECK(esp_wmngr_get_cfg(cfg) == ESP_OK);
+
+    cfg->mode = WIFI_MODE_APSTA;
+    cfg->sta_connect = true;
+    memset(&(cfg->sta), 0x0, sizeof(cfg->sta));
+    memcpy(cfg->sta.sta.ssid, ssid, strlen(ssid));
+    memcpy(cfg->sta.sta.password, pass, strlen(pass));
+}
+
+/* Connect once, so the AP's BSSID and channel get recorded. */
+static void test_learn(void)
+{
+    struct wifi_cfg cfg;
+
+    memset(host_wifi.bssid, 0x42, sizeof(host_wifi.bssid));
+    host_wifi.channel = 11;
+
+    CHECK(esp_wmngr_init() == ESP_OK);
+    CHECK(esp_wmngr_start() == ESP_OK);
+    run_until(wmngr_state_idle, SCAN_TIMEOUT);
+
+    sta_cfg(&cfg, "HomeNet", "password");
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+    CHECK(!host_wifi.sta.sta.bssid_set);
+
+    link_up();
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+    CHECK(cfg_state.fast.valid);
+    CHECK(cfg_state.fast.data.channel == 11);
+}
+
+static void test_moved(void)
+{
+    struct wifi_cfg cfg;
+    unsigned int connects, restores;
+
+    /* Changing the password re-applies the STA config, using fast connect. */
+    sta_cfg(&cfg, "HomeNet", "password2");
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+
+    CHECK(cfg_state.fast.active);
+    CHECK(host_wifi.sta.sta.bssid_set);
+    CHECK(host_wifi.sta.sta.channel == 11);
+
+    connects = host_wifi.connects;
+    restores = host_wifi.restores;
+
+    /* The AP does not answer on its old channel. */
+    while(host_wifi.connects == connects
+          && (host_ticks - cfg_state.cfg_timestamp) < 2 * FAST_TIMEOUT
+          && host_timer_fire(config_timer))
+        ;
+
+    /* Only the STA has been re-applied, now without BSSID and channel. */
+    CHECK(esp_wmngr_get_state() == wmngr_state_connecting);
+    CHECK(host_wifi.connects == connects + 1);
+    CHECK(host_wifi.restores == restores);
+    CHECK(!cfg_state.fast.valid);
+    CHECK(!cfg_state.fast.active);
+    CHECK(!host_wifi.sta.sta.bssid_set);
+    CHECK(host_wifi.sta.sta.channel == 0);
+    CHECK(!memcmp(host_wifi.ap.ap.ssid, CONFIG_WMNGR_AP_SSID,
+                  strlen(CONFIG_WMNGR_AP_SSID)));
+
+    /* The full scan finds it. */
+    link_up();
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+    CHECK(cfg_state.fast.valid);
+}
+
+int main(void)
+{
+    test_learn();
+    test_moved();
+
+    printf("%s: %s\n", __FILE__, host_failures ? "FAILED" : "OK");
+
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/*
+ * Migrates a config from the version 1 key layout to a config slot and
+ * reports the NVS accesses and host time of loading and saving it. On the
+ * device, every NVS access scans the namespace's pages, so the number of
+ * accesses is what matters for the boot time. The host time only covers
+ * encoding, decoding and checksumming.
+ */
+
+#include <time.h>
+
+#include "wifi_manager.c"
+
+#include "host.h"
+
+#define BENCH_RUNS      1000
+
+static struct host_nvs nvs_start;
+static struct timespec time_start;
+
+static void bench_start(void)
+{
+    nvs_start = host_nvs;
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+}
+
+static void bench_report(const char *step, unsigned int runs)
+{
+    struct timespec now;
+    double us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - time_start.tv_sec) * 1e6
+         + (now.tv_nsec - time_start.tv_nsec) / 1e3;
+
+    printf("  %-14s %3u reads %3u writes %3u erases %3u commits %8.2f us\n",
+           step,
+           (host_nvs.reads - nvs_start.reads) / runs,
+           (host_nvs.writes - nvs_start.writes) / runs,
+           (host_nvs.erases - nvs_start.erases) / runs,
+           (host_nvs.commits - nvs_start.commits) / runs,
+           us / runs);
+}
+
+static void init_cfg(struct wifi_cfg *cfg)
+{
+    memset(cfg, 0x0, sizeof(*cfg));
+    cfg->mode = WIFI_MODE_APSTA;
+    cfg->sta_connect = true;
+    cfg->sta_static = true;
+    memcpy(cfg->ap.ap.ssid, "MyAP", 4);
+    memcpy(cfg->ap.ap.password, "secret123", 9);
+    cfg->ap.ap.authmode = WIFI_AUTH_WPA2_PSK;
+    cfg->ap.ap.channel = 6;
+    cfg->ap.ap.max_connection = MAX_AP_CLIENTS;
+    cfg->ap.ap.beacon_interval = 100;
+    memcpy(cfg->sta.sta.ssid, "HomeNet", 7);
+    memcpy(cfg->sta.sta.password, "password", 8);
+    cfg->sta.sta.listen_interval = 3;
+    IP4_ADDR(&(cfg->ap_ip_info.ip), 192, 168, 4, 1);
+    IP4_ADDR(&(cfg->ap_ip_info.gw), 192, 168, 4, 1);
+    IP4_ADDR(&(cfg->ap_ip_info.netmask), 255, 255, 255, 0);
+    IP4_ADDR(&(cfg->sta_ip_info.ip), 10, 0, 0, 2);
+    IP4_ADDR(&(cfg->sta_ip_info.gw), 10, 0, 0, 1);
+    IP4_ADDR(&(cfg->sta_ip_info.netmask), 255, 255, 255, 0);
+    cfg->sta_dns_info[0].ip.type = IPADDR_TYPE_V4;
+    IP4_ADDR(&(cfg->sta_dns_info[0].ip.u_addr.ip4), 10, 0, 0, 1);
+}
+
+/* Store cfg the way the version 1 code did. */
+static void put_legacy_config(const struct wifi_cfg *cfg)
+{
+    nvs_handle handle;
+
+    CHECK(nvs_open(WMNGR_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK);
+    CHECK(nvs_set_u32(handle, "version", NVS_CFG_VER_LEGACY) == ESP_OK);
+    CHECK(nvs_set_u32(handle, "mode", cfg->mode) == ESP_OK);
+    CHECK(nvs_set_u32(handle, "sta_static", cfg->sta_static) == ESP_OK);
+    CHECK(nvs_set_u32(handle, "sta_connect", cfg->sta_connect) == ESP_OK);
+    CHECK(nvs_set_blob(handle, "ap", &(cfg->ap), sizeof(cfg->ap)) == ESP_OK);
+    CHECK(nvs_set_blob(handle, "sta", &(cfg->sta), sizeof(cfg->sta))
+          == ESP_OK);
+    CHECK(nvs_set_blob(handle, "ap_ip", &(cfg->ap_ip_info),
+                       sizeof(cfg->ap_ip_info)) == ESP_OK);
+    CHECK(nvs_set_blob(handle, "sta_ip", &(cfg->sta_ip_info),
+                       sizeof(cfg->sta_ip_info)) == ESP_OK);
+    CHECK(nvs_set_blob(handle, "sta_dns", &(cfg->sta_dns_info),
+                       sizeof(cfg->sta_dns_info)) == ESP_OK);
+    CHECK(nvs_commit(handle) == ESP_OK);
+    nvs_close(handle);
+}
+
+static bool has_key(const char *key)
+{
+    nvs_handle handle;
+    size_t len;
+    bool result;
+
+    CHECK(nvs_open(WMNGR_NAMESPACE, NVS_READONLY, &handle) == ESP_OK);
+    result = (nvs_get_blob(handle, key, NULL, &len) == ESP_OK);
+    nvs_close(handle);
+
+    return result;
+}
+
+static bool cfg_read_back(const struct wifi_cfg *a, const struct wifi_cfg *b)
+{
+    return a->mode == b->mode
+           && a->sta_static == b->sta_static
+           && a->sta_connect == b->sta_connect
+           && ap_cfgs_are_equal(&(a->ap.ap), &(b->ap.ap))
+           && sta_cfgs_are_equal(&(a->sta.sta), &(b->sta.sta))
+           && ip_infos_are_equal(&(a->ap_ip_info), &(b->ap_ip_info))
+           && ip_infos_are_equal(&(a->sta_ip_info), &(b->sta_ip_info))
+           && !memcmp(&(a->sta_dns_info), &(b->sta_dns_info),
+                      sizeof(a->sta_dns_info));
+}
+
+static void test_migrate(void)
+{
+    struct nvs_cfg_desc desc;
+    struct wifi_cfg cfg, tmp;
+
+    init_cfg(&cfg);
+    put_legacy_config(&cfg);
+
+    bench_start();
+    CHECK(get_saved_config(&tmp, &desc) == ESP_OK);
+    bench_report("load v1", 1);
+
+    CHECK(cfg_read_back(&tmp, &cfg));
+    CHECK(desc.present && desc.version == NVS_CFG_VER_LEGACY);
+    CHECK(desc.slot == NVS_SLOT_NONE);
+
+    /* Loads the version 1 config, the first save moves it to a slot. */
+    CHECK(esp_wmngr_init() == ESP_OK);
+    CHECK(cfg_state.nvs.version == NVS_CFG_VER_LEGACY);
+
+    bench_start();
+    CHECK(save_config(&tmp) == ESP_OK);
+    bench_report("migrate", 1);
+
+    CHECK(cfg_state.nvs.version == NVS_CFG_VER);
+    CHECK(!has_key("version"));
+    CHECK(!has_key("sta_dns"));
+
+    bench_start();
+    CHECK(get_saved_config(&tmp, &desc) == ESP_OK);
+    bench_report("load slot", 1);
+
+    CHECK(cfg_read_back(&tmp, &cfg));
+    CHECK(desc.present && desc.version == NVS_CFG_VER);
+    CHECK(desc.slot == cfg_state.nvs.slot);
+}
+
+static void test_bench(void)
+{
+    struct wifi_cfg cfg;
+    unsigned int idx, saves;
+
+    init_cfg(&cfg);
+
+    bench_start();
+    for(idx = 0; idx < BENCH_RUNS; ++idx){
+        CHECK(get_saved_config(&cfg, NULL) == ESP_OK);
+    }
+    bench_report("load", BENCH_RUNS);
+
+    /* Every save changes the config, so every save gets written. */
+    saves = cfg_state.flash_stats.saves;
+    bench_start();
+    for(idx = 0; idx < BENCH_RUNS; ++idx){
+        cfg.ap.ap.channel = 1 + (idx % 11);
+        CHECK(save_config(&cfg) == ESP_OK);
+    }
+    bench_report("save", BENCH_RUNS);
+    CHECK(cfg_state.flash_stats.saves == saves + BENCH_RUNS);
+
+    /* Saving it again does not touch the flash. */
+    bench_start();
+    CHECK(save_config(&cfg) == ESP_OK);
+    bench_report("save same", 1);
+    CHECK(host_nvs.writes == nvs_start.writes);
+}
+
+int main(void)
+{
+    test_migrate();
+    test_bench();
+
+    printf("%s: %s\n", __FILE__, host_failures ? "FAILED" : "OK");
+
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,495 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/*
+ * Drives handle_wifi() through connecting to an AP, losing and regaining
+ * the link, saving the config, changing the AP's address, falling back
+ * from a config that does not connect or gets rejected by the AP, waiting
+ * for a slow DHCP server and scanning. Reports the virtual time and number
+ * of state machine runs each step took.
+ *
+ * Also built with CONFIG_WMNGR_STATIC_ALLOC as test_state_machine_static,
+ * which checks that nothing gets allocated from the heap after
+ * esp_wmngr_init().
+ */
+
+#include "wifi_manager.c"
+
+#include "host.h"
+
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+/*
+ * The test gets linked with --wrap for the heap functions, so all calls
+ * made by the WiFi Manager end up here. Counting starts once it has been
+ * initialised.
+ */
+static bool heap_armed;
+static unsigned int heap_calls;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    heap_calls += heap_armed;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size)
+{
+    heap_calls += heap_armed;
+    return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    heap_calls += heap_armed;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    heap_calls += heap_armed;
+    __real_free(ptr);
+}
+#endif /* defined(CONFIG_WMNGR_STATIC_ALLOC) */
+
+/* Start of the step being measured. */
+static TickType_t step_ticks;
+static uint32_t step_runs;
+
+static void step_start(void)
+{
+    step_ticks = host_ticks;
+    step_runs = esp_wmngr_get_run_count();
+}
+
+static void step_report(const char *step)
+{
+    printf("  %-12s %6u ms %4u runs\n", step,
+           (unsigned int) ((host_ticks - step_ticks) * portTICK_PERIOD_MS),
+           (unsigned int) (esp_wmngr_get_run_count() - step_runs));
+}
+
+/*
+ * Keep firing the config timer until the state machine reaches the given
+ * state, the timer is no longer armed or limit ticks have passed.
+ */
+static void run_until(enum wmngr_state state, TickType_t limit)
+{
+    TickType_t start;
+
+    start = host_ticks;
+    while(esp_wmngr_get_state() != state
+          && (host_ticks - start) < limit
+          && host_timer_fire(config_timer))
+        ;
+}
+
+/* Keep firing the config timer for limit ticks or until it is disarmed. */
+static void run_for(TickType_t limit)
+{
+    TickType_t start;
+
+    start = host_ticks;
+    while((host_ticks - start) < limit && host_timer_fire(config_timer))
+        ;
+}
+
+static void link_up(void)
+{
+    host_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, NULL);
+    host_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, NULL);
+}
+
+static void sta_disconnected(uint8_t reason)
+{
+    wifi_event_sta_disconnected_t event;
+
+    memset(&event, 0x0, sizeof(event));
+    memcpy(event.ssid, host_wifi.sta.sta.ssid, sizeof(event.ssid));
+    event.ssid_len = strnlen((char *) event.ssid, sizeof(event.ssid));
+    event.reason = reason;
+
+    host_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event);
+}
+
+static void link_down(void)
+{
+    host_event_post(IP_EVENT, IP_EVENT_STA_LOST_IP, NULL);
+    sta_disconnected(WIFI_REASON_BEACON_TIMEOUT);
+}
+
+static void sta_cfg(struct wifi_cfg *cfg, const char *ssid, const char *pass)
+{
+    CHECK(esp_wmngr_get_cfg(cfg) == ESP_OK);
+
+    cfg->mode = WIFI_MODE_APSTA;
+    cfg->sta_connect = true;
+    memset(&(cfg->sta), 0x0, sizeof(cfg->sta));
+    memcpy(cfg->sta.sta.ssid, ssid, strlen(ssid));
+    memcpy(cfg->sta.sta.password, pass, strlen(pass));
+}
+
+static void test_start(void)
+{
+    CHECK(esp_wmngr_init() == ESP_OK);
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    heap_armed = true;
+#endif
+    CHECK(esp_wmngr_get_state() == wmngr_state_stopped);
+    CHECK(!esp_wmngr_nvs_valid());
+
+    /* Without a saved config, the defaults get applied. */
+    step_start();
+    CHECK(esp_wmngr_start() == ESP_OK);
+    run_until(wmngr_state_idle, SCAN_TIMEOUT);
+    step_report("start");
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_idle);
+    CHECK(host_wifi.started);
+    CHECK(host_wifi.mode == WIFI_MODE_APSTA);
+    CHECK(!memcmp(host_wifi.ap.ap.ssid, CONFIG_WMNGR_AP_SSID,
+                  strlen(CONFIG_WMNGR_AP_SSID)));
+    CHECK(host_wifi.connects == 0);
+}
+
+static void test_connect(void)
+{
+    const struct wifi_cfg *snap, *snap2;
+    struct wifi_cfg cfg;
+    unsigned int connects;
+    uint32_t gen, gen2;
+
+    sta_cfg(&cfg, "HomeNet", "password");
+    connects = host_wifi.connects;
+
+    step_start();
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_connecting);
+    CHECK(!strcmp((char *) host_wifi.sta.sta.ssid, "HomeNet"));
+    CHECK(host_wifi.connects == connects + 1);
+
+    snap = esp_wmngr_get_cfg_snap(&gen);
+    CHECK(snap != NULL && !snap->is_valid);
+
+    /* The AP answers after two seconds. */
+    host_ticks += pdMS_TO_TICKS(2000);
+    link_up();
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+    step_report("connect");
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+
+    /* Snapshots held by readers do not change, a new one gets published. */
+    snap2 = esp_wmngr_get_cfg_snap(&gen2);
+    CHECK(snap != NULL && !snap->is_valid);
+    CHECK(snap2 != NULL && snap2->is_valid && gen2 != gen);
+    esp_wmngr_put_cfg_snap(snap2);
+    esp_wmngr_put_cfg_snap(snap);
+
+    /* The working config gets saved once it has been stable a while. */
+    step_start();
+    while(!esp_wmngr_nvs_valid()
+          && (host_ticks - step_ticks) < 2 * SAVE_DELAY
+          && host_timer_fire(config_timer))
+        ;
+    step_report("save");
+
+    CHECK(esp_wmngr_nvs_valid());
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+}
+
+static void test_link_drop(void)
+{
+    unsigned int connects;
+
+    connects = host_wifi.connects;
+
+    step_start();
+    link_down();
+    run_until(wmngr_state_reconnecting, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_reconnecting);
+
+    /* The driver gets asked to reconnect after backing off. */
+    while(host_wifi.connects == connects
+          && (host_ticks - step_ticks) < SCAN_TIMEOUT
+          && host_timer_fire(config_timer))
+        ;
+    CHECK(host_wifi.connects == connects + 1);
+
+    link_up();
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+    step_report("reconnect");
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+}
+
+static void test_ap_ip(void)
+{
+    struct wifi_cfg cfg;
+    esp_netif_ip_info_t ip_info;
+    unsigned int connects, starts;
+
+    CHECK(esp_wmngr_get_cfg(&cfg) == ESP_OK);
+    IP4_ADDR(&(cfg.ap_ip_info.ip), 10, 10, 0, 1);
+    IP4_ADDR(&(cfg.ap_ip_info.gw), 10, 10, 0, 1);
+    IP4_ADDR(&(cfg.ap_ip_info.netmask), 255, 255, 0, 0);
+
+    connects = host_wifi.connects;
+    starts = host_dhcps_starts;
+
+    step_start();
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_update, SCAN_TIMEOUT);
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+    step_report("ap ip");
+
+    /* The AP's address changed, the STA connection was left alone. */
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+    CHECK(esp_netif_get_ip_info(ap_netif, &ip_info) == ESP_OK);
+    CHECK(ip_infos_are_equal(&ip_info, &(cfg.ap_ip_info)));
+    CHECK(host_dhcps_starts == starts + 1);
+    CHECK(host_wifi.connects == connects);
+}
+
+/*
+ * The config read back from the driver must compare equal to the one
+ * applied, or every readback of a non-default AP address would trigger
+ * another update.
+ */
+static void test_ap_ip_readback(void)
+{
+    struct wifi_cfg cfg;
+    unsigned int connects, starts;
+
+    CHECK(get_wifi_cfg(&cfg) == ESP_OK);
+    CHECK(cfg_changes(&cfg, &(cfg_state.current->cfg)) == 0);
+
+    connects = host_wifi.connects;
+    starts = host_dhcps_starts;
+
+    CHECK(esp_wmngr_get_cfg(&cfg) == ESP_OK);
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_update, SCAN_TIMEOUT);
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+    CHECK(host_dhcps_starts == starts);
+    CHECK(host_wifi.connects == connects);
+}
+
+static void test_fallback(void)
+{
+    struct wifi_cfg cfg;
+
+    /* Nobody answers for this one. */
+    sta_cfg(&cfg, "NoSuchNet", "password");
+
+    step_start();
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_connecting);
+    CHECK(!strcmp((char *) host_wifi.sta.sta.ssid, "NoSuchNet"));
+
+    run_until(wmngr_state_failed, 2 * CFG_TIMEOUT);
+    step_report("fallback");
+
+    /* The previous, working config has been restored. */
+    CHECK(esp_wmngr_get_state() == wmngr_state_failed);
+    CHECK(!strcmp((char *) host_wifi.sta.sta.ssid, "HomeNet"));
+}
+
+/*
+ * The AP turns down the password. The driver reports this right away, but
+ * the config still only gets dropped once the connect timeout has passed.
+ */
+static void test_auth_fail(void)
+{
+    struct wifi_cfg cfg;
+
+    sta_cfg(&cfg, "HomeNet", "wrongpass");
+
+    step_start();
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_connecting);
+    CHECK(!strcmp((char *) host_wifi.sta.sta.password, "wrongpass"));
+
+    host_ticks += pdMS_TO_TICKS(500);
+    sta_disconnected(WIFI_REASON_AUTH_FAIL);
+    run_until(wmngr_state_failed, 2 * CFG_TIMEOUT);
+    step_report("auth fail");
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_failed);
+    CHECK(!strcmp((char *) host_wifi.sta.sta.password, "password"));
+}
+
+/*
+ * Every request reports its own result: superseded ones as replaced, the
+ * others only once the connection has either been made or failed.
+ */
+static void test_tickets(void)
+{
+    struct wifi_cfg cfg;
+    uint32_t t1, t2, t3;
+
+    sta_cfg(&cfg, "HomeNet2", "password");
+    CHECK(esp_wmngr_submit_cfg(&cfg, &t1) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_connecting);
+
+    /* Queued while busy, the second one replaces the first. */
+    sta_cfg(&cfg, "NetA", "password");
+    CHECK(esp_wmngr_submit_cfg(&cfg, &t2) == ESP_OK);
+    sta_cfg(&cfg, "NetB", "password");
+    CHECK(esp_wmngr_submit_cfg(&cfg, &t3) == ESP_OK);
+
+    /* Waiters get woken up although other requests are still pending. */
+    CHECK(xEventGroupGetBits(wifi_events) & BIT_CMD_DONE);
+
+    CHECK(esp_wmngr_wait_ticket(t1, 0) == ESP_ERR_TIMEOUT);
+    CHECK(esp_wmngr_wait_ticket(t2, 0) == ESP_ERR_INVALID_STATE);
+    CHECK(esp_wmngr_wait_ticket(t3, 0) == ESP_ERR_TIMEOUT);
+
+    /* The first one connects, then the queued one gets applied. */
+    link_up();
+    run_until(wmngr_state_update, SCAN_TIMEOUT);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+    CHECK(!strcmp((char *) host_wifi.sta.sta.ssid, "NetB"));
+    CHECK(esp_wmngr_wait_ticket(t1, 0) == ESP_OK);
+    CHECK(esp_wmngr_wait_ticket(t3, 0) == ESP_ERR_TIMEOUT);
+
+    /* Nobody answers, so it fails. */
+    run_until(wmngr_state_failed, 2 * CFG_TIMEOUT);
+    CHECK(esp_wmngr_wait_ticket(t3, 0) == ESP_FAIL);
+    CHECK(esp_wmngr_wait_ticket(t1, 0) == ESP_OK);
+    CHECK(esp_wmngr_wait_ticket(t3 + 1, 0) == ESP_ERR_INVALID_ARG);
+}
+
+/*
+ * Associating works, but the DHCP server takes its time. The association
+ * is what counts as connected, so the state machine must neither prod the
+ * driver nor drop the config while the address is missing.
+ */
+static void test_slow_dhcp(void)
+{
+    struct wifi_cfg cfg;
+    unsigned int connects, disconnects;
+
+    sta_cfg(&cfg, "SlowNet", "password");
+
+    step_start();
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_connecting);
+    connects = host_wifi.connects;
+    disconnects = host_wifi.disconnects;
+
+    host_ticks += pdMS_TO_TICKS(1000);
+    host_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, NULL);
+
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+
+    /* No address for five seconds. */
+    run_for(pdMS_TO_TICKS(5000));
+    host_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, NULL);
+    run_for(CFG_DELAY);
+    step_report("slow dhcp");
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+    CHECK(host_wifi.connects == connects);
+    CHECK(host_wifi.disconnects == disconnects);
+}
+
+static void test_scan(void)
+{
+    struct scan_data *data;
+    wifi_event_sta_scan_done_t done;
+    unsigned int idx, scans;
+
+    host_wifi.num_scan_aps = 3;
+    for(idx = 0; idx < host_wifi.num_scan_aps; ++idx){
+        memset(&(host_wifi.scan_aps[idx]), 0x0, sizeof(host_wifi.scan_aps[0]));
+        snprintf((char *) host_wifi.scan_aps[idx].ssid,
+                 sizeof(host_wifi.scan_aps[idx].ssid), "AP%u", idx);
+        memset(host_wifi.scan_aps[idx].bssid, idx + 1,
+               sizeof(host_wifi.scan_aps[idx].bssid));
+        host_wifi.scan_aps[idx].primary = 1 + idx;
+        host_wifi.scan_aps[idx].rssi = -50 - idx;
+    }
+
+    scans = host_wifi.scans;
+
+    step_start();
+    CHECK(esp_wmngr_start_scan() == ESP_OK);
+    while(host_wifi.scans == scans
+          && (host_ticks - step_ticks) < SCAN_TIMEOUT
+          && host_timer_fire(config_timer))
+        ;
+    CHECK(host_wifi.scans == scans + 1);
+
+    memset(&done, 0x0, sizeof(done));
+    done.number = host_wifi.num_scan_aps;
+    step_report("scan start");
+
+    /* The results are collected on the state machine's next run. */
+    step_start();
+    host_event_post(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &done);
+    while((xEventGroupGetBits(wifi_events) & BIT_SCAN_DONE)
+          && (host_ticks - step_ticks) < SCAN_TIMEOUT
+          && host_timer_fire(config_timer))
+        ;
+    step_report("scan done");
+
+    data = esp_wmngr_get_scan();
+    CHECK(data != NULL && data->num_records == host_wifi.num_scan_aps);
+    if(data != NULL){
+        esp_wmngr_put_scan(data);
+    }
+}
+
+int main(void)
+{
+    test_start();
+    test_connect();
+    test_link_drop();
+    test_ap_ip();
+    test_ap_ip_readback();
+    test_fallback();
+    test_auth_fail();
+    test_tickets();
+    test_slow_dhcp();
+    test_scan();
+
+#if defined(CONFIG_WMNGR_STATIC_ALLOC)
+    heap_armed = false;
+    printf("  heap calls after init: %u\n", heap_calls);
+    CHECK(heap_calls == 0);
+#endif
+
+    printf("%s: %s\n", __FILE__, host_failures ? "FAILED" : "OK");
+
+    return host_failures ? 1 : 0;
+}
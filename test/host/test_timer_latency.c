@@ -0,0 +1,177 @@
+/*
+ * This file is part of the ESP WiFi Manager project.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/*
+ * Reports how long the timer call back blocks the timer service task while
+ * starting, applying a config and saving it. Built as test_timer_latency,
+ * running the slow jobs in the call back, and with CONFIG_WMNGR_WORKER as
+ * test_timer_latency_worker, handing them to the worker task.
+ *
+ * The run times of the driver and NVS calls are modelled by the stubs, see
+ * struct host_cost. The numbers below are rough guesses for an ESP32, not
+ * measurements, so only compare the two builds with each other.
+ */
+
+#include "wifi_manager.c"
+
+#include "host.h"
+
+/* Longest single run of the worker, measured like the timer's. */
+static uint32_t worker_max_us;
+
+/* Longest timer run over all steps. */
+static uint32_t timer_max_us;
+
+static void set_costs(void)
+{
+    host_cost.wifi_start = 80000;
+    host_cost.wifi_stop = 30000;
+    host_cost.wifi_set_config = 2000;
+    host_cost.nvs_write = 10000;
+    host_cost.nvs_commit = 5000;
+}
+
+/*
+ * Run the worker if it has a job waiting, otherwise fire the config timer.
+ * Returns false if there was nothing to do.
+ */
+static bool step(void)
+{
+#if defined(CONFIG_WMNGR_WORKER)
+    int64_t start;
+    uint32_t duration;
+
+    if(xEventGroupGetBits(wifi_events) & BIT_JOB){
+        xEventGroupClearBits(wifi_events, BIT_JOB);
+
+        start = esp_timer_get_time();
+        worker_run();
+        duration = (uint32_t) (esp_timer_get_time() - start);
+        if(duration > worker_max_us){
+            worker_max_us = duration;
+        }
+
+        return true;
+    }
+#endif
+
+    return host_timer_fire(config_timer);
+}
+
+static void run_until(enum wmngr_state state, TickType_t limit)
+{
+    TickType_t start;
+
+    start = host_ticks;
+    while(esp_wmngr_get_state() != state
+          && (host_ticks - start) < limit
+          && step())
+        ;
+}
+
+static void step_start(void)
+{
+    cfg_state.timer_max_us = 0;
+    worker_max_us = 0;
+}
+
+static void step_report(const char *step)
+{
+    timer_max_us = MAX(timer_max_us, esp_wmngr_get_timer_max());
+    printf("  %-8s timer max %7u us   worker max %7u us\n", step,
+           esp_wmngr_get_timer_max(), worker_max_us);
+}
+
+static void test_start(void)
+{
+    CHECK(esp_wmngr_init() == ESP_OK);
+
+    step_start();
+    CHECK(esp_wmngr_start() == ESP_OK);
+    run_until(wmngr_state_idle, SCAN_TIMEOUT);
+    step_report("start");
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_idle);
+    CHECK(host_wifi.started);
+}
+
+static void test_apply(void)
+{
+    struct wifi_cfg cfg;
+
+    CHECK(esp_wmngr_get_cfg(&cfg) == ESP_OK);
+    cfg.mode = WIFI_MODE_APSTA;
+    cfg.sta_connect = true;
+    memset(&(cfg.sta), 0x0, sizeof(cfg.sta));
+    memcpy(cfg.sta.sta.ssid, "HomeNet", strlen("HomeNet"));
+    memcpy(cfg.sta.sta.password, "password", strlen("password"));
+
+    step_start();
+    CHECK(esp_wmngr_set_cfg(&cfg) == ESP_OK);
+    run_until(wmngr_state_connecting, SCAN_TIMEOUT);
+    CHECK(esp_wmngr_get_state() == wmngr_state_connecting);
+
+    host_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, NULL);
+    host_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, NULL);
+    run_until(wmngr_state_connected, SCAN_TIMEOUT);
+    step_report("apply");
+
+    CHECK(esp_wmngr_get_state() == wmngr_state_connected);
+}
+
+static void test_save(void)
+{
+    TickType_t start;
+
+    step_start();
+    start = host_ticks;
+    while(!esp_wmngr_nvs_valid()
+          && (host_ticks - start) < 2 * SAVE_DELAY
+          && step())
+        ;
+    step_report("save");
+
+    CHECK(esp_wmngr_nvs_valid());
+}
+
+int main(void)
+{
+    set_costs();
+
+#if defined(CONFIG_WMNGR_WORKER)
+    printf("  jobs run in the worker task\n");
+#else
+    printf("  jobs run in the timer call back\n");
+#endif
+
+    test_start();
+    test_apply();
+    test_save();
+
+    /* Slow jobs must block the timer only if there is no worker. */
+#if defined(CONFIG_WMNGR_WORKER)
+    CHECK(timer_max_us < host_cost.wifi_set_config);
+#else
+    CHECK(timer_max_us >= host_cost.wifi_start);
+#endif
+
+    printf("%s: %s\n", __FILE__, host_failures ? "FAILED" : "OK");
+
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+#
+# This file is part of the ESP WiFi Manager project.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+"""Decode the output of esp_wmngr_dump_trace() into a timeline.
+
+Reads a serial log from the given file or stdin and prints one line per
+trace record found in it.
+
+    wmngr_trace.py [--tick-ms N] [log]
+"""
+
+import argparse
+import re
+import sys
+
+# Must match enum wmngr_state in include/wifi_manager.h
+STATES = [
+    "Deinit", "Stopped", "Failed", "Connected", "Idle", "Update",
+    "WPS Start", "WPS Active", "Connecting", "Disconnecting", "Fall Back",
+    "Reconnecting",
+]
+
+# Must match the BIT_* event bits in src/wifi_manager.c
+EVENT_BITS = [
+    "TRIGGER", "STA_START", "STA_CONNECTED", "STA_GOT_IP", "AP_START",
+    "SCAN_START", "SCAN_RUNNING", "SCAN_DONE", "WPS_SUCCESS", "WPS_FAILED",
+    "STOPPED", "JOB", "CMD_DONE",
+]
+
+WIFI_EVENTS = [
+    "WIFI_READY", "SCAN_DONE", "STA_START", "STA_STOP", "STA_CONNECTED",
+    "STA_DISCONNECTED", "STA_AUTHMODE_CHANGE", "STA_WPS_ER_SUCCESS",
+    "STA_WPS_ER_FAILED", "STA_WPS_ER_TIMEOUT", "STA_WPS_ER_PIN",
+    "STA_WPS_ER_PBC_OVERLAP", "AP_START", "AP_STOP", "AP_STACONNECTED",
+    "AP_STADISCONNECTED", "AP_PROBEREQRECVED",
+]
+
+IP_EVENTS = [
+    "STA_GOT_IP", "STA_LOST_IP", "AP_STAIPASSIGNED", "GOT_IP6", "ETH_GOT_IP",
+]
+
+RESET_REASONS = [
+    "UNKNOWN", "POWERON", "EXT", "SW", "PANIC", "INT_WDT", "TASK_WDT", "WDT",
+    "DEEPSLEEP", "BROWNOUT", "SDIO",
+]
+
+ERRORS = {
+    -1: "ESP_FAIL",
+    0x101: "ESP_ERR_NO_MEM",
+    0x102: "ESP_ERR_INVALID_ARG",
+    0x103: "ESP_ERR_INVALID_STATE",
+    0x104: "ESP_ERR_INVALID_SIZE",
+    0x105: "ESP_ERR_NOT_FOUND",
+    0x106: "ESP_ERR_NOT_SUPPORTED",
+    0x107: "ESP_ERR_TIMEOUT",
+}
+
+TRACE_RE = re.compile(r"trace ((?:[0-9a-fA-F]+ ){7}[0-9a-fA-F]+)\s*$")
+
+# Colour codes added by ESP-IDF's logging with CONFIG_LOG_COLORS
+ANSI_RE = re.compile(r"\x1b\[[0-9;]*m")
+
+
+def name(table, idx):
+    return table[idx] if 0 <= idx < len(table) else "0x%x" % idx
+
+
+def bits(val):
+    names = [n for i, n in enumerate(EVENT_BITS) if val & (1 << i)]
+    return "|".join(names) if names else "-"
+
+
+def error(val):
+    if val & 0x80000000:
+        val -= 1 << 32
+    return ERRORS.get(val, "0x%x" % val)
+
+
+def describe(kind, old, new, base, err):
+    if kind == 0:
+        return "boot, reset reason %s" % name(RESET_REASONS, err)
+    if kind == 1:
+        return "state %s -> %s" % (name(STATES, old), name(STATES, new))
+    if kind == 2:
+        if base == 1:
+            return "event IP_EVENT_%s" % name(IP_EVENTS, err)
+        return "event WIFI_EVENT_%s" % name(WIFI_EVENTS, err)
+    if kind == 3:
+        return "error %s in state %s" % (error(err), name(STATES, old))
+    return "unknown record kind %d" % kind
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log", nargs="?", type=argparse.FileType("r"),
+                        default=sys.stdin, help="serial log, default stdin")
+    parser.add_argument("--tick-ms", type=int, default=10,
+                        help="FreeRTOS tick period in ms, default 10")
+    args = parser.parse_args()
+
+    for line in args.log:
+        match = TRACE_RE.search(ANSI_RE.sub("", line))
+        if match is None:
+            continue
+
+        fields = [int(f, 16) for f in match.group(1).split()]
+        seq, tick, kind, old, new, base, events, err = fields
+
+        print("%8u %10u ms  %-48s %s"
+              % (seq, tick * args.tick_ms,
+                 describe(kind, old, new, base, err), bits(events)))
+
+
+if __name__ == "__main__":
+    main()